@@ -2,70 +2,139 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 // Define Instruction Memory Size (1024 * 16 bits = 1024 words, 16 bits per word)
 #define INSTRUCTION_MEMORY_SIZE 1024
 #define INSTRUCTION_MEMORY_WIDTH 16                   // 16 bits per word
-uint16_t instruction_memory[INSTRUCTION_MEMORY_SIZE]; // Instruction memory (word-addressable)
 
 // Define Data Memory Size (2048 * 8 bits = 2048 words, 8 bits per word)
 #define DATA_MEMORY_SIZE 2048
 #define DATA_MEMORY_WIDTH 8           // 8 bits per word (1 byte per word)
-int8_t data_memory[DATA_MEMORY_SIZE]; // Data memory (byte/word addressable)
-int skipped = 0;                      // Flag to indicate if the instruction was skipped
 
 // At the top, define a NOP instruction value
 #define NOP_INSTR 0xFFFF
 
-// Function to load instruction into memory
-void load_instruction(uint16_t address, uint16_t value)
+// Execution counters for --profile; build with -DPROFILE_COUNTERS=0 to take
+// them out of the pipeline loop entirely
+#ifndef PROFILE_COUNTERS
+#define PROFILE_COUNTERS 1
+#endif
+
+// SREG is worked out only when something looks at it; build with
+// -DLAZY_FLAGS=0 to update it on every ALU instruction instead
+#ifndef LAZY_FLAGS
+#define LAZY_FLAGS 1
+#endif
+
+// Trace levels, from quietest to most verbose
+typedef enum
 {
-    if (address < INSTRUCTION_MEMORY_SIZE)
-    {
-        instruction_memory[address] = value;
-    }
-    else
-    {
-        printf("Error: Instruction memory address out of range\n");
-    }
-}
+    TRACE_NONE = 0,    // No output at all (fastest)
+    TRACE_SUMMARY = 1, // Header and final register/memory state only
+    TRACE_CYCLE = 2,   // Summary + IF/ID/EX contents of every cycle
+    TRACE_FULL = 3     // Cycle trace + per-instruction EX stage details
+} TraceLevel;
 
-// Function to load data into memory
-void load_data(uint16_t address, uint8_t value)
+// Trace output is formatted into one large reusable buffer and written in bulk
+// to the buffer's stream. Every machine owns one, so machines running on
+// different threads never share output state.
+#define TRACE_BUFFER_SIZE (1 << 16)
+typedef struct
 {
-    if (address < DATA_MEMORY_SIZE)
-    {
-        data_memory[address] = value;
-    }
-    else
+    TraceLevel level;
+    FILE *out;
+    size_t length;
+    char buffer[TRACE_BUFFER_SIZE];
+} TraceBuffer;
+
+// Write out everything collected in the trace buffer
+void trace_flush(TraceBuffer *trace)
+{
+    if (trace->length > 0)
     {
-        printf("Error: Data memory address out of range\n");
+        fwrite(trace->buffer, 1, trace->length, trace->out);
+        trace->length = 0;
     }
+    fflush(trace->out);
 }
 
-// Function to print an instruction memory block
-void print_instruction_memory()
+// printf-style append to the trace buffer, flushing when it is full
+void trace_printf(TraceBuffer *trace, const char *format, ...)
 {
-    printf("Instruction Memory (16-bit words):\n");
-    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
+    va_list args;
+    size_t space = TRACE_BUFFER_SIZE - trace->length;
+
+    va_start(args, format);
+    int written = vsnprintf(trace->buffer + trace->length, space, format, args);
+    va_end(args);
+    if (written < 0)
+        return;
+
+    if ((size_t)written >= space)
     {
-        printf("Address %3d: 0x%04X\n", i, instruction_memory[i]);
+        // Did not fit: flush and format again at the start of the buffer
+        trace_flush(trace);
+        va_start(args, format);
+        written = vsnprintf(trace->buffer, TRACE_BUFFER_SIZE, format, args);
+        va_end(args);
+        if (written < 0 || (size_t)written >= TRACE_BUFFER_SIZE)
+        {
+            // Larger than the whole buffer: write it directly
+            va_start(args, format);
+            vfprintf(trace->out, format, args);
+            va_end(args);
+            return;
+        }
     }
+    trace->length += written;
 }
 
-// Function to print a data memory block
-void print_data_memory()
+// Only format the message when the machine's trace level asks for it
+#define TRACE(m, min_level, ...)                       \
+    do                                                 \
+    {                                                  \
+        if ((m)->trace.level >= (min_level))           \
+            trace_printf(&(m)->trace, __VA_ARGS__);    \
+    } while (0)
+
+// Parse a trace level name (none, summary, cycle, full); returns -1 if unknown
+int parse_trace_level(const char *name)
 {
-    printf("Data Memory (8-bit words):\n");
-    for (int i = 0; i < DATA_MEMORY_SIZE; i++)
-    {
-        printf("Address %4d: 0x%02X\n", i, data_memory[i]);
-    }
+    if (strcmp(name, "none") == 0)
+        return TRACE_NONE;
+    if (strcmp(name, "summary") == 0)
+        return TRACE_SUMMARY;
+    if (strcmp(name, "cycle") == 0)
+        return TRACE_CYCLE;
+    if (strcmp(name, "full") == 0)
+        return TRACE_FULL;
+    return -1;
 }
 
 // General Purpose Registers (R0 to R63): 8-bit each
 #define NUM_GPRS 64
-int8_t GPR[NUM_GPRS]; // R0 to R63
 
 // Status Register (SREG): 8 bits (only 5 bits used)
 typedef struct
@@ -78,8 +147,6 @@ typedef struct
     uint8_t reserved : 3; // Bits 5-7 always 0
 } SREG_t;
 
-SREG_t SREG;
-
 int8_t convert_6bit_twos_to_8bit(uint8_t value)
 {
     // Mask to extract only the lower 6 bits
@@ -169,8 +236,20 @@ void updateZeroFlag(SREG_t *sreg, int8_t result)
     }
 }
 
-// Program Counter (PC): 16-bit
-uint16_t PC = 0;
+#if LAZY_FLAGS
+// No instruction reads SREG, so the ALU instructions only record what the
+// flags are computed from: C comes from the last ADD, V and S from the last
+// ADD or SUB, N and Z from the last flag-writing instruction of any kind.
+// machine_sreg() turns the record into the SREG bits.
+typedef struct
+{
+    uint16_t carry_sum;           // unsigned sum of the last ADD
+    int8_t vs_a, vs_b, vs_result; // operands and result of the last ADD/SUB
+    int16_t nz_result;            // last result (-256 for N = Z = 1)
+} FlagState;
+#else
+typedef SREG_t FlagState;
+#endif
 
 // Helper macros to extract fields from a 16-bit instruction
 #define OPCODE(instr) (((instr) >> 12) & 0b00001111)  // bits 15–12
@@ -178,6 +257,11 @@ uint16_t PC = 0;
 #define R2_INDEX(instr) ((instr) & 0b00111111)        // bits 5–0
 #define IMM_VALUE(instr) ((instr) & 0b00111111)       // bits 5–0
 
+// SAL/SAR shift the register as a 32-bit int, and shift counts of 32..63 wrap
+// around the way the x86 shift instruction does. Masking makes that explicit
+// (and well defined) so every execution engine agrees on the result.
+#define SHIFT_COUNT(immshift) ((immshift) & 31)
+
 int8_t extract_6bit_to_8bit(uint16_t instr, int is_unsigned) {
     int8_t imm6 = IMM_VALUE(instr);  // extract bits [5:0]
     if (!is_unsigned && (imm6 & 0b00100000)) {
@@ -196,35 +280,339 @@ typedef struct
     int8_t imm;
 } DecodedInstruction;
 
+typedef struct Machine Machine;
+
+// Per-opcode EX handler used by the threaded and JIT engines
+typedef void (*ExecuteHandler)(Machine *m, const DecodedInstruction *instruction);
+
+typedef enum
+{
+    ENGINE_SWITCH,   // execute_instruction()
+    ENGINE_THREADED, // per-instruction handler pointers
+    ENGINE_JIT,      // native basic blocks, threaded handlers elsewhere
+    ENGINE_MEMO      // memoized basic blocks, threaded handlers elsewhere
+} ExecutionEngine;
+
+struct JitCache;
+struct MemoCache;
+struct SnapshotPage;
+struct SnapshotCode;
+struct TraceRecorder;
+struct BranchPredictor;
+struct DataCache;
+struct PipelineModel;
+
+// Counters collected by pipeline_run while Machine.profile is set
+typedef struct
+{
+    unsigned long long cycles;
+    unsigned long long ex_idle;      // cycles with a NOP in EX
+    unsigned long long flush_cycles; // cycles lost to the skipped countdown
+    unsigned long long flushes;      // BEQZ that started a flush, and BR
+    unsigned long long opcode[12];
+    unsigned long long pc[INSTRUCTION_MEMORY_SIZE];
+    unsigned long long beqz_taken[INSTRUCTION_MEMORY_SIZE];
+    unsigned long long br_target[INSTRUCTION_MEMORY_SIZE];
+    unsigned long long br_outside; // BR targets past instruction memory
+} Profile;
+
+// Run stmt when profile (a Profile pointer, NULL when not profiling) is set;
+// never without PROFILE_COUNTERS
+#define PROFILE(profile, stmt)                       \
+    do                                               \
+    {                                                \
+        if (PROFILE_COUNTERS && (profile) != NULL)   \
+            stmt;                                    \
+    } while (0)
+
+// Data memory is tracked in pages for snapshots and resets: a bit per page
+// in Machine.dirty and Machine.touched is set whenever the page is written,
+// plus one bit for instruction memory (set by data_write for an STR into
+// it, and by the loaders)
+#define DATA_PAGE_SIZE 64
+#define DATA_PAGES (DATA_MEMORY_SIZE / DATA_PAGE_SIZE)
+#define DIRTY_CODE_BIT DATA_PAGES
+#define DIRTY_ALL (~0ULL)
+#define DIRTY_BIT(address) ((address) / DATA_PAGE_SIZE)
+#define MARK_DIRTY(m, address)                      \
+    do                                              \
+    {                                               \
+        uint64_t bit_ = 1ULL << DIRTY_BIT(address); \
+        (m)->dirty |= bit_;                         \
+        (m)->touched |= bit_;                       \
+    } while (0)
+
+// Everything one simulated processor owns. Every stage function works on the
+// machine it is handed, so independent machines can run side by side (the
+// batch runner gives each worker thread its own).
+struct Machine
+{
+    uint16_t instruction_memory[INSTRUCTION_MEMORY_SIZE]; // Instruction memory (word-addressable)
+    int8_t data_memory[DATA_MEMORY_SIZE];                 // Data memory (byte/word addressable)
+    int8_t GPR[NUM_GPRS];                                 // R0 to R63
+    FlagState flags;                                      // Status Register (see machine_sreg)
+    uint16_t PC;                                          // Program Counter (PC): 16-bit
+    int skipped;                                          // Flag to indicate if the instruction was skipped
+
+    // Pipeline Buffers for IF, ID, EX stages
+    uint16_t IF_buffer;                  // Instruction Fetch buffer
+    uint16_t ID_buffer;                  // Instruction Decode buffer
+    const DecodedInstruction *EX_buffer; // Execute buffer
+    // The two addresses are ints, not uint16_t: packed next to PC, GCC merges
+    // the per-cycle address shift into 4-byte vector loads that stall on the
+    // 2-byte PC store and cost the interpreters about a third of their speed
+    int IF_addr; // Instruction memory address held in IF_buffer
+    int ID_addr; // Instruction memory address held in ID_buffer
+    int remaining;  // Cycles left once fetching ran past the program
+    long long cycle; // Cycles run since pipeline_start
+
+    // Predecoded copy of instruction memory. Every word is decoded once up
+    // front and the ID stage just indexes this array; the only write into
+    // instruction memory while a program runs, an STR with a negative
+    // address, decodes the word it changed again (data_write).
+    DecodedInstruction decoded_program[INSTRUCTION_MEMORY_SIZE];
+    ExecuteHandler decoded_handlers[INSTRUCTION_MEMORY_SIZE];
+    int code_unsettled; // The STR in EX rewrote its own word (code_settle)
+
+    // Data memory and PC the loaded program starts with (.data/.entry or the
+    // segments of a program image); reset_state goes back to them
+    int8_t initial_data[DATA_MEMORY_SIZE];
+    uint16_t entry_pc;
+
+    ExecutionEngine engine;
+    long long max_cycles; // run_pipeline stops after this many cycles
+    struct JitCache *jit; // Compiled blocks, NULL unless ENGINE_JIT is usable
+    struct MemoCache *memo; // Memoized blocks, NULL unless ENGINE_MEMO
+    TraceBuffer trace;
+    Profile *profile; // Execution counters, NULL unless --profile is given
+    struct TraceRecorder *recorder; // Binary trace, NULL unless --record is given
+    struct BranchPredictor *predictor; // Branch prediction model, NULL unless --predictor is given
+    struct DataCache *dcache; // Data cache model, NULL unless --dcache is given
+    struct PipelineModel *pipeline; // Hazard/forwarding model, NULL unless --pipeline is given
+    struct Debugger *debugger; // Breakpoints and watchpoints, NULL unless --break, --break-if or --watch is given
+    uint32_t *executions; // functional_run counts instructions per address here when --sample sets it
+    // Fetch address the predictor chose after the instructions in IF and ID
+    // (plus one; 0 when fetch went on sequentially)
+    int IF_pred;
+    int ID_pred;
+
+    // Pages written since the last snapshot, and the snapshot pages that
+    // hold the clean ones (shared with every snapshot that uses them)
+    uint64_t dirty;
+    // What reset_state and the final dump have to look at: pages written
+    // since the last reset (or changed in initial_data), pages of
+    // initial_data that are not all zero, and the end of the part of
+    // instruction memory (and of the predecoded copy) that may not be zero
+    uint64_t touched;
+    uint64_t initial_pages;
+    int code_end;
+    int decoded_end;
+    struct SnapshotPage *clean_pages[DATA_PAGES];
+    struct SnapshotCode *clean_code;
+};
+
+// The status register as execute_instruction would have left it
+static inline SREG_t machine_sreg(const Machine *m)
+{
+#if LAZY_FLAGS
+    // V as updateOverflowFlag computes it: both operands have the sign the
+    // result does not have
+    const FlagState *f = &m->flags;
+    int8_t r = f->vs_result;
+    uint8_t v = (((f->vs_a ^ r) & (f->vs_b ^ r)) >> 7) & 1;
+    return (SREG_t){f->carry_sum > 0xFF, v, f->nz_result < 0, (r < 0) ^ v, (uint8_t)f->nz_result == 0, 0};
+#else
+    return m->flags;
+#endif
+}
+
+static inline void machine_set_sreg(Machine *m, SREG_t sreg)
+{
+#if LAZY_FLAGS
+    // An ADD of a to itself giving r leaves V = 0 and S = N(a) if r == a,
+    // and V = 1 and S = N(a) if r = ~a has the other sign
+    int8_t a = sreg.S ? -1 : 0;
+    m->flags.carry_sum = sreg.C ? 0x100 : 0;
+    m->flags.vs_a = a;
+    m->flags.vs_b = a;
+    m->flags.vs_result = sreg.V ? ~a : a;
+    m->flags.nz_result = sreg.Z ? (sreg.N ? -256 : 0) : (sreg.N ? -1 : 1);
+#else
+    m->flags = sreg;
+#endif
+}
+
+// Flag updates of ADD (operands a and b), SUB, and the instructions that
+// only write N and Z
+static inline void flags_add(Machine *m, int8_t a, int8_t b, int8_t result)
+{
+#if LAZY_FLAGS
+    m->flags.carry_sum = (uint8_t)a + (uint8_t)b;
+    m->flags.vs_a = a;
+    m->flags.vs_b = b;
+    m->flags.vs_result = result;
+    m->flags.nz_result = result;
+#else
+    updateCarryFlag(&m->flags, (uint8_t)a, (uint8_t)b);
+    updateOverflowFlag(&m->flags, a, b, result);
+    updateNegativeFlag(&m->flags, result);
+    updateZeroFlag(&m->flags, result);
+    updateSignFlag(&m->flags);
+#endif
+}
+
+static inline void flags_sub(Machine *m, int8_t result)
+{
+    // SUB computes V from the already updated register, so both "operands"
+    // carry the sign of the result and V is always 0: the same as adding
+    // the result to itself
+#if LAZY_FLAGS
+    m->flags.vs_a = result;
+    m->flags.vs_b = result;
+    m->flags.vs_result = result;
+    m->flags.nz_result = result;
+#else
+    updateOverflowFlag(&m->flags, result, result, result);
+    updateNegativeFlag(&m->flags, result);
+    updateZeroFlag(&m->flags, result);
+    updateSignFlag(&m->flags);
+#endif
+}
+
+static inline void flags_nz(Machine *m, int8_t result)
+{
+#if LAZY_FLAGS
+    m->flags.nz_result = result;
+#else
+    updateNegativeFlag(&m->flags, result);
+    updateZeroFlag(&m->flags, result);
+#endif
+}
+
+// Instruction memory past this address is all zero
+static inline int machine_code_end(const Machine *m)
+{
+    return (m->touched >> DIRTY_CODE_BIT) & 1 ? INSTRUCTION_MEMORY_SIZE : m->code_end;
+}
+
+// Function to load instruction into memory
+void load_instruction(Machine *m, uint16_t address, uint16_t value)
+{
+    if (address < INSTRUCTION_MEMORY_SIZE)
+    {
+        m->instruction_memory[address] = value;
+        m->dirty |= 1ULL << DIRTY_CODE_BIT;
+        if (address >= m->code_end)
+            m->code_end = address + 1;
+    }
+    else
+    {
+        printf("Error: Instruction memory address out of range\n");
+    }
+}
+
+// Function to load data into memory
+void load_data(Machine *m, uint16_t address, uint8_t value)
+{
+    if (address < DATA_MEMORY_SIZE)
+    {
+        m->data_memory[address] = value;
+        m->dirty |= 1ULL << (address / DATA_PAGE_SIZE);
+        m->touched |= 1ULL << (address / DATA_PAGE_SIZE);
+    }
+    else
+    {
+        printf("Error: Data memory address out of range\n");
+    }
+}
+
+// Function to print an instruction memory block
+void print_instruction_memory(Machine *m)
+{
+    printf("Instruction Memory (16-bit words):\n");
+    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
+    {
+        printf("Address %3d: 0x%04X\n", i, m->instruction_memory[i]);
+    }
+}
+
+// Function to print a data memory block
+void print_data_memory(Machine *m)
+{
+    printf("Data Memory (8-bit words):\n");
+    for (int i = 0; i < DATA_MEMORY_SIZE; i++)
+    {
+        printf("Address %4d: 0x%02X\n", i, m->data_memory[i]);
+    }
+}
+
+
 DecodedInstruction decode_instruction(uint16_t instruction)
 {
     DecodedInstruction decoded;
     if (instruction == NOP_INSTR)
     {
         decoded.opcode = 0xFF; // NOP
-        decoded.r1 = decoded.r2 = decoded.imm = 0;
+        decoded.r1 = decoded.r2 = decoded.immshift = decoded.imm = 0;
         return decoded;
     }
     decoded.opcode = OPCODE(instruction);
     decoded.r1 = R1_INDEX(instruction);
     decoded.r2 = R2_INDEX(instruction);
     int immt = IMM_VALUE(instruction);
-    if(decoded.opcode == 8 || decoded.opcode == 9){
-        decoded.immshift = immt;
-    }
-    else{
-        // Sign extend the immediate value
-        if (immt & 0b00100000) {  // If bit 5 is set (negative)
-            decoded.imm = immt | 0b11000000;  // Sign extend to 8 bits
-        } else {
-            decoded.imm = immt & 0b00111111;  // Keep only lower 6 bits
-        }
+    // Shift amount (SAL/SAR) is the raw unsigned 6-bit field
+    decoded.immshift = immt;
+    // Sign extend the immediate value
+    if (immt & 0b00100000) {  // If bit 5 is set (negative)
+        decoded.imm = immt | 0b11000000;  // Sign extend to 8 bits
+    } else {
+        decoded.imm = immt & 0b00111111;  // Keep only lower 6 bits
     }
     return decoded;
 }
 
+const DecodedInstruction nop_decoded = {0xFF, 0, 0, 0, 0};
+
+// Called by data_write; defined after jit_reset, as it drops the JIT's blocks
+void code_written(Machine *m, int address);
+
+// LDR and STR take a signed 6-bit address. Addresses -32..-1 are the last
+// 32 bytes of instruction memory, counted back from its end: the bytes of
+// words 1008..1023 in host order. Every engine that reaches data memory
+// through an instruction goes through data_read and data_write, or leaves
+// the instructions with such an address to them.
+static inline int address_in_code(int address)
+{
+    return address < 0;
+}
+
+static inline int8_t data_read(const Machine *m, int address)
+{
+    if (address_in_code(address))
+        return (int8_t)((const uint8_t *)m->instruction_memory)[sizeof m->instruction_memory + address];
+    return m->data_memory[address];
+}
+
+// A write into instruction memory sets the code bit and brings the decoded
+// copy and the JIT in line with the new word (code_written)
+static inline void data_write(Machine *m, int address, int8_t value)
+{
+    if (address_in_code(address))
+    {
+        ((uint8_t *)m->instruction_memory)[sizeof m->instruction_memory + address] = (uint8_t)value;
+        m->dirty |= 1ULL << DIRTY_CODE_BIT;
+        m->touched |= 1ULL << DIRTY_CODE_BIT;
+        code_written(m, address);
+    }
+    else
+    {
+        m->data_memory[address] = value;
+        MARK_DIRTY(m, address);
+    }
+}
+
 // Executes a single instruction at PC and advances PC
-void execute_instruction(DecodedInstruction instruction, uint16_t *IF_buffer_ptr, uint16_t *ID_buffer_ptr)
+void execute_instruction(Machine *m, const DecodedInstruction *instruction, uint16_t *IF_buffer_ptr, uint16_t *ID_buffer_ptr)
 {
     /*
     uint8_t opcode = OPCODE(instruction);
@@ -234,11 +622,11 @@ void execute_instruction(DecodedInstruction instruction, uint16_t *IF_buffer_ptr
 
     // DecodedInstruction decoded = decode_instruction(instruction);
 
-    uint8_t opcode = instruction.opcode;
-    uint8_t r1 = instruction.r1;
-    uint8_t r2 = instruction.r2;
-    int8_t imm = instruction.imm;
-    uint8_t immshift = instruction.immshift;
+    uint8_t opcode = instruction->opcode;
+    uint8_t r1 = instruction->r1;
+    uint8_t r2 = instruction->r2;
+    int8_t imm = instruction->imm;
+    uint8_t immshift = instruction->immshift;
     int8_t result;
 
 
@@ -247,366 +635,6935 @@ void execute_instruction(DecodedInstruction instruction, uint16_t *IF_buffer_ptr
     switch (opcode)
     {
     case 0: // ADD
-        result = GPR[r1] + GPR[r2];
-        updateCarryFlag(&SREG, (uint8_t)GPR[r1], (uint8_t)GPR[r2]);  // Use original values
-        updateOverflowFlag(&SREG, GPR[r1], GPR[r2], result);
-        GPR[r1] = result;  // Update register after flag calculations
-        updateNegativeFlag(&SREG, result);
-        updateZeroFlag(&SREG, result);
-        updateSignFlag(&SREG);
-        printf("ADD R%d = %d, C=%d, V=%d, N=%d, Z=%d, S=%d\n", r1, GPR[r1], SREG.C, SREG.V, SREG.N, SREG.Z, SREG.S);
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
+        result = m->GPR[r1] + m->GPR[r2];
+        flags_add(m, m->GPR[r1], m->GPR[r2], result); // Use original values
+        m->GPR[r1] = result;  // Update register after flag calculations
         break;
 
     case 1: // SUB
-        result = GPR[r1] - GPR[r2];
-        GPR[r1] = result;
-        updateOverflowFlag(&SREG, GPR[r1], GPR[r2], result);
-        updateNegativeFlag(&SREG, result);
-        updateZeroFlag(&SREG, result);
-
-        updateSignFlag(&SREG);
-        printf("SUB R%d = %d, V=%d, N=%d, Z=%d, S=%d\n", r1, GPR[r1], SREG.V, SREG.N, SREG.Z, SREG.S);
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
-
+        result = m->GPR[r1] - m->GPR[r2];
+        m->GPR[r1] = result;
+        flags_sub(m, result);
         break;
 
     case 2: // MUL
-        result = GPR[r1] * GPR[r2];
-        GPR[r1] = result;
-        updateNegativeFlag(&SREG, result);
-        updateZeroFlag(&SREG, result);
-        printf("MUL R%d = %d, N=%d, Z=%d\n", r1, GPR[r1], SREG.N, SREG.Z);
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
+        result = m->GPR[r1] * m->GPR[r2];
+        m->GPR[r1] = result;
+        flags_nz(m, result);
         break;
 
     case 3: // MOVI
-        GPR[r1] = imm;  // Store the value (imm is already sign-extended)
-        printf("MOVI R%d = %d\n", r1, GPR[r1]); // Print as signed
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
+        m->GPR[r1] = imm;  // Store the value (imm is already sign-extended)
         break;
 
     case 4: // BEQZ
-        if (GPR[r1] == 0)
+        if (m->GPR[r1] == 0)
         {
             if (imm > 2)
             {
-                skipped = 2; // Flush next 2 instructions
-                PC = PC + imm - 2;
+                m->skipped = 2; // Flush next 2 instructions
+                m->PC = m->PC + imm - 2;
             }
             else
             {
-                skipped = imm; // Flush next instruction
+                m->skipped = imm; // Flush next instruction
             }
-            printf("BEQZ PC = %d (branch taken, pipeline flushed)\n", PC);
-            printf("PC updated to %d in EX stage\n", PC);
-        }
-        else
-        {
-            printf("BEQZ not taken, continue normally.\n");
         }
         break;
 
     case 5: // ANDI
-        result = GPR[r1] & imm;
-        GPR[r1] = result;
-        updateNegativeFlag(&SREG, result);
-        updateZeroFlag(&SREG, result);
-        printf("ANDI R%d = %d, N=%d, Z=%d\n", r1, GPR[r1], SREG.N, SREG.Z);
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
+        result = m->GPR[r1] & imm;
+        m->GPR[r1] = result;
+        flags_nz(m, result);
         break;
 
     case 6: // EOR - Exclusive OR
-        result = GPR[r1] ^ GPR[r2];
-        GPR[r1] = result;
-        updateNegativeFlag(&SREG, result);
-        updateZeroFlag(&SREG, result);
-        printf("EOR R%d = %d, N=%d, Z=%d\n", r1, GPR[r1], SREG.N, SREG.Z);
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
+        result = m->GPR[r1] ^ m->GPR[r2];
+        m->GPR[r1] = result;
+        flags_nz(m, result);
         break;
 
     case 7: // BR (Branch Register)
-        PC = (GPR[r1] << 8) | GPR[r2];
+        m->PC = (m->GPR[r1] << 8) | m->GPR[r2];
         *IF_buffer_ptr = NOP_INSTR;
         *ID_buffer_ptr = NOP_INSTR;
-        printf("BR PC = %d (branch taken, pipeline flushed)\n", PC);
-        printf("PC updated to %d in EX stage\n", PC);
         break;
 
     case 8:                               // SAL (Shift Left)
-        result = GPR[r1] << (immshift); // Use unsigned 6 bits
-        GPR[r1] = result;
-        updateNegativeFlag(&SREG, result);
-        updateZeroFlag(&SREG, result);
-        printf("SAL R%d = %d, N=%d, Z=%d\n", r1, GPR[r1], SREG.N, SREG.Z);
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
+        result = m->GPR[r1] << SHIFT_COUNT(immshift); // Use unsigned 6 bits
+        m->GPR[r1] = result;
+        flags_nz(m, result);
         break;
 
     case 9:                               // SAR (Shift Right)
-        result = GPR[r1] >> (immshift); // Use unsigned 6 bits
-        GPR[r1] = result;
-        updateNegativeFlag(&SREG, result);
-        updateZeroFlag(&SREG, result);
-        printf("SAR R%d = %d, N=%d, Z=%d\n", r1, GPR[r1], SREG.N, SREG.Z);
-        printf("Register R%d updated to %d in EX stage\n", r1, GPR[r1]);
+        result = m->GPR[r1] >> SHIFT_COUNT(immshift); // Use unsigned 6 bits
+        m->GPR[r1] = result;
+        flags_nz(m, result);
         break;
 
     case 10: // LDR
-        GPR[r1] = data_memory[imm];
-        PC += 1;
-        printf("LDR R%d = %d\n", r1, GPR[r1]);
-        printf("Memory[%d] updated to %d in EX stage\n", imm, data_memory[imm]);
+        m->GPR[r1] = data_read(m, imm);
+        m->PC += 1;
         break;
 
     case 11: // STR
-        data_memory[imm] = GPR[r1];
-        printf("STR mem[%d] = %d\n", imm, data_memory[imm]);
-        printf("Memory[%d] updated to %d in EX stage\n", imm, data_memory[imm]);
+        data_write(m, imm, m->GPR[r1]);
         break;
 
     default:
         // Invalid opcode: halt or skip
         break;
     }
-
-    printf("SREG updated: C=%d V=%d N=%d S=%d Z=%d in EX stage\n", SREG.C, SREG.V, SREG.N, SREG.S, SREG.Z);
-    printf("PC updated to %d in EX stage\n", PC);
-}
-uint16_t fetch_instruction()
-{
-    if (PC < INSTRUCTION_MEMORY_SIZE && instruction_memory[PC] != 0)
-        return instruction_memory[PC++];
-    return NOP_INSTR;
 }
 
-// Pipeline Buffers for IF, ID, EX stages
-uint16_t IF_buffer;           // Instruction Fetch buffer (up to 3 instructions)
-uint16_t ID_buffer;           // Instruction Decode buffer (up to 3 instructions)
-DecodedInstruction EX_buffer; // Execute buffer (up to 3 instructions)
-
-// Add this helper function at file scope:
-void print_instruction_human(uint16_t instr, const char *stage)
+// Print what the EX stage just did (TRACE_FULL). Everything is read back from
+// the state after execution, so the engine itself never formats any text.
+void trace_execute(Machine *m, const DecodedInstruction *instruction)
 {
-    if (instr == 0)
-    {
-        printf("  %s: (NOP)\n", stage);
-        return;
-    }
-    DecodedInstruction d = decode_instruction(instr);
-    const char *mnemonics[] = {"ADD", "SUB", "MUL", "MOVI", "BEQZ", "ANDI", "EOR", "BR", "SAL", "SAR", "LDR", "STR"};
-    if (d.opcode > 11)
-    {
-        printf("  %s: (Invalid)\n", stage);
-        return;
-    }
-    // Print based on instruction type
-    switch (d.opcode)
+    uint8_t r1 = instruction->r1;
+    int8_t imm = instruction->imm;
+    const char *nz_mnemonic = NULL;
+    SREG_t sreg = machine_sreg(m);
+
+    switch (instruction->opcode)
     {
-    case 0:
-    case 1:
+    case 0: // ADD
+        trace_printf(&m->trace, "ADD R%d = %d, C=%d, V=%d, N=%d, Z=%d, S=%d\n", r1, m->GPR[r1], sreg.C, sreg.V, sreg.N, sreg.Z, sreg.S);
+        trace_printf(&m->trace, "Register R%d updated to %d in EX stage\n", r1, m->GPR[r1]);
+        break;
+    case 1: // SUB
+        trace_printf(&m->trace, "SUB R%d = %d, V=%d, N=%d, Z=%d, S=%d\n", r1, m->GPR[r1], sreg.V, sreg.N, sreg.Z, sreg.S);
+        trace_printf(&m->trace, "Register R%d updated to %d in EX stage\n", r1, m->GPR[r1]);
+        break;
     case 2:
-    case 6:
-    case 7: // R-type: ADD, SUB, MUL, EOR, BR
-        printf("  %s: %s R%d, R%d\n", stage, mnemonics[d.opcode], d.r1, d.r2);
+        nz_mnemonic = "MUL";
+        break;
+    case 3: // MOVI
+        trace_printf(&m->trace, "MOVI R%d = %d\n", r1, m->GPR[r1]); // Print as signed
+        trace_printf(&m->trace, "Register R%d updated to %d in EX stage\n", r1, m->GPR[r1]);
+        break;
+    case 4: // BEQZ
+        if (m->GPR[r1] == 0)
+        {
+            trace_printf(&m->trace, "BEQZ PC = %d (branch taken, pipeline flushed)\n", m->PC);
+            trace_printf(&m->trace, "PC updated to %d in EX stage\n", m->PC);
+        }
+        else
+        {
+            trace_printf(&m->trace, "BEQZ not taken, continue normally.\n");
+        }
         break;
-    case 3:
     case 5:
+        nz_mnemonic = "ANDI";
+        break;
+    case 6:
+        nz_mnemonic = "EOR";
+        break;
+    case 7: // BR
+        trace_printf(&m->trace, "BR PC = %d (branch taken, pipeline flushed)\n", m->PC);
+        trace_printf(&m->trace, "PC updated to %d in EX stage\n", m->PC);
+        break;
     case 8:
-    case 9: // I-type: MOVI, ANDI, SAL, SAR
-        printf("  %s: %s R%d, %d\n", stage, mnemonics[d.opcode], d.r1, get_imm_value(d.imm));
+        nz_mnemonic = "SAL";
         break;
-    case 4: // BEQZ
-        printf("  %s: %s R%d, %d\n", stage, mnemonics[d.opcode], d.r1,get_imm_value(d.imm));
+    case 9:
+        nz_mnemonic = "SAR";
         break;
-    case 10:
-    case 11: // LDR, STR
-        printf("  %s: %s R%d, [%d]\n", stage, mnemonics[d.opcode], d.r1, get_imm_value(d.imm));
+    case 10: // LDR
+        trace_printf(&m->trace, "LDR R%d = %d\n", r1, m->GPR[r1]);
+        trace_printf(&m->trace, "Memory[%d] updated to %d in EX stage\n", imm, data_read(m, imm));
+        break;
+    case 11: // STR
+        trace_printf(&m->trace, "STR mem[%d] = %d\n", imm, data_read(m, imm));
+        trace_printf(&m->trace, "Memory[%d] updated to %d in EX stage\n", imm, data_read(m, imm));
         break;
     default:
-        printf("  %s: (Unknown)\n", stage);
+        break;
+    }
+
+    // MUL, ANDI, EOR, SAL and SAR only touch N and Z
+    if (nz_mnemonic != NULL)
+    {
+        trace_printf(&m->trace, "%s R%d = %d, N=%d, Z=%d\n", nz_mnemonic, r1, m->GPR[r1], sreg.N, sreg.Z);
+        trace_printf(&m->trace, "Register R%d updated to %d in EX stage\n", r1, m->GPR[r1]);
     }
+
+    trace_printf(&m->trace, "SREG updated: C=%d V=%d N=%d S=%d Z=%d in EX stage\n", sreg.C, sreg.V, sreg.N, sreg.S, sreg.Z);
+    trace_printf(&m->trace, "PC updated to %d in EX stage\n", m->PC);
 }
 
-// get signed value of the immediate
+uint16_t fetch_instruction(Machine *m)
+{
+    if (m->PC < INSTRUCTION_MEMORY_SIZE && m->instruction_memory[m->PC] != 0)
+        return m->instruction_memory[m->PC++];
+    return NOP_INSTR;
+}
+
+// Whether fetch_instruction gets a real instruction at addr: not past
+// memory, not the empty word and not NOP_INSTR, which the interpreters treat
+// as a NOP (and count towards the end of the program). JIT blocks, memoized
+// blocks and the functional engine only run on while this holds.
+static inline int instruction_fetchable(const Machine *m, int addr)
+{
+    return addr >= 0 && addr < INSTRUCTION_MEMORY_SIZE && m->instruction_memory[addr] != 0 &&
+           m->instruction_memory[addr] != NOP_INSTR;
+}
+
+// Predecoded record for a pipeline buffer holding (raw, address)
+static inline const DecodedInstruction *buffer_decoded(const Machine *m, uint16_t raw, uint16_t addr)
+{
+    return raw == NOP_INSTR ? &nop_decoded : &m->decoded_program[addr];
+}
 
+// Threaded-code engine: every predecoded instruction gets a pointer to a
+// handler specialised for its opcode, so the EX stage makes one indirect call
+// instead of going through the switch in execute_instruction. Results are
+// identical to execute_instruction.
 
-// Run the pipeline
-void run_pipeline()
+void execute_add(Machine *m, const DecodedInstruction *instruction)
 {
-    int remaining = INT32_MAX;
-    skipped = 0;
-    int cycle = 0;
-    int n = 0; // Number of loaded instructions
-    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
-    {
-        if (instruction_memory[i] != 0)
-            n++;
-    }
-    printf("initialized count is: %d\n", n);
-    const DecodedInstruction dummy = {0xFF, 0, 0, 0}; // Dummy instruction for NOP
-    // Initialize pipeline buffers to NOP
-    IF_buffer = NOP_INSTR;
-    ID_buffer = NOP_INSTR;
-    EX_buffer = dummy; // Use 0xFF as NOP/invalid
+    int8_t a = m->GPR[instruction->r1];
+    int8_t b = m->GPR[instruction->r2];
+    int8_t result = a + b;
+    flags_add(m, a, b, result);
+    m->GPR[instruction->r1] = result;
+}
 
-    // Run for n+2 Instructions to account for the pipeline
-    for (int cycle = 0; remaining > 0; cycle++)
-    {
-        // Shift EX and ID buffers
-        EX_buffer = decode_instruction(ID_buffer);
-        ID_buffer = IF_buffer;
-        IF_buffer = fetch_instruction();
-        if (IF_buffer == NOP_INSTR)
-        {
-            if (remaining == INT32_MAX)
-            {
-                remaining = 2;
-            }
-            remaining--;
-        }
+void execute_sub(Machine *m, const DecodedInstruction *instruction)
+{
+    int8_t result = m->GPR[instruction->r1] - m->GPR[instruction->r2];
+    m->GPR[instruction->r1] = result;
+    flags_sub(m, result);
+}
 
-        // Shift pipeline: EX <- ID <- IF
-        // Execute stage: execute EX_buffer[2]
-        if (skipped > 0)
-        {
-            printf("Pipeline flushed due to branch. Skipping instruction.\n");
-            skipped--;
-            continue;
-        }
-        printf("\nCycle %d:\n", cycle + 1);
-        print_instruction_human(IF_buffer, "IF");
-        print_instruction_human(ID_buffer, "ID");
-        DecodedInstruction ex_instr = EX_buffer;
-        if (ex_instr.opcode == 0xFF)
+void execute_mul(Machine *m, const DecodedInstruction *instruction)
+{
+    int8_t result = m->GPR[instruction->r1] * m->GPR[instruction->r2];
+    m->GPR[instruction->r1] = result;
+    flags_nz(m, result);
+}
+
+void execute_movi(Machine *m, const DecodedInstruction *instruction)
+{
+    m->GPR[instruction->r1] = instruction->imm;
+}
+
+void execute_beqz(Machine *m, const DecodedInstruction *instruction)
+{
+    if (m->GPR[instruction->r1] == 0)
+    {
+        if (instruction->imm > 2)
         {
-            printf("  EX: (NOP)\n");
+            m->skipped = 2;
+            m->PC = m->PC + instruction->imm - 2;
         }
         else
         {
-            uint16_t ex_raw = (ex_instr.opcode << 12) | (ex_instr.r1 << 6) | (ex_instr.opcode == 3 || ex_instr.opcode == 4 || ex_instr.opcode == 5 || ex_instr.opcode == 8 || ex_instr.opcode == 9 || ex_instr.opcode == 10 || ex_instr.opcode == 11 ? (ex_instr.imm & 0x3F) : (ex_instr.r2 & 0x3F));
-            print_instruction_human(ex_raw, "EX");
-            execute_instruction(ex_instr, &IF_buffer, &ID_buffer);
+            m->skipped = instruction->imm;
         }
     }
+}
 
-    printf("Execution complete. Final PC = 0x%04X\n", PC);
+void execute_andi(Machine *m, const DecodedInstruction *instruction)
+{
+    int8_t result = m->GPR[instruction->r1] & instruction->imm;
+    m->GPR[instruction->r1] = result;
+    flags_nz(m, result);
+}
 
-    printf("\nFinal Register Values:\n");
-    for (int i = 0; i < NUM_GPRS; i++)
-    {
-        printf("R%d = %d\n", i, GPR[i]);
-    }
-    printf("PC = %d\n", PC);
-    printf("SREG: C=%d V=%d N=%d S=%d Z=%d\n", SREG.C, SREG.V, SREG.N, SREG.S, SREG.Z);
-    printf("\nInstruction Memory (nonzero):\n");
-    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
-    {
-        if (instruction_memory[i] != 0)
-            printf("Addr %d: 0x%04X\n", i, instruction_memory[i]);
-    }
-    printf("\nData Memory (nonzero):\n");
-    for (int i = 0; i < DATA_MEMORY_SIZE; i++)
-    {
-        if (data_memory[i] != 0)
-            printf("Addr %d: 0x%02X\n", i, data_memory[i]);
-    }
+void execute_eor(Machine *m, const DecodedInstruction *instruction)
+{
+    int8_t result = m->GPR[instruction->r1] ^ m->GPR[instruction->r2];
+    m->GPR[instruction->r1] = result;
+    flags_nz(m, result);
 }
-void resetAll()
+
+void execute_br(Machine *m, const DecodedInstruction *instruction)
 {
-    // Reset all states-----------------------WORK--------------------------------------------
-    for (int i = 0; i < NUM_GPRS; i++)
-        GPR[i] = 0;
-    for (int i = 0; i < DATA_MEMORY_SIZE; i++)
-        data_memory[i] = 0;
-    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
-        instruction_memory[i] = 0;
-    PC = 0;
-}
-
-uint16_t parseOpcode(char opcode[])
-{
-    if (strcmp(opcode, "ADD") == 0)
-        return 0x0000; // ADD
-    if (strcmp(opcode, "SUB") == 0)
-        return 0x1000; // SUB
-    if (strcmp(opcode, "MUL") == 0)
-        return 0x2000; // MUL
-    if (strcmp(opcode, "MOVI") == 0)
-        return 0x3000; // MOVI
-    if (strcmp(opcode, "BEQZ") == 0)
-        return 0x4000; // BEQZ
-    if (strcmp(opcode, "ANDI") == 0)
-        return 0x5000; // ANDI
-    if (strcmp(opcode, "EOR") == 0)
-        return 0x6000; // EOR
-    if (strcmp(opcode, "BR") == 0)
-        return 0x7000; // BR
-    if (strcmp(opcode, "SAL") == 0)
-        return 0x8000; // SAL
-    if (strcmp(opcode, "SAR") == 0)
-        return 0x9000; // SAR
-    if (strcmp(opcode, "LDR") == 0)
-        return 0xA000; // LDR
-    if (strcmp(opcode, "STR") == 0)
-        return 0xB000; // STR
-    return -1;
+    m->PC = (m->GPR[instruction->r1] << 8) | m->GPR[instruction->r2];
+    m->IF_buffer = NOP_INSTR;
+    m->ID_buffer = NOP_INSTR;
 }
 
-uint16_t parseRegister(char reg[])
+void execute_sal(Machine *m, const DecodedInstruction *instruction)
 {
-    // convert from string to int
-    int regNum = atoi(reg + 1); // Skip the 'R' character
-    // printf("Register number: %d\n", regNum);
-    return 0x0000 | (regNum << 6); // Shift left by 6 bits to match the instruction format
+    int8_t result = m->GPR[instruction->r1] << SHIFT_COUNT(instruction->immshift);
+    m->GPR[instruction->r1] = result;
+    flags_nz(m, result);
 }
-uint16_t parseImmediate(char imm[])
+
+void execute_sar(Machine *m, const DecodedInstruction *instruction)
 {
-    if (imm[0] == 'R')
-    {
-        // convert from string to int
-        int regNum = atoi(imm + 1); // Skip the 'R' character
-        return 0x0000 | (regNum); // Shift left by 6 bits to match the instruction format
-    }
-    // convert from string to int
-    int immediate = atoi(imm);
-    if (immediate < 0)
-    {
-        // Convert to 6-bit two's complement
-        immediate = (~(-immediate) + 1) & 0x3F;
-    }
-    else
-    {
-        // Ensure positive numbers are also masked to 6 bits
-        immediate &= 0x3F;
-    }
-    return 0x0000 | (immediate); // Shift left by 12 bits to match the instruction format
+    int8_t result = m->GPR[instruction->r1] >> SHIFT_COUNT(instruction->immshift);
+    m->GPR[instruction->r1] = result;
+    flags_nz(m, result);
 }
 
-uint16_t parsefn(char line[])
+void execute_ldr(Machine *m, const DecodedInstruction *instruction)
 {
-    uint16_t hex = 0x0000;
-    // Variables to store the extracted words
-    char opcode[20] = {0};
-    char reg[20] = {0};
-    char imm[20] = {0};
+    m->GPR[instruction->r1] = data_read(m, instruction->imm);
+    m->PC += 1;
+}
 
-    // Use sscanf to extract the three words
-    sscanf(line, "%s %s %s", opcode, reg, imm);
+void execute_str(Machine *m, const DecodedInstruction *instruction)
+{
+    data_write(m, instruction->imm, m->GPR[instruction->r1]);
+}
+
+void execute_invalid(Machine *m, const DecodedInstruction *instruction)
+{
+    (void)m;
+    (void)instruction;
+}
+
+const ExecuteHandler execute_handlers[16] = {
+    execute_add, execute_sub, execute_mul, execute_movi,
+    execute_beqz, execute_andi, execute_eor, execute_br,
+    execute_sal, execute_sar, execute_ldr, execute_str,
+    execute_invalid, execute_invalid, execute_invalid, execute_invalid};
+
+// ---------------------------------------------------------------------------
+// Basic-block JIT (x86-64)
+//
+// Used by --engine=jit when no per-cycle trace is printed. Straight-line runs
+// of instructions, ending at BEQZ, BR or LDR, are translated to native code
+// that updates GPR, SREG and data_memory directly and counts the cycles the
+// pipeline would have spent on them. A block is only entered from a "clean"
+// pipeline state at address X (ID holds X, IF holds X+1, PC = X+2, nothing to
+// flush) and only covers instructions whose fetches stay inside the loaded
+// program, so the fetch stream, flushes and cycle count are exactly those of
+// the interpreter. Anything else (per-cycle tracing, the end of the program,
+// branches into the last words of memory) falls back to the interpreter.
+//
+// Blocks whose exit target is known at translation time are chained with a
+// direct jump; BR targets go back through jit_enter(), which looks the block
+// up in the translation cache (one slot per instruction address).
+// ---------------------------------------------------------------------------
+typedef struct
+{
+    int8_t *gpr;              // GPR
+    int8_t *dmem;             // data_memory
+    uint8_t *sreg;            // SREG viewed as a byte
+    const uint8_t *add_flags; // SREG bits of ADD, indexed by (a << 8) | b
+    const uint8_t *sub_flags; // SREG bits of SUB, indexed by the result
+    const uint8_t *nz_flags;  // N and Z bits, indexed by the result
+    int64_t cycles;           // cycles executed by native code
+    int64_t fuel;             // cycles left before returning to C
+    int32_t skipped;          // copy of skipped
+    int32_t exit_kind;        // JIT_EXIT_*
+    int32_t exit_pc;          // next clean address, BR target or new PC
+    int32_t exit_addr;        // address of the last executed instruction
+    uint64_t *dirty;          // Machine.dirty
+    uint64_t *touched;        // Machine.touched
+} JitContext;
+
+enum
+{
+    JIT_EXIT_CLEAN, // pipeline is clean at exit_pc
+    JIT_EXIT_BR,    // BR executed: IF/ID flushed, PC = exit_pc
+    JIT_EXIT_AFTER  // instruction at exit_addr executed, PC = exit_pc
+};
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_MAX_BLOCK 64
+#define JIT_MAX_CHAINS 4096
+#define JIT_NOT_COMPILED -1
+#define JIT_UNCOMPILABLE -2
+#define JIT_FUEL (1LL << 30)
+// A chained block never runs more than JIT_MAX_BLOCK + 2 cycles, so keeping
+// this much in reserve means native code never overshoots a cycle budget
+#define JIT_FUEL_MARGIN (JIT_MAX_BLOCK + 2)
+
+typedef struct
+{
+    uint32_t stub;   // offset of the patchable exit stub
+    uint16_t target; // clean address the stub exits to
+} JitChain;
+
+// Translation cache of one machine
+typedef struct JitCache
+{
+    uint8_t *code;                                // JIT_CODE_SIZE bytes, RW or RX
+    size_t used;                                  // bytes of code emitted so far
+    int32_t block_offset[INSTRUCTION_MEMORY_SIZE]; // block per clean address
+    JitChain chains[JIT_MAX_CHAINS];              // exits waiting for a block
+    int chain_count;
+    uint8_t *cursor;                              // emit position
+} JitCache;
+
+// Flag tables are shared by every machine and built once
+uint8_t jit_add_flags[65536];
+uint8_t jit_sub_flags[256];
+uint8_t jit_nz_flags[256];
+uint8_t jit_flag_c, jit_flag_v, jit_flag_n, jit_flag_s, jit_flag_z;
+
+static inline uint8_t sreg_byte(SREG_t sreg)
+{
+    uint8_t byte;
+    memcpy(&byte, &sreg, 1);
+    return byte;
+}
+
+// Flag tables are built with the same update functions execute_instruction
+// uses, so native code only has to look the SREG bits up
+void jit_build_flag_tables()
+{
+    SREG_t s;
+    memset(&s, 0, sizeof(s));
+    s.C = 1;
+    jit_flag_c = sreg_byte(s);
+    memset(&s, 0, sizeof(s));
+    s.V = 1;
+    jit_flag_v = sreg_byte(s);
+    memset(&s, 0, sizeof(s));
+    s.N = 1;
+    jit_flag_n = sreg_byte(s);
+    memset(&s, 0, sizeof(s));
+    s.S = 1;
+    jit_flag_s = sreg_byte(s);
+    memset(&s, 0, sizeof(s));
+    s.Z = 1;
+    jit_flag_z = sreg_byte(s);
+
+    for (int a = 0; a < 256; a++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            int8_t result = (int8_t)a + (int8_t)b;
+            memset(&s, 0, sizeof(s));
+            updateCarryFlag(&s, a, b);
+            updateOverflowFlag(&s, a, b, result);
+            updateNegativeFlag(&s, result);
+            updateZeroFlag(&s, result);
+            updateSignFlag(&s);
+            jit_add_flags[(a << 8) | b] = sreg_byte(s);
+        }
+        memset(&s, 0, sizeof(s));
+        updateNegativeFlag(&s, a);
+        updateZeroFlag(&s, a);
+        jit_nz_flags[a] = sreg_byte(s);
+        updateOverflowFlag(&s, a, a, a); // SUB sees the updated register
+        updateSignFlag(&s);
+        jit_sub_flags[a] = sreg_byte(s);
+    }
+}
+
+// Drop every translation (the program changed)
+void jit_reset(JitCache *jit)
+{
+    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
+        jit->block_offset[i] = JIT_NOT_COMPILED;
+    jit->used = 0;
+    jit->chain_count = 0;
+}
+
+static void decode_word(Machine *m, int word)
+{
+    m->decoded_program[word] = decode_instruction(m->instruction_memory[word]);
+    m->decoded_handlers[word] = execute_handlers[m->decoded_program[word].opcode & 0x0F];
+    if (word >= m->decoded_end)
+        m->decoded_end = word + 1;
+}
+
+// An STR with a negative address wrote a byte of one of the last words of
+// instruction memory (data_memory follows it in Machine). Decode that word
+// again and drop the JIT's blocks, which were translated from the old
+// words. A copy of the word already fetched into IF or ID is replaced as
+// well, so every engine runs the new instruction from the next cycle on; a
+// copy rewritten to 0 or NOP_INSTR becomes a bubble.
+void code_written(Machine *m, int address)
+{
+    int word = ((int)sizeof(m->instruction_memory) + address) / 2;
+    uint16_t value = m->instruction_memory[word];
+    // A store that rewrote its own word is still traced, profiled and
+    // recorded through EX_buffer, so its word is decoded after the cycle
+    if (m->EX_buffer == &m->decoded_program[word])
+        m->code_unsettled = 1;
+    else
+        decode_word(m, word);
+    if (m->jit != NULL)
+        jit_reset(m->jit);
+
+    uint16_t fetched = value != 0 ? value : NOP_INSTR;
+    if (m->IF_buffer != NOP_INSTR && m->IF_addr == word)
+        m->IF_buffer = fetched;
+    if (m->ID_buffer != NOP_INSTR && m->ID_addr == word)
+        m->ID_buffer = fetched;
+}
+
+// End of a cycle in which the STR in EX rewrote its own word
+static inline void code_settle(Machine *m)
+{
+    m->code_unsettled = 0;
+    decode_word(m, (int)(m->EX_buffer - m->decoded_program));
+}
+
+#if JIT_SUPPORTED
+// Registers: rdi = JitContext, r8 = GPR, r9 = data_memory, r10 = SREG.
+// eax/ecx/edx/esi/r11 are scratch.
+#define JIT_BASE_GPR 0
+#define JIT_BASE_DMEM 1
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+static void jit_emit8(JitCache *jit, uint8_t byte)
+{
+    *jit->cursor++ = byte;
+}
+
+static void jit_emit32(JitCache *jit, uint32_t value)
+{
+    memcpy(jit->cursor, &value, 4);
+    jit->cursor += 4;
+}
+
+// <opcode> reg, byte [r8/r9 + disp32]
+static void jit_emit_mem(JitCache *jit, uint8_t op1, uint8_t op2, int reg, int base, int32_t disp)
+{
+    jit_emit8(jit, 0x41);
+    jit_emit8(jit, op1);
+    if (op2)
+        jit_emit8(jit, op2);
+    jit_emit8(jit, 0x80 | (reg << 3) | base);
+    jit_emit32(jit, disp);
+}
+
+// mov dword [rdi + offset], imm32
+static void jit_emit_store_ctx(JitCache *jit, int offset, int32_t value)
+{
+    jit_emit8(jit, 0xC7);
+    jit_emit8(jit, 0x47);
+    jit_emit8(jit, offset);
+    jit_emit32(jit, value);
+}
+
+// Merge the table entry for index edx into SREG, touching only mask bits
+static void jit_emit_flags(JitCache *jit, int table_offset, uint8_t mask)
+{
+    jit_emit8(jit, 0x4C); // mov r11, [rdi + table_offset]
+    jit_emit8(jit, 0x8B);
+    jit_emit8(jit, 0x5F);
+    jit_emit8(jit, table_offset);
+    jit_emit8(jit, 0x41); // movzx edx, byte [r11 + rdx]
+    jit_emit8(jit, 0x0F);
+    jit_emit8(jit, 0xB6);
+    jit_emit8(jit, 0x14);
+    jit_emit8(jit, 0x13);
+    jit_emit8(jit, 0x83); // and edx, mask
+    jit_emit8(jit, 0xE2);
+    jit_emit8(jit, mask);
+    jit_emit8(jit, 0x41); // movzx esi, byte [r10]
+    jit_emit8(jit, 0x0F);
+    jit_emit8(jit, 0xB6);
+    jit_emit8(jit, 0x32);
+    jit_emit8(jit, 0x81); // and esi, ~mask
+    jit_emit8(jit, 0xE6);
+    jit_emit32(jit, (uint8_t)~mask);
+    jit_emit8(jit, 0x09); // or esi, edx
+    jit_emit8(jit, 0xD6);
+    jit_emit8(jit, 0x41); // mov [r10], sil
+    jit_emit8(jit, 0x88);
+    jit_emit8(jit, 0x32);
+}
+
+// movzx edx, al ; then flags from the result
+static void jit_emit_result_flags(JitCache *jit, int table_offset, uint8_t mask)
+{
+    if (mask == 0)
+        return;
+    jit_emit8(jit, 0x0F);
+    jit_emit8(jit, 0xB6);
+    jit_emit8(jit, 0xD0);
+    jit_emit_flags(jit, table_offset, mask);
+}
+
+static void jit_emit_cycles(JitCache *jit, int32_t cycles)
+{
+    jit_emit8(jit, 0x48); // add qword [rdi + cycles], n
+    jit_emit8(jit, 0x81);
+    jit_emit8(jit, 0x47);
+    jit_emit8(jit, offsetof(JitContext, cycles));
+    jit_emit32(jit, cycles);
+    jit_emit8(jit, 0x48); // sub qword [rdi + fuel], n
+    jit_emit8(jit, 0x81);
+    jit_emit8(jit, 0x6F);
+    jit_emit8(jit, offsetof(JitContext, fuel));
+    jit_emit32(jit, cycles);
+}
+
+static void jit_emit_exit(JitCache *jit, int kind, int32_t pc)
+{
+    jit_emit_store_ctx(jit, offsetof(JitContext, exit_pc), pc);
+    jit_emit_store_ctx(jit, offsetof(JitContext, exit_kind), kind);
+    jit_emit8(jit, 0xC3); // ret
+}
+
+// The cache is never writable and executable at once: it is RW while a block
+// is emitted and chains are patched, and RX while blocks run
+static int jit_protect(JitCache *jit, int writable)
+{
+    int prot = PROT_READ | (writable ? PROT_WRITE : PROT_EXEC);
+    return mprotect(jit->code, JIT_CODE_SIZE, prot) == 0;
+}
+
+static void jit_patch_chain(JitCache *jit, uint32_t stub, int32_t block)
+{
+    uint8_t *at = jit->code + stub;
+    int32_t rel = block - (int32_t)(stub + 5);
+    at[0] = 0xE9; // jmp rel32
+    memcpy(at + 1, &rel, 4);
+}
+
+// Exit to a clean state at target after the given number of cycles. While
+// there is fuel left the exit can be patched into a jump to target's block.
+static void jit_emit_clean_exit(JitCache *jit, uint16_t target, int32_t cycles)
+{
+    jit_emit_cycles(jit, cycles);
+    jit_emit8(jit, 0x7E); // jle no_chain
+    jit_emit8(jit, 15);
+    uint32_t stub = jit->cursor - jit->code;
+    jit_emit_exit(jit, JIT_EXIT_CLEAN, target);
+    jit_emit_exit(jit, JIT_EXIT_CLEAN, target); // no_chain
+    if (target < INSTRUCTION_MEMORY_SIZE && jit->block_offset[target] >= 0)
+    {
+        jit_patch_chain(jit, stub, jit->block_offset[target]);
+    }
+    else if (jit->chain_count < JIT_MAX_CHAINS)
+    {
+        jit->chains[jit->chain_count].stub = stub;
+        jit->chains[jit->chain_count].target = target;
+        jit->chain_count++;
+    }
+}
+
+// Set a bit of Machine.dirty and Machine.touched (page tracking)
+static void jit_emit_mark_dirty(JitCache *jit, int bit)
+{
+    int fields[2] = {offsetof(JitContext, dirty), offsetof(JitContext, touched)};
+    for (int i = 0; i < 2; i++)
+    {
+        jit_emit8(jit, 0x4C); // mov r11, [rdi + field]
+        jit_emit8(jit, 0x8B);
+        jit_emit8(jit, 0x5F);
+        jit_emit8(jit, fields[i]);
+        jit_emit8(jit, 0x49); // bts qword [r11], bit
+        jit_emit8(jit, 0x0F);
+        jit_emit8(jit, 0xBA);
+        jit_emit8(jit, 0x2B);
+        jit_emit8(jit, bit);
+    }
+}
+
+static void jit_emit_after_exit(JitCache *jit, uint16_t addr, int32_t pc, int32_t cycles)
+{
+    jit_emit_cycles(jit, cycles);
+    jit_emit_store_ctx(jit, offsetof(JitContext, exit_addr), addr);
+    jit_emit_exit(jit, JIT_EXIT_AFTER, pc);
+}
+
+// True if the pipeline can reach a clean state at addr: both addr and
+// addr + 1 are fetched as real instructions
+static int jit_clean_possible(const Machine *m, int addr)
+{
+    return instruction_fetchable(m, addr) && instruction_fetchable(m, addr + 1);
+}
+
+// SREG bits written by an opcode
+static uint8_t jit_flags_written(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case 0:
+        return jit_flag_c | jit_flag_v | jit_flag_n | jit_flag_s | jit_flag_z;
+    case 1:
+        return jit_flag_v | jit_flag_n | jit_flag_s | jit_flag_z;
+    case 2:
+    case 5:
+    case 6:
+    case 8:
+    case 9:
+        return jit_flag_n | jit_flag_z;
+    default:
+        return 0;
+    }
+}
+
+// Translate the block starting at a clean state at start
+int32_t jit_compile_block(Machine *m, uint16_t start)
+{
+    JitCache *jit = m->jit;
+    int count = 0;
+    int terminated = 0;
+    uint8_t live_mask[JIT_MAX_BLOCK];
+
+    // Find the block: every cycle must fetch a real instruction (addr + 2)
+    while (count < JIT_MAX_BLOCK)
+    {
+        int addr = start + count;
+        if (!instruction_fetchable(m, addr + 2))
+            break;
+        uint8_t opcode = m->decoded_program[addr].opcode;
+        // LDR/STR into instruction memory run in the interpreter (data_read,
+        // data_write); a store there decodes the word again and drops the
+        // blocks
+        if ((opcode == 10 || opcode == 11) && address_in_code(m->decoded_program[addr].imm))
+            break;
+        count++;
+        if (opcode == 7 || opcode == 10 || (opcode == 4 && m->decoded_program[addr].imm > 0))
+        {
+            terminated = 1;
+            break;
+        }
+    }
+    if (count == 0)
+        return JIT_UNCOMPILABLE;
+
+    // Only the last write of each flag in the block has to reach SREG
+    uint8_t live = 0xFF;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        uint8_t written = jit_flags_written(m->decoded_program[start + i].opcode);
+        live_mask[i] = written & live;
+        live &= ~written;
+    }
+
+    if (!jit_protect(jit, 1))
+        return JIT_UNCOMPILABLE;
+    if (JIT_CODE_SIZE - jit->used < 128 * (JIT_MAX_BLOCK + 4))
+        jit_reset(jit); // Cache full: start over
+    int32_t offset = jit->used;
+    jit->cursor = jit->code + jit->used;
+
+    jit_emit8(jit, 0x4C); // mov r8, [rdi + gpr]
+    jit_emit8(jit, 0x8B);
+    jit_emit8(jit, 0x47);
+    jit_emit8(jit, offsetof(JitContext, gpr));
+    jit_emit8(jit, 0x4C); // mov r9, [rdi + dmem]
+    jit_emit8(jit, 0x8B);
+    jit_emit8(jit, 0x4F);
+    jit_emit8(jit, offsetof(JitContext, dmem));
+    jit_emit8(jit, 0x4C); // mov r10, [rdi + sreg]
+    jit_emit8(jit, 0x8B);
+    jit_emit8(jit, 0x57);
+    jit_emit8(jit, offsetof(JitContext, sreg));
+
+    for (int i = 0; i < count; i++)
+    {
+        uint16_t addr = start + i;
+        const DecodedInstruction *d = &m->decoded_program[addr];
+        uint8_t mask = live_mask[i];
+        int shift = SHIFT_COUNT(d->immshift);
+
+        switch (d->opcode)
+        {
+        case 0: // ADD
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_ECX, JIT_BASE_GPR, d->r2);
+            if (mask)
+            {
+                jit_emit8(jit, 0x89); // mov edx, eax
+                jit_emit8(jit, 0xC2);
+                jit_emit8(jit, 0xC1); // shl edx, 8
+                jit_emit8(jit, 0xE2);
+                jit_emit8(jit, 8);
+                jit_emit8(jit, 0x09); // or edx, ecx
+                jit_emit8(jit, 0xCA);
+                jit_emit_flags(jit, offsetof(JitContext, add_flags), mask);
+            }
+            jit_emit8(jit, 0x01); // add eax, ecx
+            jit_emit8(jit, 0xC8);
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            break;
+        case 1: // SUB
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_mem(jit, 0x2A, 0, JIT_EAX, JIT_BASE_GPR, d->r2);
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_result_flags(jit, offsetof(JitContext, sub_flags), mask);
+            break;
+        case 2: // MUL
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_ECX, JIT_BASE_GPR, d->r2);
+            jit_emit8(jit, 0x0F); // imul eax, ecx
+            jit_emit8(jit, 0xAF);
+            jit_emit8(jit, 0xC1);
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_result_flags(jit, offsetof(JitContext, nz_flags), mask);
+            break;
+        case 3: // MOVI
+            jit_emit_mem(jit, 0xC6, 0, 0, JIT_BASE_GPR, d->r1);
+            jit_emit8(jit, d->imm);
+            break;
+        case 4: // BEQZ
+            jit_emit_mem(jit, 0x80, 0, 7, JIT_BASE_GPR, d->r1); // cmp byte [r8 + r1], 0
+            jit_emit8(jit, 0);
+            if (d->imm <= 0)
+            {
+                // Taken or not, execution continues in order; a taken
+                // BEQZ only leaves its offset in skipped
+                jit_emit8(jit, 0x75); // jne +7
+                jit_emit8(jit, 7);
+                jit_emit_store_ctx(jit, offsetof(JitContext, skipped), d->imm);
+            }
+            else
+            {
+                jit_emit8(jit, 0x0F); // je taken
+                jit_emit8(jit, 0x84);
+                uint8_t *je = jit->cursor;
+                jit_emit32(jit, 0);
+                jit_emit_clean_exit(jit, addr + 1, i + 1);
+                int32_t rel = jit->cursor - (je + 4);
+                memcpy(je, &rel, 4);
+
+                // Taken: the next min(imm, 2) cycles flush the fetched
+                // instructions, then execution is clean at addr + 1 + imm
+                int target = addr + 1 + d->imm;
+                int flushed = d->imm > 2 ? 2 : d->imm;
+                int safe = d->imm > 2 ? jit_clean_possible(m, target)
+                                      : instruction_fetchable(m, addr + 3) &&
+                                            (d->imm < 2 || instruction_fetchable(m, addr + 4));
+                if (safe)
+                {
+                    jit_emit_store_ctx(jit, offsetof(JitContext, skipped), 0);
+                    jit_emit_clean_exit(jit, target, i + 1 + flushed);
+                }
+                else
+                {
+                    jit_emit_store_ctx(jit, offsetof(JitContext, skipped), flushed);
+                    jit_emit_after_exit(jit, addr, d->imm > 2 ? target : addr + 3, i + 1);
+                }
+            }
+            break;
+        case 5: // ANDI
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit8(jit, 0x25); // and eax, imm32
+            jit_emit32(jit, (int32_t)d->imm);
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_result_flags(jit, offsetof(JitContext, nz_flags), mask);
+            break;
+        case 6: // EOR
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_mem(jit, 0x32, 0, JIT_EAX, JIT_BASE_GPR, d->r2);
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_result_flags(jit, offsetof(JitContext, nz_flags), mask);
+            break;
+        case 7: // BR: target = (GPR[r1] << 8) | GPR[r2], resolved in C
+            jit_emit_mem(jit, 0x0F, 0xBE, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit8(jit, 0xC1); // shl eax, 8
+            jit_emit8(jit, 0xE0);
+            jit_emit8(jit, 8);
+            jit_emit_mem(jit, 0x0F, 0xBE, JIT_ECX, JIT_BASE_GPR, d->r2);
+            jit_emit8(jit, 0x09); // or eax, ecx
+            jit_emit8(jit, 0xC8);
+            jit_emit8(jit, 0x0F); // movzx eax, ax
+            jit_emit8(jit, 0xB7);
+            jit_emit8(jit, 0xC0);
+            jit_emit8(jit, 0x89); // mov [rdi + exit_pc], eax
+            jit_emit8(jit, 0x47);
+            jit_emit8(jit, offsetof(JitContext, exit_pc));
+            jit_emit_cycles(jit, i + 1);
+            jit_emit_store_ctx(jit, offsetof(JitContext, exit_kind), JIT_EXIT_BR);
+            jit_emit8(jit, 0xC3);
+            break;
+        case 8: // SAL
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_GPR, d->r1);
+            if (shift)
+            {
+                jit_emit8(jit, 0xC1); // shl eax, shift
+                jit_emit8(jit, 0xE0);
+                jit_emit8(jit, shift);
+            }
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_result_flags(jit, offsetof(JitContext, nz_flags), mask);
+            break;
+        case 9: // SAR
+            jit_emit_mem(jit, 0x0F, 0xBE, JIT_EAX, JIT_BASE_GPR, d->r1);
+            if (shift)
+            {
+                jit_emit8(jit, 0xC1); // sar eax, shift
+                jit_emit8(jit, 0xF8);
+                jit_emit8(jit, shift);
+            }
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_result_flags(jit, offsetof(JitContext, nz_flags), mask);
+            break;
+        case 10: // LDR: also skips the next fetch (PC += 1)
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_DMEM, d->imm);
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_after_exit(jit, addr, addr + 4, i + 1);
+            break;
+        case 11: // STR
+            jit_emit_mem(jit, 0x0F, 0xB6, JIT_EAX, JIT_BASE_GPR, d->r1);
+            jit_emit_mem(jit, 0x88, 0, JIT_EAX, JIT_BASE_DMEM, d->imm);
+            jit_emit_mark_dirty(jit, DIRTY_BIT(d->imm));
+            break;
+        default: // Invalid opcodes do nothing
+            break;
+        }
+    }
+    if (!terminated)
+        jit_emit_clean_exit(jit, start + count, count);
+
+    jit->used = jit->cursor - jit->code;
+    jit->block_offset[start] = offset;
+
+    // Chain exits that were waiting for this block
+    for (int i = 0; i < jit->chain_count; i++)
+    {
+        if (jit->chains[i].target == start)
+        {
+            jit_patch_chain(jit, jit->chains[i].stub, offset);
+            jit->chains[i] = jit->chains[--jit->chain_count];
+            i--;
+        }
+    }
+    if (!jit_protect(jit, 0))
+    {
+        jit_reset(jit); // No block may run from a cache that cannot execute
+        return JIT_UNCOMPILABLE;
+    }
+    return offset;
+}
+
+// Translation cache lookup, translating on a miss
+static int32_t jit_lookup(Machine *m, uint16_t pc)
+{
+    JitCache *jit = m->jit;
+    int32_t offset = jit->block_offset[pc];
+    if (offset == JIT_NOT_COMPILED)
+    {
+        offset = jit_compile_block(m, pc);
+        if (offset == JIT_UNCOMPILABLE)
+            jit->block_offset[pc] = JIT_UNCOMPILABLE;
+    }
+    return offset;
+}
+
+pthread_once_t jit_tables_once = PTHREAD_ONCE_INIT;
+
+// Give the machine its own translation cache; returns 0 if that is impossible
+int jit_init(Machine *m)
+{
+    if (m->jit != NULL)
+        return 1;
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return 0;
+    JitCache *jit = malloc(sizeof(JitCache));
+    if (jit == NULL)
+    {
+        munmap(code, JIT_CODE_SIZE);
+        return 0;
+    }
+    jit->code = code;
+    jit_reset(jit);
+    pthread_once(&jit_tables_once, jit_build_flag_tables);
+    m->jit = jit;
+    return 1;
+}
+
+void jit_free(Machine *m)
+{
+    if (m->jit == NULL)
+        return;
+    munmap(m->jit->code, JIT_CODE_SIZE);
+    free(m->jit);
+    m->jit = NULL;
+}
+#else
+int jit_init(Machine *m)
+{
+    (void)m;
+    return 0;
+}
+
+void jit_free(Machine *m)
+{
+    (void)m;
+}
+#endif
+
+#if JIT_SUPPORTED
+// Native code keeps SREG as a byte while it runs
+static void jit_store_sreg(Machine *m, uint8_t byte)
+{
+    SREG_t sreg;
+    memcpy(&sreg, &byte, 1);
+    machine_set_sreg(m, sreg);
+}
+#endif
+
+// Run translated blocks from a clean pipeline state at start, for at most
+// budget cycles. Returns the number of cycles executed (0 if there is no
+// block for start), and leaves the pipeline buffers, PC and skipped exactly
+// as the interpreter would.
+long long jit_enter(Machine *m, uint16_t start, long long budget)
+{
+#if JIT_SUPPORTED
+    typedef void (*JitBlock)(JitContext *);
+    uint8_t sreg = sreg_byte(machine_sreg(m));
+    JitContext ctx = {m->GPR, m->data_memory, &sreg,
+                      jit_add_flags, jit_sub_flags, jit_nz_flags,
+                      0, 0, m->skipped, 0, 0, 0, &m->dirty, &m->touched};
+    uint16_t pc = start;
+
+    if (budget > JIT_FUEL)
+        budget = JIT_FUEL;
+    ctx.fuel = budget - JIT_FUEL_MARGIN;
+    if (ctx.fuel <= 0)
+        return 0;
+
+    for (;;)
+    {
+        int32_t offset = jit_lookup(m, pc);
+        if (offset < 0)
+            break;
+        ((JitBlock)(void *)(m->jit->code + offset))(&ctx);
+
+        if (ctx.exit_kind == JIT_EXIT_CLEAN)
+        {
+            pc = ctx.exit_pc;
+        }
+        else if (ctx.exit_kind == JIT_EXIT_BR && jit_clean_possible(m, ctx.exit_pc))
+        {
+            // The two flushed cycles after BR end clean at the target
+            ctx.cycles += 2;
+            ctx.fuel -= 2;
+            pc = ctx.exit_pc;
+        }
+        else if (ctx.exit_kind == JIT_EXIT_BR)
+        {
+            m->IF_buffer = NOP_INSTR;
+            m->ID_buffer = NOP_INSTR;
+            m->PC = ctx.exit_pc;
+            m->skipped = ctx.skipped;
+            jit_store_sreg(m, sreg);
+            return ctx.cycles;
+        }
+        else
+        {
+            uint16_t addr = ctx.exit_addr;
+            m->ID_buffer = m->instruction_memory[addr + 1];
+            m->ID_addr = addr + 1;
+            m->IF_buffer = m->instruction_memory[addr + 2];
+            m->IF_addr = addr + 2;
+            m->PC = ctx.exit_pc;
+            m->skipped = ctx.skipped;
+            jit_store_sreg(m, sreg);
+            return ctx.cycles;
+        }
+        if (ctx.fuel <= 0)
+            break;
+    }
+
+    if (ctx.cycles > 0)
+    {
+        m->ID_buffer = m->instruction_memory[pc];
+        m->ID_addr = pc;
+        m->IF_buffer = m->instruction_memory[pc + 1];
+        m->IF_addr = pc + 1;
+        m->PC = pc + 2;
+        m->skipped = ctx.skipped;
+        jit_store_sreg(m, sreg);
+    }
+    return ctx.cycles;
+#else
+    (void)m;
+    (void)start;
+    (void)budget;
+    return 0;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Basic-block memoization (--engine=memo)
+//
+// Straight-line runs of ALU instructions, MOVI and STR are analysed once for
+// the registers they read before writing them (the inputs), the registers
+// and data memory addresses they write and whether they set flags. The
+// first time a block runs with some input values it is executed by the
+// threaded handlers and its effect is stored under those values; when the
+// same values come again the stored registers, bytes and flags are written
+// back in one step. Like JIT blocks, a block is only entered from a clean
+// pipeline state and only covers instructions whose fetches stay inside
+// the program, so it takes exactly one cycle per instruction and leaves the
+// buffers as the interpreter would.
+//
+// BEQZ, BR and LDR end a block (they move the PC or flush), so blocks never
+// read data memory. Programs with an STR to a negative address can rewrite
+// their own code and are not memoized at all.
+// ---------------------------------------------------------------------------
+#define MEMO_MAX_BLOCK 32
+#define MEMO_MIN_BLOCK 3 // shorter blocks are cheaper to interpret
+#define MEMO_ENTRIES 64  // remembered input values per block, direct-mapped
+#define MEMO_TRIAL 256   // lookups before a block that rarely hits is given up
+
+// Flags a block writes; the others keep their values from before the block
+#define MEMO_FLAGS_NZ 1 // any ALU instruction
+#define MEMO_FLAGS_VS 2 // ADD, SUB
+#define MEMO_FLAGS_C 4  // ADD
+
+typedef struct
+{
+    uint8_t length;       // instructions
+    uint8_t inputs;
+    uint8_t outputs;
+    uint8_t stores;       // distinct addresses
+    uint8_t writes_flags; // MEMO_FLAGS_*
+    uint8_t given_up;     // hit too rarely to pay for the lookups
+    uint32_t lookups;     // during the trial
+    uint32_t hits;
+    uint8_t in_regs[NUM_GPRS];
+    uint8_t out_regs[NUM_GPRS];
+    int16_t store_addr[MEMO_MAX_BLOCK];
+    size_t stride;        // bytes per entry: valid, inputs, outputs, stores, flags
+    uint8_t *entries;     // MEMO_ENTRIES * stride
+} MemoBlock;
+
+typedef struct MemoCache
+{
+    MemoBlock *blocks[INSTRUCTION_MEMORY_SIZE]; // per clean address, once analysed
+    int8_t analysed[INSTRUCTION_MEMORY_SIZE];   // 1: block, -1: cannot be memoized
+    int code_writes;                            // an STR reaches instruction memory
+    long long lookups;
+    long long hits;
+    long long instructions; // executed inside blocks
+} MemoCache;
+
+// Forget every block; the program was (re)loaded
+void memo_reset(Machine *m)
+{
+    MemoCache *memo = m->memo;
+    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
+    {
+        if (memo->blocks[i] != NULL)
+        {
+            free(memo->blocks[i]->entries);
+            free(memo->blocks[i]);
+            memo->blocks[i] = NULL;
+        }
+        memo->analysed[i] = 0;
+    }
+    memo->code_writes = 0;
+    for (int i = 0; i < machine_code_end(m); i++)
+        memo->code_writes |= m->decoded_program[i].opcode == 11 && address_in_code(m->decoded_program[i].imm);
+}
+
+int memo_init(Machine *m)
+{
+    m->memo = calloc(1, sizeof(MemoCache));
+    return m->memo != NULL;
+}
+
+void memo_free(Machine *m)
+{
+    if (m->memo == NULL)
+        return;
+    memo_reset(m);
+    free(m->memo);
+    m->memo = NULL;
+}
+
+// Find the block at a clean address and its read and write sets; NULL if it
+// is too short
+static MemoBlock *memo_analyse(Machine *m, uint16_t start)
+{
+    int count = 0;
+    uint64_t written = 0;
+    uint64_t read = 0;
+    MemoBlock block = {0};
+    while (count < MEMO_MAX_BLOCK && instruction_fetchable(m, start + count + 2))
+    {
+        const DecodedInstruction *d = &m->decoded_program[start + count];
+        int op = d->opcode;
+        if (op == 4 || op == 7 || op == 10 || (op == 11 && address_in_code(d->imm)))
+            break;
+        int reads_r1 = op <= 2 || op == 5 || op == 6 || op == 8 || op == 9 || op == 11;
+        int reads_r2 = op <= 2 || op == 6;
+        int writes_r1 = op <= 3 || op == 5 || op == 6 || op == 8 || op == 9;
+        if (reads_r1 && !((written | read) >> d->r1 & 1))
+        {
+            block.in_regs[block.inputs++] = d->r1;
+            read |= 1ULL << d->r1;
+        }
+        if (reads_r2 && !((written | read) >> d->r2 & 1))
+        {
+            block.in_regs[block.inputs++] = d->r2;
+            read |= 1ULL << d->r2;
+        }
+        if (writes_r1 && !(written >> d->r1 & 1))
+        {
+            block.out_regs[block.outputs++] = d->r1;
+            written |= 1ULL << d->r1;
+        }
+        if (op == 11)
+        {
+            int seen = 0;
+            for (int i = 0; i < block.stores; i++)
+                seen |= block.store_addr[i] == d->imm;
+            if (!seen)
+                block.store_addr[block.stores++] = d->imm;
+        }
+        if (op <= 2 || op == 5 || op == 6 || op == 8 || op == 9)
+            block.writes_flags |= MEMO_FLAGS_NZ;
+        if (op <= 1)
+            block.writes_flags |= MEMO_FLAGS_VS;
+        if (op == 0)
+            block.writes_flags |= MEMO_FLAGS_C;
+        count++;
+    }
+    if (count < MEMO_MIN_BLOCK)
+        return NULL;
+
+    block.length = count;
+    block.stride = 1 + block.inputs + block.outputs + block.stores + sizeof(FlagState);
+    MemoBlock *b = malloc(sizeof(MemoBlock));
+    if (b == NULL)
+        return NULL;
+    *b = block;
+    b->entries = calloc(MEMO_ENTRIES, b->stride);
+    if (b->entries == NULL)
+    {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+// Copy the flag groups in mask (MEMO_FLAGS_*) from src to m
+static void memo_set_flags(Machine *m, const FlagState *src, int mask)
+{
+#if LAZY_FLAGS
+    if (mask & MEMO_FLAGS_C)
+        m->flags.carry_sum = src->carry_sum;
+    if (mask & MEMO_FLAGS_VS)
+    {
+        m->flags.vs_a = src->vs_a;
+        m->flags.vs_b = src->vs_b;
+        m->flags.vs_result = src->vs_result;
+    }
+    if (mask & MEMO_FLAGS_NZ)
+        m->flags.nz_result = src->nz_result;
+#else
+    if (mask & MEMO_FLAGS_C)
+        m->flags.C = src->C;
+    if (mask & MEMO_FLAGS_VS)
+    {
+        m->flags.V = src->V;
+        m->flags.S = src->S;
+    }
+    if (mask & MEMO_FLAGS_NZ)
+    {
+        m->flags.N = src->N;
+        m->flags.Z = src->Z;
+    }
+#endif
+}
+
+// Run the block at a clean pipeline state at start, from its stored effect
+// when its inputs were seen before. Returns the number of cycles executed
+// (0 if there is no block for start or it does not fit in budget).
+long long memo_enter(Machine *m, uint16_t start, long long budget)
+{
+    MemoCache *memo = m->memo;
+    if (memo->code_writes || memo->analysed[start] < 0)
+        return 0; // the cycle loop checks this before calling
+    if (memo->analysed[start] == 0 && budget >= MEMO_MAX_BLOCK)
+    {
+        memo->blocks[start] = memo_analyse(m, start);
+        memo->analysed[start] = memo->blocks[start] != NULL ? 1 : -1;
+    }
+    MemoBlock *b = memo->blocks[start];
+    if (b == NULL || b->given_up || b->length > budget)
+        return 0;
+    if (b->lookups == MEMO_TRIAL)
+    {
+        // Inputs that keep changing (a loop counter, say) make every lookup
+        // a miss; the interpreter is cheaper for those blocks
+        b->given_up = b->hits < MEMO_TRIAL / 4;
+        b->lookups++;
+        if (b->given_up)
+        {
+            // The interpreter now runs it and passes a clean state at every
+            // address inside; blocks starting there read mostly the same
+            // changing registers, so they are not tried either
+            for (int i = 0; i < b->length; i++)
+                memo->analysed[start + i] = memo->analysed[start + i] ? memo->analysed[start + i] : -1;
+            memo->analysed[start] = -1;
+            return 0;
+        }
+    }
+
+    uint8_t key[NUM_GPRS];
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < b->inputs; i++)
+    {
+        key[i] = m->GPR[b->in_regs[i]];
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    uint8_t *entry = b->entries + (hash % MEMO_ENTRIES) * b->stride;
+    uint8_t *outputs = entry + 1 + b->inputs;
+    uint8_t *stores = outputs + b->outputs;
+    uint8_t *flags = stores + b->stores;
+    memo->lookups++;
+    memo->instructions += b->length;
+    b->lookups += b->lookups < MEMO_TRIAL;
+
+    if (entry[0] && memcmp(entry + 1, key, b->inputs) == 0)
+    {
+        memo->hits++;
+        b->hits += b->hits < MEMO_TRIAL;
+        for (int i = 0; i < b->outputs; i++)
+            m->GPR[b->out_regs[i]] = outputs[i];
+        for (int i = 0; i < b->stores; i++)
+        {
+            m->data_memory[b->store_addr[i]] = stores[i];
+            MARK_DIRTY(m, b->store_addr[i]);
+        }
+        FlagState stored;
+        memcpy(&stored, flags, sizeof(FlagState));
+        memo_set_flags(m, &stored, b->writes_flags);
+    }
+    else
+    {
+        for (int i = 0; i < b->length; i++)
+            m->decoded_handlers[start + i](m, &m->decoded_program[start + i]);
+        entry[0] = 1;
+        memcpy(entry + 1, key, b->inputs);
+        for (int i = 0; i < b->outputs; i++)
+            outputs[i] = m->GPR[b->out_regs[i]];
+        for (int i = 0; i < b->stores; i++)
+            stores[i] = m->data_memory[b->store_addr[i]];
+        memcpy(flags, &m->flags, sizeof(FlagState));
+    }
+
+    uint16_t pc = start + b->length;
+    m->EX_buffer = &m->decoded_program[pc - 1];
+    m->ID_buffer = m->instruction_memory[pc];
+    m->ID_addr = pc;
+    m->IF_buffer = m->instruction_memory[pc + 1];
+    m->IF_addr = pc + 1;
+    m->PC = pc + 2;
+    return b->length;
+}
+
+// Block statistics on stderr; cycles is the total of the runs
+void memo_report(const MemoCache *memo, long long cycles)
+{
+    int blocks = 0;
+    int given_up = 0;
+    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
+    {
+        blocks += memo->blocks[i] != NULL;
+        given_up += memo->blocks[i] != NULL && memo->blocks[i]->given_up;
+    }
+    fprintf(stderr, "memo: blocks=%d (given up %d) lookups=%lld hits=%lld (%.1f%%) block cycles=%lld (%.1f%% of %lld)%s\n", blocks, given_up,
+            memo->lookups, memo->hits, memo->lookups ? 100.0 * memo->hits / memo->lookups : 0.0, memo->instructions,
+            cycles ? 100.0 * memo->instructions / cycles : 0.0, cycles,
+            memo->code_writes ? ", off: the program writes instruction memory" : "");
+}
+
+// Decode the whole of instruction memory; call after loading a program
+void predecode_program(Machine *m)
+{
+    // Entries past both the old and the new end already decode a zero word
+    int code_end = machine_code_end(m);
+    int end = code_end > m->decoded_end ? code_end : m->decoded_end;
+    m->decoded_end = code_end;
+    for (int i = 0; i < end; i++)
+    {
+        m->decoded_program[i] = decode_instruction(m->instruction_memory[i]);
+        m->decoded_handlers[i] = execute_handlers[m->decoded_program[i].opcode & 0x0F];
+    }
+    if (m->jit != NULL)
+        jit_reset(m->jit);
+    if (m->memo != NULL)
+        memo_reset(m);
+}
+
+// Parse an execution engine name; returns -1 if unknown
+int parse_engine(const char *name)
+{
+    if (strcmp(name, "switch") == 0)
+        return ENGINE_SWITCH;
+    if (strcmp(name, "threaded") == 0)
+        return ENGINE_THREADED;
+    if (strcmp(name, "jit") == 0)
+        return ENGINE_JIT;
+    if (strcmp(name, "memo") == 0)
+        return ENGINE_MEMO;
+    return -1;
+}
+
+// Add this helper function at file scope:
+void print_instruction_human(Machine *m, const DecodedInstruction *d, const char *stage)
+{
+    const char *mnemonics[] = {"ADD", "SUB", "MUL", "MOVI", "BEQZ", "ANDI", "EOR", "BR", "SAL", "SAR", "LDR", "STR"};
+    if (d->opcode > 11)
+    {
+        trace_printf(&m->trace, "  %s: (Invalid)\n", stage);
+        return;
+    }
+    // Print based on instruction type
+    switch (d->opcode)
+    {
+    case 0:
+    case 1:
+    case 2:
+    case 6:
+    case 7: // R-type: ADD, SUB, MUL, EOR, BR
+        trace_printf(&m->trace, "  %s: %s R%d, R%d\n", stage, mnemonics[d->opcode], d->r1, d->r2);
+        break;
+    case 3:
+    case 5: // I-type: MOVI, ANDI
+        trace_printf(&m->trace, "  %s: %s R%d, %d\n", stage, mnemonics[d->opcode], d->r1, get_imm_value(d->imm));
+        break;
+    case 8:
+    case 9: // Shifts: SAL, SAR (unsigned shift amount)
+        trace_printf(&m->trace, "  %s: %s R%d, %d\n", stage, mnemonics[d->opcode], d->r1, d->immshift);
+        break;
+    case 4: // BEQZ
+        trace_printf(&m->trace, "  %s: %s R%d, %d\n", stage, mnemonics[d->opcode], d->r1,get_imm_value(d->imm));
+        break;
+    case 10:
+    case 11: // LDR, STR
+        trace_printf(&m->trace, "  %s: %s R%d, [%d]\n", stage, mnemonics[d->opcode], d->r1, get_imm_value(d->imm));
+        break;
+    default:
+        trace_printf(&m->trace, "  %s: (Unknown)\n", stage);
+    }
+}
+
+// Print the IF/ID/EX contents of a cycle whose EX stage is not flushed
+void trace_cycle(Machine *m, long long cycle, const DecodedInstruction *ex_instr)
+{
+    trace_printf(&m->trace, "\nCycle %lld:\n", cycle);
+    print_instruction_human(m, buffer_decoded(m, m->IF_buffer, m->IF_addr), "IF");
+    print_instruction_human(m, buffer_decoded(m, m->ID_buffer, m->ID_addr), "ID");
+    if (ex_instr->opcode == 0xFF)
+    {
+        trace_printf(&m->trace, "  EX: (NOP)\n");
+    }
+    else
+    {
+        print_instruction_human(m, ex_instr, "EX");
+    }
+}
+
+// get signed value of the immediate
+
+
+// Final register/memory dump printed at the end of a run (TRACE_SUMMARY)
+void trace_final_state(Machine *m)
+{
+    if (m->trace.level < TRACE_SUMMARY)
+        return;
+
+    trace_printf(&m->trace, "Execution complete. Final PC = 0x%04X\n", m->PC);
+
+    trace_printf(&m->trace, "\nFinal Register Values:\n");
+    for (int i = 0; i < NUM_GPRS; i++)
+    {
+        trace_printf(&m->trace, "R%d = %d\n", i, m->GPR[i]);
+    }
+    trace_printf(&m->trace, "PC = %d\n", m->PC);
+    SREG_t sreg = machine_sreg(m);
+    trace_printf(&m->trace, "SREG: C=%d V=%d N=%d S=%d Z=%d\n", sreg.C, sreg.V, sreg.N, sreg.S, sreg.Z);
+    trace_printf(&m->trace, "\nInstruction Memory (nonzero):\n");
+    int code_end = machine_code_end(m);
+    for (int i = 0; i < code_end; i++)
+    {
+        if (m->instruction_memory[i] != 0)
+            trace_printf(&m->trace, "Addr %d: 0x%04X\n", i, m->instruction_memory[i]);
+    }
+    // Pages neither written nor initialised are still zero
+    trace_printf(&m->trace, "\nData Memory (nonzero):\n");
+    uint64_t pages = m->touched | m->initial_pages;
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if (!((pages >> p) & 1))
+            continue;
+        for (int i = p * DATA_PAGE_SIZE; i < (p + 1) * DATA_PAGE_SIZE; i++)
+        {
+            if (m->data_memory[i] != 0)
+                trace_printf(&m->trace, "Addr %d: 0x%02X\n", i, m->data_memory[i]);
+        }
+    }
+}
+
+// Put the pipeline in its reset state: empty buffers, cycle 0
+void pipeline_start(Machine *m)
+{
+    m->remaining = INT32_MAX;
+    m->skipped = 0;
+    m->cycle = 0;
+    int n = 0; // Number of loaded instructions
+    int code_end = machine_code_end(m);
+    for (int i = 0; i < code_end; i++)
+    {
+        if (m->instruction_memory[i] != 0)
+            n++;
+    }
+    TRACE(m, TRACE_SUMMARY, "initialized count is: %d\n", n);
+    // Initialize pipeline buffers to NOP
+    m->IF_buffer = NOP_INSTR;
+    m->ID_buffer = NOP_INSTR;
+    m->IF_addr = m->ID_addr = 0;
+    m->IF_pred = m->ID_pred = 0;
+    m->EX_buffer = &nop_decoded; // Use 0xFF as NOP/invalid
+}
+
+// ---------------------------------------------------------------------------
+// Binary execution trace (--record, --replay)
+//
+// A trace file starts with TRACE_FILE_MAGIC, a version, flags and the state
+// the run starts from in checkpoint format. One record per cycle follows: a
+// tag byte whose TREC_* bits say what happened in the cycle, then the data
+// of the bits that have some, in bit order:
+//   TREC_PC    PC after the cycle minus PC after the fetch (varint)
+//   TREC_REG   register number and its new value (two bytes)
+//   TREC_MEM   store address minus the previous store address (varint),
+//              then the stored byte
+//   TREC_SREG  SREG byte, only when it changed
+//   TREC_SKIP  new flush counter (varint)
+// Varints are zigzag encoded, 7 bits per byte. The cycle number and the
+// IF/ID/EX contents follow from the previous cycle and the TREC_FETCH_NOP
+// (IF fetched nothing), TREC_FLUSH (EX flushed by a branch) and TREC_BR
+// (IF and ID cleared by BR) bits, so most cycles take one to four bytes.
+// TREC_END, which no cycle can produce, ends the run and is followed by
+// the final cycle count.
+//
+// The simulation thread encodes records straight into a ring buffer and
+// publishes them every TRACE_PUBLISH_BYTES; a writer thread copies what was
+// published to the file. Each position is only advanced by one side, so
+// the threads share no lock and the simulation only waits when the writer
+// is a whole ring behind.
+// ---------------------------------------------------------------------------
+#define TRACE_FILE_MAGIC "PSTR"
+#define TRACE_FILE_VERSION 1
+#define TRACE_FROM_START 1 // flags: the run starts at pipeline_start (replay prints its line)
+#define TRACE_RING_SIZE (1 << 20)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+#define TRACE_PUBLISH_BYTES (1 << 14)
+#define TRACE_RECORD_MAX 32 // longer than any record
+
+#define TREC_FETCH_NOP 0x01
+#define TREC_FLUSH 0x02
+#define TREC_BR 0x04
+#define TREC_PC 0x08
+#define TREC_REG 0x10
+#define TREC_MEM 0x20
+#define TREC_SREG 0x40
+#define TREC_SKIP 0x80
+#define TREC_END 0xFF
+
+typedef struct TraceRecorder
+{
+    uint8_t *ring;    // TRACE_RING_SIZE bytes
+    size_t head;      // bytes encoded so far
+    size_t limit;     // recorder_sync is due when head gets here
+    long long stalls; // times the simulation had to wait for the writer
+    long long start_cycle;
+    int last_address; // address of the previous store
+    uint8_t sreg;     // SREG as of the last record
+    FILE *file;
+    pthread_t writer;
+    // Shared with the writer thread, on their own cache lines
+    size_t published __attribute__((aligned(64))); // bytes the writer may take
+    size_t tail __attribute__((aligned(64)));      // bytes the writer wrote
+    int closing; // set once the last byte is published
+} TraceRecorder;
+
+static inline uint32_t trace_zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// Byte stores into the ring may alias anything, so records are encoded
+// with a local copy of the head and every machine field read beforehand
+static inline void trace_put(uint8_t *ring, size_t *head, uint8_t byte)
+{
+    ring[(*head)++ & TRACE_RING_MASK] = byte;
+}
+
+static inline void trace_put_varint(uint8_t *ring, size_t *head, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        trace_put(ring, head, value | 0x80);
+        value >>= 7;
+    }
+    trace_put(ring, head, value);
+}
+
+// Publish everything encoded so far and wait until the ring has room for
+// the next record
+void recorder_sync(TraceRecorder *rec)
+{
+    struct timespec pause = {0, 20000};
+    __atomic_store_n(&rec->published, rec->head, __ATOMIC_RELEASE);
+    size_t tail = __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE);
+    if (rec->head + TRACE_RECORD_MAX > tail + TRACE_RING_SIZE)
+    {
+        rec->stalls++;
+        while (rec->head + TRACE_RECORD_MAX > tail + TRACE_RING_SIZE)
+        {
+            nanosleep(&pause, NULL);
+            tail = __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    rec->limit = tail + TRACE_RING_SIZE - TRACE_RECORD_MAX;
+    if (rec->limit > rec->head + TRACE_PUBLISH_BYTES)
+        rec->limit = rec->head + TRACE_PUBLISH_BYTES;
+}
+
+// Record a cycle flushed by a branch
+static inline void recorder_flush_cycle(TraceRecorder *rec, const Machine *m)
+{
+    if (rec->head >= rec->limit)
+        recorder_sync(rec);
+    rec->ring[rec->head++ & TRACE_RING_MASK] = TREC_FLUSH | (m->PC == m->IF_addr ? TREC_FETCH_NOP : 0);
+}
+
+// Record a cycle in which EX ran ex (maybe the NOP); pc is the PC after the
+// fetch and skipped the flush counter before EX
+static inline void recorder_cycle(TraceRecorder *rec, const Machine *m, const DecodedInstruction *ex, uint16_t pc,
+                                  int skipped)
+{
+    if (rec->head >= rec->limit)
+        recorder_sync(rec);
+    uint8_t tag = pc == m->IF_addr ? TREC_FETCH_NOP : 0;
+    int pc_delta = m->PC - pc;
+    int new_skipped = m->skipped;
+    int8_t value = 0;
+    uint8_t sreg = rec->sreg;
+    switch (ex->opcode)
+    {
+    case 4:  // BEQZ
+    case 12: // invalid
+    case 13:
+    case 14:
+    case 15:
+    case 0xFF: // NOP
+        break;
+    case 7: // BR
+        tag |= TREC_BR;
+        break;
+    case 11: // STR
+        tag |= TREC_MEM;
+        value = data_read(m, ex->imm);
+        break;
+    case 3:  // MOVI
+    case 10: // LDR
+        tag |= TREC_REG;
+        value = m->GPR[ex->r1];
+        break;
+    default:
+        tag |= TREC_REG;
+        value = m->GPR[ex->r1];
+        sreg = sreg_byte(machine_sreg(m));
+        break;
+    }
+    if (pc_delta != 0)
+        tag |= TREC_PC;
+    if (sreg != rec->sreg)
+        tag |= TREC_SREG;
+    if (new_skipped != skipped)
+        tag |= TREC_SKIP;
+
+    uint8_t *ring = rec->ring;
+    size_t head = rec->head;
+    trace_put(ring, &head, tag);
+    if (tag & TREC_PC)
+        trace_put_varint(ring, &head, trace_zigzag(pc_delta));
+    if (tag & TREC_REG)
+    {
+        trace_put(ring, &head, ex->r1);
+        trace_put(ring, &head, value);
+    }
+    if (tag & TREC_MEM)
+    {
+        trace_put_varint(ring, &head, trace_zigzag(ex->imm - rec->last_address));
+        trace_put(ring, &head, value);
+        rec->last_address = ex->imm;
+    }
+    if (tag & TREC_SREG)
+    {
+        trace_put(ring, &head, sreg);
+        rec->sreg = sreg;
+    }
+    if (tag & TREC_SKIP)
+        trace_put_varint(ring, &head, trace_zigzag(new_skipped));
+    rec->head = head;
+}
+
+// ---------------------------------------------------------------------------
+// Branch prediction model (--predictor, --btb)
+//
+// Models how many cycles a fetch stage with a branch predictor would spend.
+// When IF fetches a BEQZ, the predictor's scheme guesses its direction (the
+// target is in the instruction); a BR is looked up in the branch target
+// buffer. The guess travels down the pipeline with the instruction, and in
+// EX it is compared with what the branch did and the tables are updated.
+// A correctly predicted taken branch costs no cycles, where the pipeline
+// flushes the instructions behind it. Fetching the wrong path costs the two
+// cycles of refetching from EX, and predicting "go on sequentially" costs
+// what the branch costs now.
+//
+// The fetched words themselves are not redirected: BEQZ computes its target
+// from the PC in EX and LDR moves the PC of instructions already fetched,
+// so the program's results depend on the order in which words are fetched.
+// Keeping that order means results and the pipeline's own cycle count stay
+// exactly as they are, and the predicted cycle count is reported next to
+// them. BEQZ with an offset of 0 or less does not branch and is not
+// predicted.
+//
+// A scheme is a row in predictor_schemes: a name, a guess from the counter
+// table (and the branch and target addresses) and an update with the
+// outcome, so adding one is adding a row.
+// ---------------------------------------------------------------------------
+#define PREDICTOR_ENTRIES 64 // default counter table size
+#define BTB_ENTRIES 16        // default branch target buffer size
+#define MISPREDICT_PENALTY 2  // cycles to refetch once EX resolved a branch
+
+typedef struct BranchPredictor BranchPredictor;
+
+typedef struct
+{
+    const char *name;
+    int (*predict)(const BranchPredictor *bp, int pc, int target); // 1: taken
+    void (*update)(BranchPredictor *bp, int pc, int taken);
+} PredictorScheme;
+
+typedef struct
+{
+    int pc; // -1 when empty
+    int target;
+} BtbEntry;
+
+struct BranchPredictor
+{
+    const PredictorScheme *scheme;
+    int entries; // counter table size, a power of two
+    int btb_entries; // a power of two, or 0 for no BTB
+    uint8_t *counters;
+    BtbEntry *btb;
+    long long beqz;          // BEQZ resolved in EX
+    long long beqz_taken;
+    long long br;            // BR resolved in EX
+    long long mispredicts;
+    long long branch_cycles; // cycles the pipeline spent on branches
+    long long predicted_cycles; // cycles it would with the predictor
+};
+
+static int predict_not_taken(const BranchPredictor *bp, int pc, int target)
+{
+    (void)bp;
+    (void)pc;
+    (void)target;
+    return 0;
+}
+
+static int predict_backward(const BranchPredictor *bp, int pc, int target)
+{
+    (void)bp;
+    return target <= pc;
+}
+
+static int predict_counter(const BranchPredictor *bp, int pc, int target)
+{
+    (void)target;
+    return bp->counters[pc & (bp->entries - 1)] >= 2;
+}
+
+static void update_none(BranchPredictor *bp, int pc, int taken)
+{
+    (void)bp;
+    (void)pc;
+    (void)taken;
+}
+
+// 1-bit: the last outcome, stored as 0 or 3
+static void update_1bit(BranchPredictor *bp, int pc, int taken)
+{
+    bp->counters[pc & (bp->entries - 1)] = taken ? 3 : 0;
+}
+
+// 2-bit saturating counter: 2 and 3 predict taken
+static void update_2bit(BranchPredictor *bp, int pc, int taken)
+{
+    uint8_t *counter = &bp->counters[pc & (bp->entries - 1)];
+    if (taken && *counter < 3)
+        (*counter)++;
+    else if (!taken && *counter > 0)
+        (*counter)--;
+}
+
+const PredictorScheme predictor_schemes[] = {
+    {"not-taken", predict_not_taken, update_none},
+    {"backward", predict_backward, update_none},
+    {"1bit", predict_counter, update_1bit},
+    {"2bit", predict_counter, update_2bit},
+};
+
+// Predicted fetch address (plus one) after the instruction at pc, or 0
+static inline int predictor_lookup(const BranchPredictor *bp, const Machine *m, int pc)
+{
+    const DecodedInstruction *d = &m->decoded_program[pc];
+    if (d->opcode == 4 && d->imm > 0)
+    {
+        int target = pc + 1 + d->imm;
+        return bp->scheme->predict(bp, pc, target) ? target + 1 : 0;
+    }
+    if (d->opcode == 7 && bp->btb_entries > 0)
+    {
+        const BtbEntry *entry = &bp->btb[pc & (bp->btb_entries - 1)];
+        if (entry->pc == pc)
+            return entry->target + 1;
+    }
+    return 0;
+}
+
+// Compare the guess made at fetch (predicted, as from predictor_lookup) with
+// the BEQZ or BR EX just executed, count the cycles and train the tables
+void predictor_resolve(BranchPredictor *bp, const Machine *m, const DecodedInstruction *d, int predicted)
+{
+    int pc = (int)(d - m->decoded_program);
+    int taken;
+    int target;
+    int cost; // cycles the pipeline loses to this branch
+    if (d->opcode == 4)
+    {
+        if (d->imm <= 0)
+            return;
+        taken = m->GPR[d->r1] == 0;
+        target = d->imm > 2 ? m->PC : pc + 1 + d->imm;
+        cost = taken ? m->skipped : 0;
+        bp->beqz++;
+        bp->beqz_taken += taken;
+        bp->scheme->update(bp, pc, taken);
+    }
+    else
+    {
+        taken = 1;
+        target = m->PC;
+        cost = MISPREDICT_PENALTY; // IF and ID were cleared
+        bp->br++;
+        if (bp->btb_entries > 0)
+            bp->btb[pc & (bp->btb_entries - 1)] = (BtbEntry){pc, target};
+    }
+
+    int predicted_cost;
+    if (predicted == 0)
+        predicted_cost = cost; // fetch went on sequentially, as it does now
+    else if (taken && predicted - 1 == target)
+        predicted_cost = 0;
+    else
+        predicted_cost = MISPREDICT_PENALTY;
+    bp->mispredicts += predicted == 0 ? taken : predicted_cost > 0;
+    bp->branch_cycles += cost;
+    bp->predicted_cycles += predicted_cost;
+}
+
+// Parse --predictor=SCHEME[:ENTRIES] and set up the predictor with a BTB of
+// btb_entries; returns NULL if the scheme or a size is not valid
+BranchPredictor *predictor_create(const char *spec, int btb_entries)
+{
+    const PredictorScheme *scheme = NULL;
+    const char *colon = strchr(spec, ':');
+    size_t length = colon ? (size_t)(colon - spec) : strlen(spec);
+    int entries = colon ? atoi(colon + 1) : PREDICTOR_ENTRIES;
+    for (size_t i = 0; i < sizeof(predictor_schemes) / sizeof(predictor_schemes[0]); i++)
+    {
+        if (strlen(predictor_schemes[i].name) == length && strncmp(spec, predictor_schemes[i].name, length) == 0)
+            scheme = &predictor_schemes[i];
+    }
+    if (scheme == NULL || entries <= 0 || (entries & (entries - 1)) != 0 || btb_entries < 0 ||
+        (btb_entries & (btb_entries - 1)) != 0)
+        return NULL;
+
+    BranchPredictor *bp = calloc(1, sizeof(BranchPredictor));
+    if (bp == NULL)
+        return NULL;
+    bp->scheme = scheme;
+    bp->entries = entries;
+    bp->btb_entries = btb_entries;
+    bp->counters = malloc(entries);
+    bp->btb = malloc((btb_entries ? btb_entries : 1) * sizeof(BtbEntry));
+    if (bp->counters == NULL || bp->btb == NULL)
+    {
+        free(bp->counters);
+        free(bp->btb);
+        free(bp);
+        return NULL;
+    }
+    memset(bp->counters, 1, entries); // weakly not taken
+    for (int i = 0; i < btb_entries; i++)
+        bp->btb[i].pc = -1;
+    return bp;
+}
+
+void predictor_free(BranchPredictor *bp)
+{
+    if (bp == NULL)
+        return;
+    free(bp->counters);
+    free(bp->btb);
+    free(bp);
+}
+
+// Summary on stderr; cycles is what the pipeline took for the same runs
+void predictor_report(const BranchPredictor *bp, long long cycles)
+{
+    long long branches = bp->beqz + bp->br;
+    long long predicted = cycles - bp->branch_cycles + bp->predicted_cycles;
+    fprintf(stderr, "predictor=%s:%d btb=%d: beqz=%lld (taken %lld) br=%lld mispredicts=%lld accuracy=%.1f%%\n",
+            bp->scheme->name, bp->entries, bp->btb_entries, bp->beqz, bp->beqz_taken, bp->br, bp->mispredicts,
+            branches ? 100.0 * (branches - bp->mispredicts) / branches : 100.0);
+    fprintf(stderr, "branch cycles=%lld -> %lld, cycles=%lld -> %lld (saved %lld, %.1f%%)\n", bp->branch_cycles,
+            bp->predicted_cycles, cycles, predicted, cycles - predicted,
+            cycles ? 100.0 * (cycles - predicted) / cycles : 0.0);
+}
+
+// ---------------------------------------------------------------------------
+// Data cache model (--dcache, --dcache-miss)
+//
+// A set-associative cache in front of data_memory: every LDR and STR that
+// EX executes is looked up, and misses, dirty evictions and write-through
+// stores stall EX for the memory latency. With a blocking cache in front of
+// an in-order pipeline nothing moves while EX waits, so a stall adds
+// exactly its length to the run and changes nothing else; the pipeline
+// keeps its own cycle count (and the program its results) and the count
+// with the stalls is reported next to it. A hit costs nothing on top of
+// the EX cycle. Negative LDR/STR addresses reach the end of instruction
+// memory and are not cached.
+//
+// Write-back caches allocate on a store miss and write a dirty line back
+// when it is evicted; write-through caches send every store to memory and
+// only update a line that is already present. The cache starts cold for
+// every run and every --states instance.
+// ---------------------------------------------------------------------------
+#define DCACHE_MISS_LATENCY 10 // default cycles to reach data memory
+
+typedef struct
+{
+    long long reads;
+    long long writes;
+    long long read_misses;
+    long long write_misses;
+    long long evictions;  // valid lines replaced
+    long long writebacks; // dirty lines written to memory
+    long long uncached;   // negative addresses
+    long long stall_cycles;
+} DataCacheStats;
+
+typedef struct DataCache
+{
+    int size; // bytes
+    int line; // bytes per line
+    int ways;
+    int sets;
+    int random; // random replacement instead of LRU
+    int write_through;
+    int miss_latency;
+    int *tags;          // sets * ways, -1 when invalid
+    uint8_t *dirty;     // sets * ways
+    uint32_t *used;     // sets * ways, last access for LRU
+    uint32_t clock;     // access counter for LRU
+    uint32_t seed;      // xorshift state for random replacement
+    DataCacheStats run; // the current run
+    DataCacheStats total;
+} DataCache;
+
+// Forget every line (nothing is written back: memory is reset with it) and
+// start the counters of a new run
+void dcache_invalidate(DataCache *c)
+{
+    for (int i = 0; i < c->sets * c->ways; i++)
+    {
+        c->tags[i] = -1;
+        c->dirty[i] = 0;
+        c->used[i] = 0;
+    }
+    c->clock = 0;
+    c->seed = 0x9E3779B9u;
+    c->run = (DataCacheStats){0};
+}
+
+// Look up the byte EX reads or writes; returns the cycles EX stalls for
+static inline int dcache_access(DataCache *c, int address, int write)
+{
+    DataCacheStats *s = &c->run;
+    if (address_in_code(address))
+    {
+        s->uncached++;
+        return 0;
+    }
+    int line = address / c->line;
+    int set = line & (c->sets - 1);
+    int tag = line / c->sets;
+    int *tags = c->tags + set * c->ways;
+    int stall = 0;
+    if (write)
+        s->writes++;
+    else
+        s->reads++;
+    c->clock++;
+
+    for (int way = 0; way < c->ways; way++)
+    {
+        if (tags[way] == tag)
+        {
+            c->used[set * c->ways + way] = c->clock;
+            if (write && c->write_through)
+                stall = c->miss_latency;
+            else if (write)
+                c->dirty[set * c->ways + way] = 1;
+            s->stall_cycles += stall;
+            return stall;
+        }
+    }
+
+    if (write)
+        s->write_misses++;
+    else
+        s->read_misses++;
+    if (write && c->write_through)
+    {
+        // No allocation: the store goes straight to memory
+        s->stall_cycles += c->miss_latency;
+        return c->miss_latency;
+    }
+
+    // Fill a line: an empty way if there is one, else the victim
+    int victim = -1;
+    for (int way = 0; way < c->ways && victim < 0; way++)
+    {
+        if (tags[way] == -1)
+            victim = way;
+    }
+    if (victim < 0)
+    {
+        if (c->random)
+        {
+            c->seed ^= c->seed << 13;
+            c->seed ^= c->seed >> 17;
+            c->seed ^= c->seed << 5;
+            victim = c->seed % c->ways;
+        }
+        else
+        {
+            victim = 0;
+            for (int way = 1; way < c->ways; way++)
+            {
+                if (c->used[set * c->ways + way] < c->used[set * c->ways + victim])
+                    victim = way;
+            }
+        }
+        s->evictions++;
+        if (c->dirty[set * c->ways + victim])
+        {
+            s->writebacks++;
+            stall += c->miss_latency;
+        }
+    }
+    tags[victim] = tag;
+    c->dirty[set * c->ways + victim] = write;
+    c->used[set * c->ways + victim] = c->clock;
+    stall += c->miss_latency;
+    s->stall_cycles += stall;
+    return stall;
+}
+
+// Parse --dcache=SIZE:LINE:WAYS[:lru|random][:wb|wt] and set up a cold
+// cache; returns NULL if the geometry or a policy is not valid
+DataCache *dcache_create(const char *spec, int miss_latency)
+{
+    char *end;
+    int size = strtol(spec, &end, 10);
+    int line = *end == ':' ? strtol(end + 1, &end, 10) : 0;
+    int ways = *end == ':' ? strtol(end + 1, &end, 10) : 0;
+    int random = 0;
+    int write_through = 0;
+    while (*end == ':')
+    {
+        const char *policy = end + 1;
+        end = strchr(policy, ':');
+        if (end == NULL)
+            end = (char *)policy + strlen(policy);
+        size_t length = end - policy;
+        if (length == 3 && strncmp(policy, "lru", 3) == 0)
+            random = 0;
+        else if (length == 6 && strncmp(policy, "random", 6) == 0)
+            random = 1;
+        else if (length == 2 && strncmp(policy, "wb", 2) == 0)
+            write_through = 0;
+        else if (length == 2 && strncmp(policy, "wt", 2) == 0)
+            write_through = 1;
+        else
+            return NULL;
+    }
+    if (*end != '\0' || size <= 0 || line <= 0 || ways <= 0 || miss_latency < 0 || (size & (size - 1)) != 0 ||
+        (line & (line - 1)) != 0 || size % (line * ways) != 0 || size / (line * ways) == 0 ||
+        ((size / (line * ways)) & (size / (line * ways) - 1)) != 0)
+        return NULL;
+
+    DataCache *c = calloc(1, sizeof(DataCache));
+    if (c == NULL)
+        return NULL;
+    c->size = size;
+    c->line = line;
+    c->ways = ways;
+    c->sets = size / (line * ways);
+    c->random = random;
+    c->write_through = write_through;
+    c->miss_latency = miss_latency;
+    c->tags = malloc(c->sets * ways * sizeof(int));
+    c->dirty = malloc(c->sets * ways);
+    c->used = malloc(c->sets * ways * sizeof(uint32_t));
+    if (c->tags == NULL || c->dirty == NULL || c->used == NULL)
+    {
+        free(c->tags);
+        free(c->dirty);
+        free(c->used);
+        free(c);
+        return NULL;
+    }
+    dcache_invalidate(c);
+    return c;
+}
+
+void dcache_free(DataCache *c)
+{
+    if (c == NULL)
+        return;
+    free(c->tags);
+    free(c->dirty);
+    free(c->used);
+    free(c);
+}
+
+// One stats line on stderr; cycles is what the pipeline took without stalls
+static void dcache_print(const DataCacheStats *s, const char *what, long long cycles)
+{
+    long long accesses = s->reads + s->writes;
+    long long misses = s->read_misses + s->write_misses;
+    fprintf(stderr,
+            "dcache %s: accesses=%lld (reads %lld, writes %lld) misses=%lld (reads %lld, writes %lld) hit rate=%.1f%% "
+            "evictions=%lld writebacks=%lld uncached=%lld stalls=%lld cycles=%lld -> %lld (%.1f%% stalled)\n",
+            what, accesses, s->reads, s->writes, misses, s->read_misses, s->write_misses,
+            accesses ? 100.0 * (accesses - misses) / accesses : 100.0, s->evictions, s->writebacks, s->uncached,
+            s->stall_cycles, cycles, cycles + s->stall_cycles,
+            cycles + s->stall_cycles ? 100.0 * s->stall_cycles / (cycles + s->stall_cycles) : 0.0);
+}
+
+// Report the run that just ended and add it to the totals
+void dcache_end_run(DataCache *c, const char *what, long long cycles)
+{
+    dcache_print(&c->run, what, cycles);
+    c->total.reads += c->run.reads;
+    c->total.writes += c->run.writes;
+    c->total.read_misses += c->run.read_misses;
+    c->total.write_misses += c->run.write_misses;
+    c->total.evictions += c->run.evictions;
+    c->total.writebacks += c->run.writebacks;
+    c->total.uncached += c->run.uncached;
+    c->total.stall_cycles += c->run.stall_cycles;
+}
+
+// ---------------------------------------------------------------------------
+// Pipeline organisation model (--pipeline)
+//
+// The simulator's pipeline reads the registers and writes the result in
+// the same EX cycle, so the instruction right behind always sees it and
+// there are no data hazards. --pipeline=5 models the classic IF/ID/EX/MEM/WB
+// organisation instead: registers are read in ID, ALU results are ready
+// after EX, LDR data after MEM, and the register file is written in WB
+// (early enough for an ID in the same cycle). With forwarding, EX/MEM and
+// MEM/WB results go straight back to EX, so only a use right after an LDR
+// stalls (one cycle); without it, a consumer waits until its producer's WB.
+// STR needs its data one stage later than the other instructions. Branches
+// still resolve in EX and cost what they cost now.
+//
+// As with the other models, the real pipeline runs unchanged. Every
+// instruction EX executes is placed on the modelled timeline: its cycle
+// plus the stalls inserted so far, pushed back until the registers it reads
+// are ready. Stalls are counted per consumer address and per
+// producer/consumer opcode pair to find the sequences that stall most.
+// --pipeline=3 models the simulator's own pipeline (no stalls, CPI only).
+// ---------------------------------------------------------------------------
+#define PIPELINE_HOT_SPOTS 5 // addresses and pairs listed in the report
+
+typedef struct PipelineModel
+{
+    int stages; // 3 or 5
+    int forwarding;
+    long long ready[NUM_GPRS]; // first modelled cycle a reader of the register can be in EX
+    int writer[NUM_GPRS];      // address of the register's last producer
+    long long stalls;          // cycles inserted in the current run
+    long long total_stalls;
+    long long load_use_stalls; // the part forwarding cannot remove
+    long long instructions;
+    long long runs;
+    long long pc_stalls[INSTRUCTION_MEMORY_SIZE]; // by consumer address
+    int pc_producer[INSTRUCTION_MEMORY_SIZE];     // producer of its last stall
+    long long pair_stalls[16][16];                // [producer opcode][consumer opcode]
+} PipelineModel;
+
+// Parse --pipeline=STAGES[:forward|:noforward]; NULL if not valid
+PipelineModel *pipeline_model_create(const char *spec)
+{
+    char *end;
+    int stages = strtol(spec, &end, 10);
+    int forwarding = 1;
+    if (strcmp(end, ":noforward") == 0)
+        forwarding = 0;
+    else if (*end != '\0' && strcmp(end, ":forward") != 0)
+        return NULL;
+    if (stages != 3 && stages != 5)
+        return NULL;
+    PipelineModel *pm = calloc(1, sizeof(PipelineModel));
+    if (pm == NULL)
+        return NULL;
+    pm->stages = stages;
+    pm->forwarding = forwarding;
+    return pm;
+}
+
+// Start a run: every register is ready, nothing is stalled yet
+void pipeline_model_start(PipelineModel *pm)
+{
+    memset(pm->ready, 0, sizeof(pm->ready));
+    pm->stalls = 0;
+    pm->runs++;
+}
+
+// Place the instruction EX executed in cycle on the modelled timeline
+static inline void pipeline_model_execute(PipelineModel *pm, const Machine *m, const DecodedInstruction *d,
+                                          long long cycle)
+{
+    int pc = (int)(d - m->decoded_program);
+    int op = d->opcode;
+    int reads_r1 = op <= 2 || op == 4 || op == 5 || op == 6 || op == 7 || op == 8 || op == 9 || op == 11;
+    int reads_r2 = op <= 2 || op == 6 || op == 7;
+    int writes_r1 = op <= 3 || op == 5 || op == 6 || op == 8 || op == 9 || op == 10;
+    pm->instructions++;
+    if (pm->stages == 3)
+        return;
+
+    long long now = cycle + pm->stalls;
+    long long need = now;
+    int source = -1;
+    if (reads_r1)
+    {
+        // STR only needs its data in MEM, one cycle after EX
+        long long at = pm->ready[d->r1] - (op == 11 && pm->forwarding);
+        if (at > need)
+        {
+            need = at;
+            source = d->r1;
+        }
+    }
+    if (reads_r2 && pm->ready[d->r2] > need)
+    {
+        need = pm->ready[d->r2];
+        source = d->r2;
+    }
+    if (source >= 0)
+    {
+        long long stall = need - now;
+        int producer = pm->writer[source];
+        pm->stalls += stall;
+        pm->total_stalls += stall;
+        if (m->decoded_program[producer].opcode == 10 && pm->forwarding)
+            pm->load_use_stalls += stall;
+        pm->pc_stalls[pc] += stall;
+        pm->pc_producer[pc] = producer;
+        pm->pair_stalls[m->decoded_program[producer].opcode & 15][op & 15] += stall;
+        now = need;
+    }
+    if (writes_r1)
+    {
+        // The next cycle's EX can use an ALU result over the EX/MEM latch,
+        // an LDR result one cycle later over MEM/WB, and anything from the
+        // register file once WB has written it
+        pm->ready[d->r1] = now + (!pm->forwarding ? 3 : op == 10 ? 2 : 1);
+        pm->writer[d->r1] = pc;
+    }
+}
+
+void pipeline_model_free(PipelineModel *pm)
+{
+    free(pm);
+}
+
+// Summary on stderr; cycles is what the simulator's pipeline took
+void pipeline_model_report(const PipelineModel *pm, const Machine *m, long long cycles)
+{
+    const char *mnemonics[] = {"ADD", "SUB", "MUL", "MOVI", "BEQZ", "ANDI", "EOR", "BR", "SAL", "SAR", "LDR", "STR",
+                               "?12", "?13", "?14", "?15"};
+    // A 5-stage pipeline needs two more cycles to drain MEM and WB
+    long long modelled = cycles + pm->total_stalls + (pm->stages == 5 ? 2 * pm->runs : 0);
+    fprintf(stderr, "pipeline=%d %s: instructions=%lld cycles=%lld -> %lld CPI=%.3f -> %.3f stalls=%lld (load-use %lld)\n",
+            pm->stages, pm->forwarding ? "forward" : "noforward", pm->instructions, cycles, modelled,
+            pm->instructions ? (double)cycles / pm->instructions : 0.0,
+            pm->instructions ? (double)modelled / pm->instructions : 0.0, pm->total_stalls, pm->load_use_stalls);
+
+    // The addresses and opcode pairs with the most stall cycles
+    int shown_pc[PIPELINE_HOT_SPOTS];
+    for (int n = 0; n < PIPELINE_HOT_SPOTS; n++)
+    {
+        int best = -1;
+        for (int pc = 0; pc < INSTRUCTION_MEMORY_SIZE; pc++)
+        {
+            int taken = 0;
+            for (int k = 0; k < n; k++)
+                taken |= shown_pc[k] == pc;
+            if (!taken && pm->pc_stalls[pc] > 0 && (best < 0 || pm->pc_stalls[pc] > pm->pc_stalls[best]))
+                best = pc;
+        }
+        shown_pc[n] = best;
+        if (best < 0)
+            break;
+        int producer = pm->pc_producer[best];
+        fprintf(stderr, "  stalls=%lld at %d (%s) waiting for %d (%s)\n", pm->pc_stalls[best], best,
+                mnemonics[m->decoded_program[best].opcode & 15], producer,
+                mnemonics[m->decoded_program[producer].opcode & 15]);
+    }
+    int shown_pair[PIPELINE_HOT_SPOTS];
+    for (int n = 0; n < PIPELINE_HOT_SPOTS; n++)
+    {
+        int best = -1;
+        for (int pair = 0; pair < 256; pair++)
+        {
+            int taken = 0;
+            for (int k = 0; k < n; k++)
+                taken |= shown_pair[k] == pair;
+            if (!taken && pm->pair_stalls[pair >> 4][pair & 15] > 0 &&
+                (best < 0 || pm->pair_stalls[pair >> 4][pair & 15] > pm->pair_stalls[best >> 4][best & 15]))
+                best = pair;
+        }
+        shown_pair[n] = best;
+        if (best < 0)
+            break;
+        fprintf(stderr, "  stalls=%lld after %s -> %s\n", pm->pair_stalls[best >> 4][best & 15], mnemonics[best >> 4],
+                mnemonics[best & 15]);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Breakpoints and watchpoints (--break, --break-if, --watch)
+//
+// A breakpoint stops the run before the instruction at its address executes:
+// at the start of the cycle that moves it from ID into EX, unless a flush
+// squashes it there. A register condition (Rn OP VALUE, signed) stops the
+// run after the cycle in which it became true, and a watchpoint after every
+// STR to its data memory address. At a stop the pipeline, registers, SREG
+// and watched bytes are printed and commands are read from stdin: continue,
+// step some cycles or instructions, add stops, print or quit. Once stdin
+// ends, every further stop is printed and the run goes on.
+//
+// pipeline_run has its own instantiation of the cycle loop for a machine
+// with a debugger, which runs every cycle through the interpreter (no JIT
+// or memoized blocks); the other instantiations check nothing.
+// ---------------------------------------------------------------------------
+#define DEBUG_CONDITIONS 16
+
+enum
+{
+    DEBUG_RUNNING, // no stop yet
+    DEBUG_BREAKPOINT,
+    DEBUG_CONDITION,
+    DEBUG_WATCHPOINT,
+    DEBUG_STEP,
+    DEBUG_QUIT
+};
+
+// Two-character operators first so that "<=" is not read as "<"
+const char *debug_operators[] = {"==", "!=", "<=", ">=", "<", ">"};
+
+typedef struct
+{
+    int reg;
+    int op;    // index into debug_operators
+    int value; // -128..255; above 127 the register is compared as unsigned
+    int held;  // at the previous check
+} DebugCondition;
+
+typedef struct Debugger
+{
+    uint8_t breakpoint[INSTRUCTION_MEMORY_SIZE];
+    uint8_t watch[DATA_MEMORY_SIZE];
+    DebugCondition conditions[DEBUG_CONDITIONS];
+    int condition_count;
+    int interactive;             // 0 once stdin ended
+    char last_command[256];      // an empty line repeats it
+    long long step_until;        // cycle a cycle step ends at (LLONG_MAX: none)
+    long long step_instructions; // instructions left in an instruction step (0: none)
+    long long resume_cycle;      // a breakpoint does not stop the cycle the run resumes at
+    // Why the cycle loop returned early: DEBUG_*, the breakpoint address,
+    // condition index or watched address, and for a watchpoint the byte
+    // before the store and the address of the STR
+    int stop;
+    int stop_index;
+    int8_t stop_old;
+    int stop_pc;
+    long long stops;
+} Debugger;
+
+Debugger *debugger_create(void)
+{
+    Debugger *d = calloc(1, sizeof(Debugger));
+    if (d == NULL)
+        return NULL;
+    d->interactive = 1;
+    strcpy(d->last_command, "c");
+    d->step_until = LLONG_MAX;
+    d->resume_cycle = -1;
+    return d;
+}
+
+// Add a DEBUG_BREAKPOINT (instruction address), DEBUG_CONDITION (Rn OP
+// VALUE) or DEBUG_WATCHPOINT (data address); returns 0 if spec is not valid
+int debugger_add(Debugger *d, int kind, const char *spec)
+{
+    char *end;
+    if (kind != DEBUG_CONDITION)
+    {
+        long addr = strtol(spec, &end, 0);
+        int size = kind == DEBUG_BREAKPOINT ? INSTRUCTION_MEMORY_SIZE : DATA_MEMORY_SIZE;
+        if (end == spec || *end != '\0' || addr < 0 || addr >= size)
+            return 0;
+        if (kind == DEBUG_BREAKPOINT)
+            d->breakpoint[addr] = 1;
+        else
+            d->watch[addr] = 1;
+        return 1;
+    }
+
+    if ((spec[0] != 'R' && spec[0] != 'r') || d->condition_count == DEBUG_CONDITIONS)
+        return 0;
+    long reg = strtol(spec + 1, &end, 10);
+    if (end == spec + 1 || reg < 0 || reg >= NUM_GPRS)
+        return 0;
+    int op = 0;
+    while (op < 6 && strncmp(end, debug_operators[op], strlen(debug_operators[op])) != 0)
+        op++;
+    if (op == 6)
+        return 0;
+    const char *number = end + strlen(debug_operators[op]);
+    long value = strtol(number, &end, 0);
+    if (end == number || *end != '\0' || value < -128 || value > 255)
+        return 0;
+    d->conditions[d->condition_count++] = (DebugCondition){(int)reg, op, (int)value, 0};
+    return 1;
+}
+
+// A value above 127 can only be meant as a byte, so R1<200 takes R1 as
+// 0..255 as well; otherwise registers are signed
+static inline int debugger_holds(const Machine *m, const DebugCondition *c)
+{
+    int r = c->value > 127 ? (uint8_t)m->GPR[c->reg] : m->GPR[c->reg];
+    switch (c->op)
+    {
+    case 0:
+        return r == c->value;
+    case 1:
+        return r != c->value;
+    case 2:
+        return r <= c->value;
+    case 3:
+        return r >= c->value;
+    case 4:
+        return r < c->value;
+    default:
+        return r > c->value;
+    }
+}
+
+// Start a run: conditions that already hold only stop once they held
+// false in between
+void debugger_start(Debugger *d, const Machine *m)
+{
+    for (int i = 0; i < d->condition_count; i++)
+        d->conditions[i].held = debugger_holds(m, &d->conditions[i]);
+    d->step_until = LLONG_MAX;
+    d->step_instructions = 0;
+    d->resume_cycle = -1;
+}
+
+// Whether the run stops after EX executed ex; old is the watched byte an
+// STR overwrote. Every condition is evaluated so that each one's held is
+// up to date for the next cycle.
+static inline int debugger_executed(Debugger *d, const Machine *m, const DecodedInstruction *ex, int8_t old)
+{
+    int stop = DEBUG_RUNNING;
+    if (ex->opcode == 11 && !address_in_code(ex->imm) && d->watch[ex->imm])
+    {
+        stop = DEBUG_WATCHPOINT;
+        d->stop_index = ex->imm;
+        d->stop_old = old;
+        d->stop_pc = (int)(ex - m->decoded_program);
+    }
+    for (int i = 0; i < d->condition_count; i++)
+    {
+        int held = debugger_holds(m, &d->conditions[i]);
+        if (held && !d->conditions[i].held && stop == DEBUG_RUNNING)
+        {
+            stop = DEBUG_CONDITION;
+            d->stop_index = i;
+        }
+        d->conditions[i].held = held;
+    }
+    if (d->step_instructions > 0 && --d->step_instructions == 0 && stop == DEBUG_RUNNING)
+        stop = DEBUG_STEP;
+    d->stop = stop;
+    return stop != DEBUG_RUNNING;
+}
+
+// Count one executed instruction. BEQZ does not change its register, so
+// it was taken if the register is still zero; a BR always is, to the PC it
+// just set.
+static inline void profile_record(const Machine *m, Profile *profile, const DecodedInstruction *d)
+{
+    int pc = (int)(d - m->decoded_program);
+    profile->opcode[d->opcode]++;
+    profile->pc[pc]++;
+    if (d->opcode == 4 && m->GPR[d->r1] == 0)
+    {
+        profile->beqz_taken[pc]++;
+        profile->flushes += m->skipped > 0;
+    }
+    else if (d->opcode == 7)
+    {
+        if (m->PC < INSTRUCTION_MEMORY_SIZE)
+            profile->br_target[m->PC]++;
+        else
+            profile->br_outside++;
+        profile->flushes++;
+    }
+}
+
+// The cycle loop of pipeline_run, inlined once with profile, recorder,
+// the models and debugger NULL (no counter, trace, model or stop code at
+// all), once with the machine's profile, once for recording and the models
+// and twice for the debugger, alone and with all of them. With the debugger
+// it returns early (debugger->stop set) when a breakpoint, condition,
+// watchpoint or step stops the run.
+static inline __attribute__((always_inline)) int pipeline_loop(Machine *m, long long until, Profile *profile,
+                                                              TraceRecorder *recorder, BranchPredictor *predictor,
+                                                              DataCache *dcache, PipelineModel *pipeline,
+                                                              Debugger *debugger)
+{
+    int remaining = m->remaining;
+    long long cycle = m->cycle;
+    long long resume = -1;
+    if (debugger != NULL)
+    {
+        resume = debugger->resume_cycle;
+        debugger->resume_cycle = -1;
+    }
+
+    // Native blocks only run when nothing has to be printed, counted,
+    // recorded, modelled or checked per cycle
+    int use_blocks = m->trace.level < TRACE_CYCLE && profile == NULL && recorder == NULL && predictor == NULL &&
+                     dcache == NULL && pipeline == NULL && debugger == NULL;
+    int use_jit = use_blocks && m->engine == ENGINE_JIT;
+    // Addresses memoized blocks may start at (NULL when not memoizing)
+    const int8_t *memo_starts =
+        use_blocks && m->engine == ENGINE_MEMO && !m->memo->code_writes ? m->memo->analysed : NULL;
+
+    // Run for n+2 Instructions to account for the pipeline
+    while (remaining > 0 && cycle < until)
+    {
+        // The instruction in ID enters EX this cycle unless it is flushed
+        if (debugger != NULL && m->ID_buffer != NOP_INSTR && m->skipped <= 0 && debugger->breakpoint[m->ID_addr] &&
+            cycle != resume)
+        {
+            debugger->stop = DEBUG_BREAKPOINT;
+            debugger->stop_index = m->ID_addr;
+            break;
+        }
+        if ((use_jit || (memo_starts != NULL && memo_starts[m->ID_addr] >= 0)) && m->skipped <= 0 &&
+            m->ID_buffer != NOP_INSTR && m->IF_buffer != NOP_INSTR && m->IF_addr == m->ID_addr + 1 &&
+            m->PC == m->ID_addr + 2)
+        {
+            long long executed =
+                use_jit ? jit_enter(m, m->ID_addr, until - cycle) : memo_enter(m, m->ID_addr, until - cycle);
+            if (executed > 0)
+            {
+                cycle += executed;
+                continue;
+            }
+        }
+        cycle++;
+
+        // Shift EX and ID buffers
+        m->EX_buffer = buffer_decoded(m, m->ID_buffer, m->ID_addr);
+        m->ID_buffer = m->IF_buffer;
+        m->ID_addr = m->IF_addr;
+        m->IF_addr = m->PC;
+        m->IF_buffer = fetch_instruction(m);
+        if (m->IF_buffer == NOP_INSTR)
+        {
+            if (remaining == INT32_MAX)
+            {
+                remaining = 2;
+            }
+            remaining--;
+        }
+        int ex_pred = 0;
+        if (predictor != NULL)
+        {
+            ex_pred = m->ID_pred;
+            m->ID_pred = m->IF_pred;
+            m->IF_pred = m->IF_buffer != NOP_INSTR ? predictor_lookup(predictor, m, m->IF_addr) : 0;
+        }
+
+        // Shift pipeline: EX <- ID <- IF
+        // Execute stage: execute EX_buffer[2]
+        if (m->skipped > 0)
+        {
+            TRACE(m, TRACE_CYCLE, "Pipeline flushed due to branch. Skipping instruction.\n");
+            PROFILE(profile, profile->flush_cycles++);
+            if (recorder != NULL)
+                recorder_flush_cycle(recorder, m);
+            m->skipped--;
+            continue;
+        }
+        const DecodedInstruction *ex_instr = m->EX_buffer;
+        if (m->trace.level >= TRACE_CYCLE)
+            trace_cycle(m, cycle, ex_instr);
+        uint16_t fetched_pc = m->PC;
+        int skipped = m->skipped;
+        int stop = 0;
+        if (ex_instr->opcode != 0xFF)
+        {
+            int8_t overwritten = 0;
+            if (debugger != NULL && ex_instr->opcode == 11)
+                overwritten = data_read(m, ex_instr->imm);
+            if (m->engine != ENGINE_SWITCH)
+                m->decoded_handlers[ex_instr - m->decoded_program](m, ex_instr);
+            else
+                execute_instruction(m, ex_instr, &m->IF_buffer, &m->ID_buffer);
+            if (m->trace.level >= TRACE_FULL)
+                trace_execute(m, ex_instr);
+            PROFILE(profile, profile_record(m, profile, ex_instr));
+            if (predictor != NULL && (ex_instr->opcode == 4 || ex_instr->opcode == 7))
+                predictor_resolve(predictor, m, ex_instr, ex_pred);
+            if (pipeline != NULL)
+                pipeline_model_execute(pipeline, m, ex_instr, cycle);
+            if (dcache != NULL && (ex_instr->opcode == 10 || ex_instr->opcode == 11))
+            {
+                int stall = dcache_access(dcache, ex_instr->imm, ex_instr->opcode == 11);
+                if (stall > 0 && m->trace.level >= TRACE_FULL)
+                    trace_printf(&m->trace, "Data cache miss at [%d]: EX stalled for %d cycles\n", ex_instr->imm, stall);
+            }
+            if (debugger != NULL)
+                stop = debugger_executed(debugger, m, ex_instr, overwritten);
+        }
+        else
+        {
+            PROFILE(profile, profile->ex_idle++);
+        }
+        if (recorder != NULL)
+            recorder_cycle(recorder, m, ex_instr, fetched_pc, skipped);
+        if (ex_instr->opcode == 11 && m->code_unsettled)
+            code_settle(m);
+        if (stop)
+            break;
+    }
+
+    PROFILE(profile, profile->cycles += cycle - m->cycle);
+    m->remaining = remaining;
+    m->cycle = cycle;
+    return remaining > 0;
+}
+
+// Advance the pipeline until it drains or has run until cycles in total;
+// returns 1 if the program has not finished yet
+int pipeline_run(Machine *m, long long until)
+{
+    if (m->debugger != NULL && (m->recorder != NULL || m->predictor != NULL || m->dcache != NULL ||
+                                m->pipeline != NULL || (PROFILE_COUNTERS && m->profile != NULL)))
+        return pipeline_loop(m, until, m->profile, m->recorder, m->predictor, m->dcache, m->pipeline, m->debugger);
+    if (m->debugger != NULL)
+        return pipeline_loop(m, until, NULL, NULL, NULL, NULL, NULL, m->debugger);
+    if (m->recorder != NULL || m->predictor != NULL || m->dcache != NULL || m->pipeline != NULL)
+        return pipeline_loop(m, until, m->profile, m->recorder, m->predictor, m->dcache, m->pipeline, NULL);
+    if (PROFILE_COUNTERS && m->profile != NULL)
+        return pipeline_loop(m, until, m->profile, NULL, NULL, NULL, NULL, NULL);
+    return pipeline_loop(m, until, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+// Print the final state once the run is over
+void pipeline_finish(Machine *m)
+{
+    trace_final_state(m);
+    trace_flush(&m->trace);
+}
+
+// Write the profile counters as JSON; only non-zero per-address entries are
+// listed. Returns 0 on error.
+int profile_write(const Machine *m, const char *filename)
+{
+    // A counted word may have been rewritten to an invalid opcode since
+    // (an STR with a negative address), so "pcs" can name those as well
+    const char *mnemonics[] = {"ADD", "SUB", "MUL", "MOVI", "BEQZ", "ANDI", "EOR", "BR",
+                               "SAL", "SAR", "LDR", "STR", "INVALID", "INVALID", "INVALID", "INVALID"};
+    const Profile *profile = m->profile;
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+        perror("Error creating profile");
+        return 0;
+    }
+    unsigned long long instructions = 0;
+    for (int op = 0; op < 12; op++)
+        instructions += profile->opcode[op];
+
+    fprintf(file, "{\n  \"cycles\": %llu,\n  \"instructions\": %llu,\n", profile->cycles, instructions);
+    fprintf(file, "  \"ex_idle_cycles\": %llu,\n  \"flush_cycles\": %llu,\n  \"flushes\": %llu,\n",
+            profile->ex_idle, profile->flush_cycles, profile->flushes);
+    fprintf(file, "  \"opcodes\": {");
+    for (int op = 0; op < 12; op++)
+        fprintf(file, "%s\"%s\": %llu", op ? ", " : "", mnemonics[op], profile->opcode[op]);
+    fprintf(file, "},\n  \"pcs\": [");
+    const char *separator = "";
+    for (int pc = 0; pc < INSTRUCTION_MEMORY_SIZE; pc++)
+    {
+        if (profile->pc[pc] == 0)
+            continue;
+        fprintf(file, "%s\n    {\"pc\": %d, \"op\": \"%s\", \"count\": %llu}", separator, pc,
+                mnemonics[m->decoded_program[pc].opcode], profile->pc[pc]);
+        separator = ",";
+    }
+    fprintf(file, "\n  ],\n  \"beqz\": [");
+    separator = "";
+    for (int pc = 0; pc < INSTRUCTION_MEMORY_SIZE; pc++)
+    {
+        if (profile->pc[pc] == 0 || m->decoded_program[pc].opcode != 4)
+            continue;
+        fprintf(file, "%s\n    {\"pc\": %d, \"taken\": %llu, \"not_taken\": %llu}", separator, pc,
+                profile->beqz_taken[pc], profile->pc[pc] - profile->beqz_taken[pc]);
+        separator = ",";
+    }
+    fprintf(file, "\n  ],\n  \"br_targets\": [");
+    separator = "";
+    for (int pc = 0; pc < INSTRUCTION_MEMORY_SIZE; pc++)
+    {
+        if (profile->br_target[pc] == 0)
+            continue;
+        fprintf(file, "%s\n    {\"target\": %d, \"count\": %llu}", separator, pc, profile->br_target[pc]);
+        separator = ",";
+    }
+    fprintf(file, "\n  ],\n  \"br_outside_memory\": %llu\n}\n", profile->br_outside);
+
+    int ok = !ferror(file);
+    if (fclose(file) != 0)
+        ok = 0;
+    if (!ok)
+        fprintf(stderr, "Error writing profile %s\n", filename);
+    return ok;
+}
+
+// Run the pipeline; returns the number of cycles simulated
+long long run_pipeline(Machine *m)
+{
+    pipeline_start(m);
+    pipeline_run(m, m->max_cycles);
+    pipeline_finish(m);
+    return m->cycle;
+}
+
+// Print why the run stopped and the state it stopped in
+void debugger_print(Machine *m)
+{
+    Debugger *d = m->debugger;
+    switch (d->stop)
+    {
+    case DEBUG_BREAKPOINT:
+        trace_printf(&m->trace, "\nBreakpoint at %d before cycle %lld\n", d->stop_index, m->cycle + 1);
+        break;
+    case DEBUG_CONDITION:
+    {
+        const DebugCondition *c = &d->conditions[d->stop_index];
+        trace_printf(&m->trace, "\nR%d %s %d after cycle %lld\n", c->reg, debug_operators[c->op], c->value, m->cycle);
+        break;
+    }
+    case DEBUG_WATCHPOINT:
+        trace_printf(&m->trace, "\nSTR at %d wrote [%d]: %d -> %d in cycle %lld\n", d->stop_pc, d->stop_index,
+                     d->stop_old, m->data_memory[d->stop_index], m->cycle);
+        break;
+    default:
+        trace_printf(&m->trace, "\nStepped to cycle %lld\n", m->cycle);
+    }
+    // The run goes on past a breakpoint it stopped in front of for another
+    // reason, so it is reported here
+    if (d->stop != DEBUG_BREAKPOINT && m->ID_buffer != NOP_INSTR && m->skipped <= 0 && d->breakpoint[m->ID_addr])
+        trace_printf(&m->trace, "Breakpoint at %d before cycle %lld\n", m->ID_addr, m->cycle + 1);
+    print_instruction_human(m, buffer_decoded(m, m->IF_buffer, m->IF_addr), "IF");
+    print_instruction_human(m, buffer_decoded(m, m->ID_buffer, m->ID_addr), "ID");
+    if (m->EX_buffer->opcode == 0xFF)
+        trace_printf(&m->trace, "  EX: (NOP)\n");
+    else
+        print_instruction_human(m, m->EX_buffer, "EX");
+    if (m->skipped > 0)
+        trace_printf(&m->trace, "  (next %d cycles flushed)\n", m->skipped);
+    for (int i = 0; i < NUM_GPRS; i++)
+        trace_printf(&m->trace, "%sR%d=%d", i % 8 ? " " : i ? "\n  " : "  ", i, m->GPR[i]);
+    SREG_t sreg = machine_sreg(m);
+    trace_printf(&m->trace, "\n  PC=%d SREG: C=%d V=%d N=%d S=%d Z=%d\n", m->PC, sreg.C, sreg.V, sreg.N, sreg.S,
+                 sreg.Z);
+    for (int i = 0; i < DATA_MEMORY_SIZE; i++)
+    {
+        if (d->watch[i])
+            trace_printf(&m->trace, "  [%d]=%d\n", i, m->data_memory[i]);
+    }
+    trace_flush(&m->trace);
+}
+
+// Read commands from stdin until one resumes the run; returns 0 to end it.
+// An empty line repeats the previous command.
+static int debugger_command(Machine *m)
+{
+    Debugger *d = m->debugger;
+    char line[256];
+    while (d->interactive)
+    {
+        if (isatty(STDIN_FILENO))
+        {
+            fputs("(debug) ", stderr);
+            fflush(stderr);
+        }
+        if (fgets(line, sizeof(line), stdin) == NULL)
+        {
+            d->interactive = 0;
+            break;
+        }
+        char command[16];
+        char arg[128];
+        int n = sscanf(line, "%15s %127s", command, arg);
+        if (n <= 0)
+        {
+            strcpy(line, d->last_command);
+            n = sscanf(line, "%15s %127s", command, arg);
+        }
+        strcpy(d->last_command, line);
+        long long count = n == 2 ? strtoll(arg, NULL, 10) : 1;
+
+        if (strcmp(command, "c") == 0)
+            return 1;
+        if ((strcmp(command, "s") == 0 || strcmp(command, "i") == 0) && count > 0)
+        {
+            if (command[0] == 's')
+                d->step_until = m->cycle + count;
+            else
+                d->step_instructions = count;
+            return 1;
+        }
+        if (strcmp(command, "q") == 0)
+        {
+            d->stop = DEBUG_QUIT;
+            return 0;
+        }
+        if (strcmp(command, "p") == 0)
+        {
+            debugger_print(m);
+            continue;
+        }
+        int kind = strcmp(command, "b") == 0 ? DEBUG_BREAKPOINT : strcmp(command, "if") == 0 ? DEBUG_CONDITION
+                   : strcmp(command, "w") == 0 ? DEBUG_WATCHPOINT : DEBUG_RUNNING;
+        if (kind != DEBUG_RUNNING && n == 2 && debugger_add(d, kind, arg))
+        {
+            if (kind == DEBUG_CONDITION)
+            {
+                DebugCondition *c = &d->conditions[d->condition_count - 1];
+                c->held = debugger_holds(m, c);
+            }
+            continue;
+        }
+        fprintf(stderr, "Commands: c (continue), s [N] (cycles), i [N] (instructions), b ADDR, if Rn<op>VALUE, "
+                        "w ADDR, p (print), q (quit)\n");
+    }
+    return 1;
+}
+
+// pipeline_run for a machine with a debugger: prints the state and reads
+// commands at every stop; returns 1 if the program has not finished yet
+// (0 also once it was quit)
+int debugger_run(Machine *m, long long until)
+{
+    Debugger *d = m->debugger;
+    for (;;)
+    {
+        d->stop = DEBUG_RUNNING;
+        int running = pipeline_run(m, d->step_until < until ? d->step_until : until);
+        if (running && d->stop == DEBUG_RUNNING && m->cycle == d->step_until)
+            d->stop = DEBUG_STEP;
+        if (d->stop == DEBUG_RUNNING)
+            return running;
+        d->stops++;
+        d->step_until = LLONG_MAX;
+        d->step_instructions = 0;
+        debugger_print(m);
+        d->resume_cycle = m->cycle;
+        if (!debugger_command(m))
+            return 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Functional engine
+//
+// Runs the program one instruction at a time at the instruction-set level,
+// for fast-forwarding to the part of a run that should be looked at in the
+// pipeline model. While the pipeline is in its steady state (the next
+// instruction a in ID, a+1 in IF, PC at a+2, no flush pending) its buffers
+// follow from a alone, so only a is kept: each instruction is one handler
+// call and one cycle, and the buffers are written back when the engine
+// stops. A taken BEQZ or a BR costs its known number of flushed cycles and
+// continues at the target. LDR (which moves the PC of instructions already
+// fetched), STR into instruction memory and the end of the program leave
+// the steady state; those cycles are run by the pipeline model until it is
+// steady again. Both engines therefore agree on the complete machine state,
+// cycle count included, whenever control passes from one to the other.
+// ---------------------------------------------------------------------------
+
+static inline int functional_steady(const Machine *m)
+{
+    return m->skipped <= 0 && m->ID_buffer != NOP_INSTR && m->IF_buffer != NOP_INSTR &&
+           m->IF_addr == m->ID_addr + 1 && m->PC == m->ID_addr + 2;
+}
+
+// Run one pipeline cycle; returns 1 if it executed an instruction
+static int functional_pipeline_cycle(Machine *m)
+{
+    int squashed = m->skipped > 0;
+    pipeline_run(m, m->cycle + 1);
+    if (squashed || m->EX_buffer == &nop_decoded)
+        return 0;
+    if (m->executions != NULL)
+        m->executions[m->EX_buffer - m->decoded_program]++;
+    return 1;
+}
+
+// Execute up to count instructions (or until the program ends or
+// max_cycles is reached) without per-cycle traces or profile counters;
+// returns the number executed
+long long functional_run(Machine *m, long long count)
+{
+    long long executed = 0;
+    TraceLevel level = m->trace.level;
+    Profile *profile = m->profile;
+    uint32_t *executions = m->executions;
+    if (m->trace.level > TRACE_SUMMARY)
+        m->trace.level = TRACE_SUMMARY;
+    m->profile = NULL;
+
+    while (executed < count && m->remaining > 0 && m->cycle < m->max_cycles)
+    {
+        if (!functional_steady(m))
+        {
+            executed += functional_pipeline_cycle(m);
+            continue;
+        }
+
+        int a = m->ID_addr;
+        long long cycle = m->cycle;
+        const DecodedInstruction *last = m->EX_buffer; // what EX holds
+        int steady = 1;
+        while (executed < count && cycle < m->max_cycles && instruction_fetchable(m, a + 2))
+        {
+            const DecodedInstruction *d = &m->decoded_program[a];
+            if (d->opcode == 10 || (d->opcode == 11 && address_in_code(d->imm)))
+                break;
+            m->PC = a + 3; // BEQZ and BR read or move the fetch PC
+            m->decoded_handlers[a](m, d);
+            if (executions != NULL)
+                executions[a]++;
+            executed++;
+            cycle++;
+            last = d;
+            if (d->opcode != 4 && d->opcode != 7)
+            {
+                a++;
+                continue;
+            }
+            if (d->opcode == 4 && m->skipped <= 0)
+            {
+                a++;
+                continue;
+            }
+
+            // A taken BEQZ squashes the next one or two instructions, a BR
+            // empties IF and ID; the pipeline is steady again at the target
+            // after that many cycles if target and target+1 can be fetched
+            int target = d->opcode == 4 ? a + 1 + d->imm : m->PC;
+            int bubbles = d->opcode == 4 ? m->skipped : 2;
+            if (cycle + bubbles > m->max_cycles || !instruction_fetchable(m, target) ||
+                !instruction_fetchable(m, target + 1))
+            {
+                // Leave the state after this cycle to the pipeline model
+                m->EX_buffer = d;
+                m->ID_addr = a + 1;
+                m->ID_buffer = d->opcode == 7 ? NOP_INSTR : m->instruction_memory[a + 1];
+                m->IF_addr = a + 2;
+                m->IF_buffer = d->opcode == 7 ? NOP_INSTR : m->instruction_memory[a + 2];
+                steady = 0;
+                break;
+            }
+            if (d->opcode == 4)
+            {
+                last = &m->decoded_program[a + bubbles];
+                m->skipped = 0;
+            }
+            else
+            {
+                last = &nop_decoded;
+            }
+            cycle += bubbles;
+            a = target;
+        }
+
+        if (cycle == m->cycle)
+        {
+            executed += functional_pipeline_cycle(m);
+            continue;
+        }
+        // Write back the buffers of the steady state at a
+        if (steady)
+        {
+            m->EX_buffer = last;
+            m->ID_addr = a;
+            m->ID_buffer = m->instruction_memory[a];
+            m->IF_addr = a + 1;
+            m->IF_buffer = m->instruction_memory[a + 1];
+            m->PC = a + 2;
+        }
+        m->cycle = cycle;
+    }
+
+    m->trace.level = level;
+    m->profile = profile;
+    return executed;
+}
+
+// Whether two machines are in the same state: architectural state, pipeline
+// buffers and cycle count
+int machine_state_equal(const Machine *a, const Machine *b)
+{
+    return memcmp(a->GPR, b->GPR, sizeof(a->GPR)) == 0 && sreg_byte(machine_sreg(a)) == sreg_byte(machine_sreg(b)) &&
+           memcmp(a->data_memory, b->data_memory, sizeof(a->data_memory)) == 0 &&
+           memcmp(a->instruction_memory, b->instruction_memory, sizeof(a->instruction_memory)) == 0 &&
+           a->PC == b->PC && a->skipped == b->skipped && a->remaining == b->remaining && a->cycle == b->cycle &&
+           a->IF_buffer == b->IF_buffer && a->ID_buffer == b->ID_buffer &&
+           (a->IF_buffer == NOP_INSTR || a->IF_addr == b->IF_addr) &&
+           (a->ID_buffer == NOP_INSTR || a->ID_addr == b->ID_addr) &&
+           (a->EX_buffer == &nop_decoded) == (b->EX_buffer == &nop_decoded) &&
+           (a->EX_buffer == &nop_decoded || a->EX_buffer - a->decoded_program == b->EX_buffer - b->decoded_program);
+}
+
+typedef struct
+{
+    long long functional_instructions;
+    long long functional_cycles;
+    long long detailed_cycles;
+    int switches;
+    int mismatches;
+} FastForwardStats;
+
+// Run the program (started with pipeline_start) alternating between
+// forward instructions in the functional engine and window cycles in the
+// pipeline model (window 0: the rest of the run). With ref, a machine
+// holding the same program is run in the pipeline model alongside and
+// compared with m at every switch point until they first disagree.
+void run_fast_forward(Machine *m, Machine *ref, long long forward, long long window, FastForwardStats *stats)
+{
+    int functional = 1;
+    while (m->remaining > 0 && m->cycle < m->max_cycles)
+    {
+        long long start = m->cycle;
+        if (functional)
+        {
+            stats->functional_instructions += functional_run(m, forward);
+            stats->functional_cycles += m->cycle - start;
+        }
+        else
+        {
+            pipeline_run(m, window > 0 && start + window < m->max_cycles ? start + window : m->max_cycles);
+            stats->detailed_cycles += m->cycle - start;
+        }
+        functional = !functional;
+        stats->switches++;
+        if (ref != NULL)
+        {
+            pipeline_run(ref, m->cycle);
+            if (!machine_state_equal(m, ref))
+            {
+                // Report the first one; later states follow from it
+                fprintf(stderr, "Engines disagree at cycle %lld (PC 0x%04X, reference PC 0x%04X)\n",
+                        m->cycle, m->PC, ref->PC);
+                stats->mismatches++;
+                ref = NULL;
+            }
+        }
+    }
+}
+
+// Reset registers, flags, PC and data memory but keep the loaded program
+// Only the data pages written since the last reset are copied back.
+void reset_state(Machine *m)
+{
+    for (int i = 0; i < NUM_GPRS; i++)
+        m->GPR[i] = 0;
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if ((m->touched >> p) & 1)
+            memcpy(m->data_memory + p * DATA_PAGE_SIZE, m->initial_data + p * DATA_PAGE_SIZE, DATA_PAGE_SIZE);
+    }
+    machine_set_sreg(m, (SREG_t){0});
+    m->PC = m->entry_pc;
+    // Instruction memory is not reset; remember if STR wrote into it
+    m->code_end = machine_code_end(m);
+    m->dirty |= m->touched;
+    m->touched = 0;
+}
+
+void resetAll(Machine *m)
+{
+    // Reset all states-----------------------WORK--------------------------------------------
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if ((m->initial_pages >> p) & 1)
+            memset(m->initial_data + p * DATA_PAGE_SIZE, 0, DATA_PAGE_SIZE);
+    }
+    m->touched |= m->initial_pages;
+    m->initial_pages = 0;
+    m->entry_pc = 0;
+    reset_state(m);
+    int code_end = machine_code_end(m);
+    for (int i = 0; i < code_end; i++)
+        m->instruction_memory[i] = 0;
+    if (code_end > 0)
+        m->dirty |= 1ULL << DIRTY_CODE_BIT;
+    m->code_end = 0;
+    predecode_program(m);
+}
+
+// ---------------------------------------------------------------------------
+// Snapshots and checkpoint files
+//
+// A snapshot is the complete machine state between two cycles: registers,
+// SREG, PC, both memories, the IF/ID/EX buffers, the flush counter and the
+// cycle bookkeeping. Memory is held in reference-counted pages. The machine
+// remembers which snapshot page matches each of its clean pages, so a new
+// snapshot only copies the pages written since the previous one and shares
+// the rest; taking one every few cycles in a loop costs a few small copies.
+//
+// Checkpoint files store the same state in a compact little-endian binary
+// form: a fixed header, then only the non-zero blocks of instruction and data
+// memory.
+// ---------------------------------------------------------------------------
+typedef struct SnapshotPage
+{
+    int refs;
+    int8_t bytes[DATA_PAGE_SIZE];
+} SnapshotPage;
+
+typedef struct SnapshotCode
+{
+    int refs;
+    uint16_t words[INSTRUCTION_MEMORY_SIZE];
+} SnapshotCode;
+
+typedef struct
+{
+    long long cycle;
+    int remaining;
+    int skipped;
+    uint16_t PC;
+    uint16_t IF_buffer;
+    uint16_t ID_buffer;
+    uint16_t IF_addr;
+    uint16_t ID_addr;
+    uint16_t EX_addr; // NOP_INSTR when EX holds a NOP
+    FlagState flags;
+    int8_t GPR[NUM_GPRS];
+    uint64_t touched;
+    int code_end;
+    SnapshotCode *code;
+    SnapshotPage *pages[DATA_PAGES];
+} Snapshot;
+
+void snapshot_page_release(SnapshotPage *page)
+{
+    if (page != NULL && --page->refs == 0)
+        free(page);
+}
+
+void snapshot_code_release(SnapshotCode *code)
+{
+    if (code != NULL && --code->refs == 0)
+        free(code);
+}
+
+// Forget which snapshot pages match the machine's memory
+void machine_drop_clean_pages(Machine *m)
+{
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        snapshot_page_release(m->clean_pages[p]);
+        m->clean_pages[p] = NULL;
+    }
+    snapshot_code_release(m->clean_code);
+    m->clean_code = NULL;
+    m->dirty = DIRTY_ALL;
+}
+
+// Snapshot the machine; returns NULL if out of memory
+Snapshot *snapshot_take(Machine *m)
+{
+    Snapshot *snap = malloc(sizeof(Snapshot));
+    if (snap == NULL)
+        return NULL;
+
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if ((m->dirty >> p) & 1 || m->clean_pages[p] == NULL)
+        {
+            SnapshotPage *page = malloc(sizeof(SnapshotPage));
+            if (page == NULL)
+            {
+                for (int q = 0; q < p; q++)
+                    snapshot_page_release(snap->pages[q]);
+                free(snap);
+                return NULL;
+            }
+            page->refs = 1; // held by the machine
+            memcpy(page->bytes, m->data_memory + p * DATA_PAGE_SIZE, DATA_PAGE_SIZE);
+            snapshot_page_release(m->clean_pages[p]);
+            m->clean_pages[p] = page;
+        }
+        snap->pages[p] = m->clean_pages[p];
+        snap->pages[p]->refs++;
+    }
+    if ((m->dirty >> DIRTY_CODE_BIT) & 1 || m->clean_code == NULL)
+    {
+        SnapshotCode *code = malloc(sizeof(SnapshotCode));
+        if (code == NULL)
+        {
+            for (int p = 0; p < DATA_PAGES; p++)
+                snapshot_page_release(snap->pages[p]);
+            free(snap);
+            return NULL;
+        }
+        code->refs = 1;
+        memcpy(code->words, m->instruction_memory, sizeof(code->words));
+        snapshot_code_release(m->clean_code);
+        m->clean_code = code;
+    }
+    snap->code = m->clean_code;
+    snap->code->refs++;
+    m->dirty = 0;
+    snap->touched = m->touched;
+    snap->code_end = m->code_end;
+
+    snap->cycle = m->cycle;
+    snap->remaining = m->remaining;
+    snap->skipped = m->skipped;
+    snap->PC = m->PC;
+    snap->IF_buffer = m->IF_buffer;
+    snap->ID_buffer = m->ID_buffer;
+    snap->IF_addr = m->IF_addr;
+    snap->ID_addr = m->ID_addr;
+    snap->EX_addr = m->EX_buffer == &nop_decoded ? NOP_INSTR : m->EX_buffer - m->decoded_program;
+    snap->flags = m->flags;
+    memcpy(snap->GPR, m->GPR, sizeof(snap->GPR));
+    return snap;
+}
+
+void snapshot_release(Snapshot *snap)
+{
+    if (snap == NULL)
+        return;
+    for (int p = 0; p < DATA_PAGES; p++)
+        snapshot_page_release(snap->pages[p]);
+    snapshot_code_release(snap->code);
+    free(snap);
+}
+
+// Put the machine back into the snapshot's state. Only pages that differ
+// from the machine's clean pages are copied back.
+void snapshot_restore(Machine *m, const Snapshot *snap)
+{
+    m->touched = snap->touched;
+    m->code_end = snap->code_end;
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if ((m->dirty >> p) & 1 || m->clean_pages[p] != snap->pages[p])
+        {
+            memcpy(m->data_memory + p * DATA_PAGE_SIZE, snap->pages[p]->bytes, DATA_PAGE_SIZE);
+            snap->pages[p]->refs++;
+            snapshot_page_release(m->clean_pages[p]);
+            m->clean_pages[p] = snap->pages[p];
+        }
+    }
+    if ((m->dirty >> DIRTY_CODE_BIT) & 1 || m->clean_code != snap->code)
+    {
+        memcpy(m->instruction_memory, snap->code->words, sizeof(m->instruction_memory));
+        snap->code->refs++;
+        snapshot_code_release(m->clean_code);
+        m->clean_code = snap->code;
+        predecode_program(m);
+    }
+    m->dirty = 0;
+
+    m->cycle = snap->cycle;
+    m->remaining = snap->remaining;
+    m->skipped = snap->skipped;
+    m->PC = snap->PC;
+    m->IF_buffer = snap->IF_buffer;
+    m->ID_buffer = snap->ID_buffer;
+    m->IF_addr = snap->IF_addr;
+    m->ID_addr = snap->ID_addr;
+    m->EX_buffer = snap->EX_addr == NOP_INSTR ? &nop_decoded : &m->decoded_program[snap->EX_addr];
+    m->IF_pred = m->ID_pred = 0;
+    m->flags = snap->flags;
+    memcpy(m->GPR, snap->GPR, sizeof(m->GPR));
+}
+
+#define CHECKPOINT_MAGIC "PSCK"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_CODE_BLOCK 32 // words per instruction memory block
+#define CHECKPOINT_CODE_BLOCKS (INSTRUCTION_MEMORY_SIZE / CHECKPOINT_CODE_BLOCK)
+
+static void put_u16(FILE *file, uint16_t value)
+{
+    fputc(value & 0xFF, file);
+    fputc(value >> 8, file);
+}
+
+static void put_u32(FILE *file, uint32_t value)
+{
+    put_u16(file, value & 0xFFFF);
+    put_u16(file, value >> 16);
+}
+
+static uint16_t get_u16(FILE *file)
+{
+    int low = fgetc(file);
+    int high = fgetc(file);
+    return (uint16_t)((low & 0xFF) | (high & 0xFF) << 8);
+}
+
+static uint32_t get_u32(FILE *file)
+{
+    uint32_t low = get_u16(file);
+    return low | (uint32_t)get_u16(file) << 16;
+}
+
+// Write the machine's current state in checkpoint format to file
+void checkpoint_write(const Machine *m, FILE *file)
+{
+    fwrite(CHECKPOINT_MAGIC, 1, 4, file);
+    put_u16(file, CHECKPOINT_VERSION);
+    put_u32(file, (uint32_t)m->cycle);
+    put_u32(file, (uint32_t)(m->cycle >> 32));
+    put_u32(file, (uint32_t)m->remaining);
+    put_u32(file, (uint32_t)m->skipped);
+    put_u16(file, m->PC);
+    put_u16(file, m->IF_buffer);
+    put_u16(file, m->IF_addr);
+    put_u16(file, m->ID_buffer);
+    put_u16(file, m->ID_addr);
+    put_u16(file, m->EX_buffer == &nop_decoded ? NOP_INSTR : m->EX_buffer - m->decoded_program);
+    fputc(sreg_byte(machine_sreg(m)), file);
+    fwrite(m->GPR, 1, NUM_GPRS, file);
+
+    // Bitmap of non-zero blocks, then the blocks
+    uint32_t code_blocks = 0;
+    for (int b = 0; b < CHECKPOINT_CODE_BLOCKS; b++)
+    {
+        for (int i = 0; i < CHECKPOINT_CODE_BLOCK; i++)
+        {
+            if (m->instruction_memory[b * CHECKPOINT_CODE_BLOCK + i] != 0)
+                code_blocks |= 1u << b;
+        }
+    }
+    put_u32(file, code_blocks);
+    for (int b = 0; b < CHECKPOINT_CODE_BLOCKS; b++)
+    {
+        if ((code_blocks >> b) & 1)
+        {
+            for (int i = 0; i < CHECKPOINT_CODE_BLOCK; i++)
+                put_u16(file, m->instruction_memory[b * CHECKPOINT_CODE_BLOCK + i]);
+        }
+    }
+
+    uint32_t data_pages = 0;
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        for (int i = 0; i < DATA_PAGE_SIZE; i++)
+        {
+            if (m->data_memory[p * DATA_PAGE_SIZE + i] != 0)
+                data_pages |= 1u << p;
+        }
+    }
+    put_u32(file, data_pages);
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if ((data_pages >> p) & 1)
+            fwrite(m->data_memory + p * DATA_PAGE_SIZE, 1, DATA_PAGE_SIZE, file);
+    }
+}
+
+// Write the machine's current state to a checkpoint file; returns 0 on error
+int checkpoint_save(Machine *m, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        perror("Error writing checkpoint");
+        return 0;
+    }
+    checkpoint_write(m, file);
+
+    int ok = !ferror(file);
+    if (fclose(file) != 0)
+        ok = 0;
+    if (!ok)
+        fprintf(stderr, "Error writing checkpoint %s\n", filename);
+    return ok;
+}
+
+// Read a checkpoint from file (named filename in error messages) into the
+// machine, program included, so that pipeline_run continues from it;
+// returns 0 if it is not valid
+int checkpoint_read(Machine *m, FILE *file, const char *filename)
+{
+    char magic[4];
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, CHECKPOINT_MAGIC, 4) != 0 ||
+        get_u16(file) != CHECKPOINT_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a checkpoint file\n", filename);
+        return 0;
+    }
+
+    uint64_t cycle = get_u32(file);
+    cycle |= (uint64_t)get_u32(file) << 32;
+    m->cycle = (long long)cycle;
+    m->remaining = (int32_t)get_u32(file);
+    m->skipped = (int32_t)get_u32(file);
+    m->PC = get_u16(file);
+    m->IF_buffer = get_u16(file);
+    m->IF_addr = get_u16(file);
+    m->ID_buffer = get_u16(file);
+    m->ID_addr = get_u16(file);
+    uint16_t ex_addr = get_u16(file);
+    uint8_t sreg_bits = fgetc(file);
+    SREG_t sreg;
+    memcpy(&sreg, &sreg_bits, 1);
+    machine_set_sreg(m, sreg);
+    size_t got = fread(m->GPR, 1, NUM_GPRS, file);
+
+    memset(m->instruction_memory, 0, sizeof(m->instruction_memory));
+    uint32_t code_blocks = get_u32(file);
+    for (int b = 0; b < CHECKPOINT_CODE_BLOCKS; b++)
+    {
+        if ((code_blocks >> b) & 1)
+        {
+            for (int i = 0; i < CHECKPOINT_CODE_BLOCK; i++)
+                m->instruction_memory[b * CHECKPOINT_CODE_BLOCK + i] = get_u16(file);
+        }
+    }
+    memset(m->data_memory, 0, sizeof(m->data_memory));
+    uint32_t data_pages = get_u32(file);
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if ((data_pages >> p) & 1)
+            got += fread(m->data_memory + p * DATA_PAGE_SIZE, 1, DATA_PAGE_SIZE, file);
+    }
+
+    int ok = !feof(file) && !ferror(file) && got == NUM_GPRS + (size_t)__builtin_popcount(data_pages) * DATA_PAGE_SIZE &&
+             (ex_addr == NOP_INSTR || ex_addr < INSTRUCTION_MEMORY_SIZE);
+    if (!ok)
+    {
+        fprintf(stderr, "Error: checkpoint %s is truncated or corrupt\n", filename);
+        return 0;
+    }
+
+    // Only the pages stored in the file can differ from initial_data
+    m->touched = data_pages | m->initial_pages;
+    m->code_end = code_blocks ? CHECKPOINT_CODE_BLOCK * (32 - __builtin_clz(code_blocks)) : 0;
+    predecode_program(m);
+    m->EX_buffer = ex_addr == NOP_INSTR ? &nop_decoded : &m->decoded_program[ex_addr];
+    m->IF_pred = m->ID_pred = 0;
+    machine_drop_clean_pages(m);
+    return 1;
+}
+
+// Load a checkpoint file; returns 0 if it cannot be read or is not valid
+int checkpoint_load(Machine *m, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        perror("Error opening checkpoint");
+        return 0;
+    }
+    int ok = checkpoint_read(m, file, filename);
+    fclose(file);
+    return ok;
+}
+
+// Writer thread of a TraceRecorder: copies published bytes to the file
+static void *recorder_writer(void *arg)
+{
+    TraceRecorder *rec = arg;
+    struct timespec pause = {0, 100000};
+    size_t tail = 0;
+    for (;;)
+    {
+        int closing = __atomic_load_n(&rec->closing, __ATOMIC_ACQUIRE);
+        size_t head = __atomic_load_n(&rec->published, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            if (closing)
+                break;
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        size_t start = tail & TRACE_RING_MASK;
+        size_t length = head - tail;
+        size_t first = length < TRACE_RING_SIZE - start ? length : TRACE_RING_SIZE - start;
+        fwrite(rec->ring + start, 1, first, rec->file);
+        fwrite(rec->ring, 1, length - first, rec->file);
+        tail = head;
+        __atomic_store_n(&rec->tail, tail, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Start recording the run of m from its current state into a trace file;
+// from_start says the state is the one pipeline_start set up. Returns NULL
+// if the file cannot be created.
+TraceRecorder *recorder_open(const Machine *m, const char *filename, int from_start)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        perror("Error writing trace");
+        return NULL;
+    }
+    TraceRecorder *rec = calloc(1, sizeof(TraceRecorder));
+    uint8_t *ring = malloc(TRACE_RING_SIZE);
+    if (rec == NULL || ring == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(ring);
+        free(rec);
+        fclose(file);
+        return NULL;
+    }
+    fwrite(TRACE_FILE_MAGIC, 1, 4, file);
+    put_u16(file, TRACE_FILE_VERSION);
+    put_u16(file, from_start ? TRACE_FROM_START : 0);
+    checkpoint_write(m, file);
+
+    rec->ring = ring;
+    rec->file = file;
+    rec->start_cycle = m->cycle;
+    rec->sreg = sreg_byte(machine_sreg(m));
+    recorder_sync(rec);
+    if (pthread_create(&rec->writer, NULL, recorder_writer, rec) != 0)
+    {
+        fprintf(stderr, "Cannot start the trace writer thread\n");
+        free(ring);
+        free(rec);
+        fclose(file);
+        return NULL;
+    }
+    return rec;
+}
+
+// End the recorded run, wait for the writer and close the file; reports the
+// trace size on stderr and returns 0 on a write error
+int recorder_close(TraceRecorder *rec, const Machine *m, const char *filename)
+{
+    if (rec->head >= rec->limit)
+        recorder_sync(rec);
+    trace_put(rec->ring, &rec->head, TREC_END);
+    trace_put_varint(rec->ring, &rec->head, m->cycle);
+    __atomic_store_n(&rec->published, rec->head, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->closing, 1, __ATOMIC_RELEASE);
+    pthread_join(rec->writer, NULL);
+
+    int ok = !ferror(rec->file);
+    if (fclose(rec->file) != 0)
+        ok = 0;
+    if (!ok)
+        fprintf(stderr, "Error writing trace %s\n", filename);
+    long long cycles = m->cycle - rec->start_cycle;
+    fprintf(stderr, "trace: cycles=%lld bytes=%zu (%.2f bytes/cycle) writer stalls=%lld\n", cycles, rec->head,
+            cycles > 0 ? (double)rec->head / cycles : 0.0, rec->stalls);
+    free(rec->ring);
+    free(rec);
+    return ok;
+}
+
+static int trace_get_varint(FILE *file, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = getc_unlocked(file);
+        if (byte == EOF)
+            return 0;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (byte < 0x80)
+            return 1;
+    }
+    return 0;
+}
+
+static int trace_get_signed(FILE *file, int32_t *value)
+{
+    uint64_t zigzag;
+    if (!trace_get_varint(file, &zigzag))
+        return 0;
+    *value = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+    return 1;
+}
+
+// Print the text output of a recorded run at m's trace level from the trace
+// alone: the machine state is rebuilt cycle by cycle from the records and
+// nothing is executed. Returns the number of cycles, or -1 if the file is
+// not a valid trace.
+long long replay_trace(Machine *m, const char *filename)
+{
+    char magic[4];
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        perror("Error opening trace");
+        return -1;
+    }
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, TRACE_FILE_MAGIC, 4) != 0 ||
+        get_u16(file) != TRACE_FILE_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a trace file\n", filename);
+        fclose(file);
+        return -1;
+    }
+    int flags = get_u16(file);
+    if (!checkpoint_read(m, file, filename))
+    {
+        fclose(file);
+        return -1;
+    }
+    if (flags & TRACE_FROM_START)
+        pipeline_start(m);
+    long long start_cycle = m->cycle;
+
+    int last_address = 0;
+    int ok = 0;
+    for (;;)
+    {
+        int tag = getc_unlocked(file);
+        if (tag == EOF)
+            break;
+        if (tag == TREC_END)
+        {
+            uint64_t cycle;
+            ok = trace_get_varint(file, &cycle) && (long long)cycle == m->cycle;
+            break;
+        }
+
+        m->cycle++;
+        m->EX_buffer = buffer_decoded(m, m->ID_buffer, m->ID_addr);
+        m->ID_buffer = m->IF_buffer;
+        m->ID_addr = m->IF_addr;
+        m->IF_addr = m->PC;
+        if (tag & TREC_FETCH_NOP)
+            m->IF_buffer = NOP_INSTR;
+        else if (m->PC < INSTRUCTION_MEMORY_SIZE)
+            m->IF_buffer = m->instruction_memory[m->PC++];
+        else
+            break;
+        if (tag & TREC_FLUSH)
+        {
+            TRACE(m, TRACE_CYCLE, "Pipeline flushed due to branch. Skipping instruction.\n");
+            m->skipped--;
+            continue;
+        }
+
+        const DecodedInstruction *ex_instr = m->EX_buffer;
+        if (m->trace.level >= TRACE_CYCLE)
+            trace_cycle(m, m->cycle, ex_instr);
+        int32_t value;
+        if ((tag & TREC_PC) && trace_get_signed(file, &value))
+            m->PC += value;
+        if (tag & TREC_REG)
+        {
+            int r = getc_unlocked(file);
+            int v = getc_unlocked(file);
+            if (r < 0 || r >= NUM_GPRS || v == EOF)
+                break;
+            m->GPR[r] = v;
+        }
+        if (tag & TREC_MEM)
+        {
+            if (!trace_get_signed(file, &value))
+                break;
+            last_address += value;
+            int v = getc_unlocked(file);
+            // Negative addresses reach the end of instruction memory, like STR
+            if (last_address < -(int)sizeof(m->instruction_memory) || last_address >= DATA_MEMORY_SIZE || v == EOF)
+                break;
+            data_write(m, last_address, v);
+        }
+        if (tag & TREC_SREG)
+        {
+            uint8_t bits = getc_unlocked(file);
+            SREG_t sreg;
+            memcpy(&sreg, &bits, 1);
+            machine_set_sreg(m, sreg);
+        }
+        if (tag & TREC_BR)
+        {
+            m->IF_buffer = NOP_INSTR;
+            m->ID_buffer = NOP_INSTR;
+        }
+        if ((tag & TREC_SKIP) && trace_get_signed(file, &value))
+            m->skipped = value;
+        if (ex_instr->opcode != 0xFF && m->trace.level >= TRACE_FULL)
+            trace_execute(m, ex_instr);
+        if (m->code_unsettled)
+            code_settle(m);
+    }
+    ok = ok && !ferror(file);
+    fclose(file);
+    if (!ok)
+    {
+        fprintf(stderr, "Error: trace %s is truncated or corrupt\n", filename);
+        return -1;
+    }
+    pipeline_finish(m);
+    return m->cycle - start_cycle;
+}
+
+// ---------------------------------------------------------------------------
+// Initial states and SIMD lockstep
+//
+// --states=FILE runs the loaded program once per line of FILE, each time
+// from a fresh register/data state with the registers and data memory words
+// given on that line ("R3=5 [10]=-2"); everything else starts from zero
+// registers and the program's initial data memory.
+//
+// With --lockstep the instances are run together in chunks of
+// LOCKSTEP_LANES. Registers, flags and data memory are stored
+// struct-of-arrays (one byte per instance, LANE_VEC_BYTES instances per
+// vector), so each instruction is dispatched once and executed for the whole
+// chunk with byte-vector operations (AVX2 when compiled for it, else SSE).
+// Instances that share the pipeline's control state (PC, buffers, flush
+// state) form a group with a per-lane mask; writes are blended under the
+// mask. A BEQZ taken by only some lanes, or a BR to different targets, splits
+// the group, and groups whose control state becomes identical again are
+// merged. Results, final PCs and cycle counts match running the instances
+// one at a time.
+// ---------------------------------------------------------------------------
+typedef struct
+{
+    int8_t GPR[NUM_GPRS];
+    int8_t data_memory[DATA_MEMORY_SIZE];
+} InitialState;
+
+// Parse one state line into state; returns 0 on a malformed token
+int parse_state_line(char *line, InitialState *state, const int8_t *initial_data)
+{
+    memset(state->GPR, 0, sizeof(state->GPR));
+    memcpy(state->data_memory, initial_data, sizeof(state->data_memory));
+    for (char *token = strtok(line, " \t\r\n,"); token != NULL; token = strtok(NULL, " \t\r\n,"))
+    {
+        int index, value;
+        if (sscanf(token, "R%d=%d", &index, &value) == 2 && index >= 0 && index < NUM_GPRS)
+            state->GPR[index] = value;
+        else if (sscanf(token, "[%d]=%d", &index, &value) == 2 && index >= 0 && index < DATA_MEMORY_SIZE)
+            state->data_memory[index] = value;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+// Read every line of a states file; returns the number of states or -1
+int load_states_file(const Machine *m, const char *filename, InitialState **states)
+{
+    char line[4096];
+    int count = 0;
+    int capacity = 0;
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        perror("Error opening states file");
+        return -1;
+    }
+    *states = NULL;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (line[0] == '#')
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            *states = realloc(*states, capacity * sizeof(InitialState));
+        }
+        if (!parse_state_line(line, &(*states)[count], m->initial_data))
+        {
+            fprintf(stderr, "%s:%d: expected Rn=value or [addr]=value\n", filename, count + 1);
+            fclose(file);
+            free(*states);
+            return -1;
+        }
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+void apply_state(Machine *m, const InitialState *state)
+{
+    memcpy(m->GPR, state->GPR, sizeof(m->GPR));
+    memcpy(m->data_memory, state->data_memory, sizeof(m->data_memory));
+    m->dirty = DIRTY_ALL;
+    m->touched |= DIRTY_ALL & ~(1ULL << DIRTY_CODE_BIT);
+}
+
+// One AVX2 register of lanes when the compiler targets AVX2 (-mavx2 or
+// -march=native), otherwise one SSE register
+#ifdef __AVX2__
+#define LANE_VEC_BYTES 32
+#else
+#define LANE_VEC_BYTES 16
+#endif
+#define LOCKSTEP_LANES 128
+#define LOCKSTEP_VECS (LOCKSTEP_LANES / LANE_VEC_BYTES)
+
+typedef int8_t LaneVec __attribute__((vector_size(LANE_VEC_BYTES)));
+typedef uint8_t LaneVecU __attribute__((vector_size(LANE_VEC_BYTES)));
+// Byte multiplies and byte shifts have no SSE/AVX instruction; they are done
+// on 16-bit lanes and masked so the compiler does not fall back to scalar code
+typedef uint16_t LaneVec16 __attribute__((vector_size(LANE_VEC_BYTES)));
+
+// LDR/STR address data memory with a 6-bit immediate, and negative ones
+// are rejected, so only these words can change; the rest of each instance's
+// data memory stays as its initial state
+#define LOCKSTEP_DATA_WORDS 32
+
+// One chunk of instances, struct-of-arrays. Flags hold 0 or 1 per lane.
+typedef struct
+{
+    LaneVec GPR[NUM_GPRS][LOCKSTEP_VECS];
+    LaneVec data_memory[LOCKSTEP_DATA_WORDS][LOCKSTEP_VECS];
+    LaneVec C[LOCKSTEP_VECS], V[LOCKSTEP_VECS], N[LOCKSTEP_VECS], S[LOCKSTEP_VECS], Z[LOCKSTEP_VECS];
+    int vecs;  // vectors in use (lanes rounded up)
+    int lanes; // instances in this chunk
+    uint16_t final_PC[LOCKSTEP_LANES];
+    long long cycles[LOCKSTEP_LANES];
+} LaneState;
+
+// Pipeline control state shared by the lanes in mask
+typedef struct
+{
+    uint16_t PC;
+    uint16_t IF_buffer;
+    uint16_t ID_buffer;
+    int IF_addr;
+    int ID_addr;
+    int skipped;
+    int remaining;
+    int lanes;                   // member lanes
+    LaneVec mask[LOCKSTEP_VECS]; // -1 for member lanes, 0 otherwise
+} LaneGroup;
+
+typedef struct
+{
+    LaneGroup groups[LOCKSTEP_LANES];
+    int count;
+    long long dispatches; // instructions executed for a group
+    long long lane_instructions;
+} LaneGroups;
+
+void *lane_alloc(size_t size)
+{
+    return aligned_alloc(LANE_VEC_BYTES, (size + LANE_VEC_BYTES - 1) / LANE_VEC_BYTES * LANE_VEC_BYTES);
+}
+
+static inline int8_t lane_get(const LaneVec *v, int lane)
+{
+    return v[lane / LANE_VEC_BYTES][lane % LANE_VEC_BYTES];
+}
+
+static inline void lane_set(LaneVec *v, int lane, int8_t value)
+{
+    v[lane / LANE_VEC_BYTES][lane % LANE_VEC_BYTES] = value;
+}
+
+// Lanes set in mask take value, the others keep old
+#define LANE_BLEND(mask, value, old) (((value) & (mask)) | ((old) & ~(mask)))
+
+// Number of lanes set in a mask
+static int lane_count(const LaneVec *mask, int vecs)
+{
+    int count = 0;
+    for (int v = 0; v < vecs; v++)
+    {
+        uint64_t words[LANE_VEC_BYTES / 8];
+        memcpy(words, &mask[v], sizeof(words));
+        for (int w = 0; w < LANE_VEC_BYTES / 8; w++)
+            count += __builtin_popcountll(words[w]) / 8;
+    }
+    return count;
+}
+
+// Program can run in lockstep: LDR/STR into instruction memory go through
+// the scalar machine's data_read and data_write, which the lanes do not have
+int lockstep_supported(const Machine *m)
+{
+    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
+    {
+        const DecodedInstruction *d = &m->decoded_program[i];
+        if ((d->opcode == 10 || d->opcode == 11) && address_in_code(d->imm))
+            return 0;
+    }
+    return 1;
+}
+
+// Write an ALU result and its N/Z flags (MUL, ANDI, EOR, SAL, SAR)
+#define LANE_NZ_RESULT(ls, g, r1, v, result)                                    \
+    do                                                                          \
+    {                                                                           \
+        LaneVec mask_ = (g)->mask[v];                                           \
+        (ls)->GPR[r1][v] = LANE_BLEND(mask_, (result), (ls)->GPR[r1][v]);       \
+        (ls)->N[v] = LANE_BLEND(mask_, ((result) < 0) & 1, (ls)->N[v]);         \
+        (ls)->Z[v] = LANE_BLEND(mask_, ((result) == 0) & 1, (ls)->Z[v]);        \
+    } while (0)
+
+// Split the lanes of group g for which taken is set into a new group;
+// returns the group holding the taken lanes (g itself if all were taken) or
+// NULL if none was
+static LaneGroup *lane_split(LaneGroups *groups, LaneGroup *g, const LaneVec *taken, int vecs)
+{
+    int count = lane_count(taken, vecs);
+    if (count == 0)
+        return NULL;
+    if (count == g->lanes)
+        return g;
+    LaneGroup *split = &groups->groups[groups->count++];
+    *split = *g;
+    split->lanes = count;
+    g->lanes -= count;
+    for (int v = 0; v < vecs; v++)
+    {
+        split->mask[v] = taken[v];
+        g->mask[v] &= ~taken[v];
+    }
+    return split;
+}
+
+// EX stage of one instruction for every lane of group g
+void lockstep_execute(LaneState *ls, LaneGroups *groups, LaneGroup *g, const DecodedInstruction *d)
+{
+    int vecs = ls->vecs;
+    uint8_t r1 = d->r1;
+    uint8_t r2 = d->r2;
+    int shift = SHIFT_COUNT(d->immshift);
+    LaneVec zero = {0};
+
+    groups->dispatches++;
+    switch (d->opcode)
+    {
+    case 0: // ADD
+        for (int v = 0; v < vecs; v++)
+        {
+            LaneVec a = ls->GPR[r1][v], b = ls->GPR[r2][v], mask = g->mask[v];
+            LaneVec r = a + b;
+            LaneVec n = (r < 0) & 1;
+            LaneVec overflow = (((a ^ r) & (b ^ r)) < 0) & 1;
+            LaneVec carry = (((a & b) | ((a | b) & ~r)) < 0) & 1;
+            ls->C[v] = LANE_BLEND(mask, carry, ls->C[v]);
+            ls->V[v] = LANE_BLEND(mask, overflow, ls->V[v]);
+            ls->N[v] = LANE_BLEND(mask, n, ls->N[v]);
+            ls->Z[v] = LANE_BLEND(mask, (r == 0) & 1, ls->Z[v]);
+            ls->S[v] = LANE_BLEND(mask, n ^ overflow, ls->S[v]);
+            ls->GPR[r1][v] = LANE_BLEND(mask, r, a);
+        }
+        break;
+    case 1: // SUB: V is computed from the updated register and is always 0
+        for (int v = 0; v < vecs; v++)
+        {
+            LaneVec a = ls->GPR[r1][v], b = ls->GPR[r2][v], mask = g->mask[v];
+            LaneVec r = a - b;
+            LaneVec n = (r < 0) & 1;
+            ls->V[v] = LANE_BLEND(mask, zero, ls->V[v]);
+            ls->N[v] = LANE_BLEND(mask, n, ls->N[v]);
+            ls->Z[v] = LANE_BLEND(mask, (r == 0) & 1, ls->Z[v]);
+            ls->S[v] = LANE_BLEND(mask, n, ls->S[v]);
+            ls->GPR[r1][v] = LANE_BLEND(mask, r, a);
+        }
+        break;
+    case 2: // MUL: even bytes from the 16-bit product, odd bytes from the high halves
+        for (int v = 0; v < vecs; v++)
+        {
+            LaneVec16 a = (LaneVec16)ls->GPR[r1][v], b = (LaneVec16)ls->GPR[r2][v];
+            LaneVec16 even = (a * b) & 0x00FF;
+            LaneVec16 odd = ((a >> 8) * (b & 0xFF00)) & 0xFF00;
+            LaneVec r = (LaneVec)(even | odd);
+            LANE_NZ_RESULT(ls, g, r1, v, r);
+        }
+        break;
+    case 3: // MOVI
+        for (int v = 0; v < vecs; v++)
+            ls->GPR[r1][v] = LANE_BLEND(g->mask[v], zero + d->imm, ls->GPR[r1][v]);
+        break;
+    case 4: // BEQZ
+    {
+        LaneVec taken[LOCKSTEP_VECS];
+        for (int v = 0; v < vecs; v++)
+            taken[v] = (ls->GPR[r1][v] == 0) & g->mask[v];
+        LaneGroup *t = lane_split(groups, g, taken, vecs);
+        if (t != NULL)
+        {
+            if (d->imm > 2)
+            {
+                t->skipped = 2;
+                t->PC = t->PC + d->imm - 2;
+            }
+            else
+            {
+                t->skipped = d->imm;
+            }
+        }
+        break;
+    }
+    case 5: // ANDI
+        for (int v = 0; v < vecs; v++)
+        {
+            LaneVec r = ls->GPR[r1][v] & d->imm;
+            LANE_NZ_RESULT(ls, g, r1, v, r);
+        }
+        break;
+    case 6: // EOR
+        for (int v = 0; v < vecs; v++)
+        {
+            LaneVec r = ls->GPR[r1][v] ^ ls->GPR[r2][v];
+            LANE_NZ_RESULT(ls, g, r1, v, r);
+        }
+        break;
+    case 7: // BR: one group per distinct target
+    {
+        for (;;)
+        {
+            int first = -1;
+            uint16_t target = 0;
+            LaneVec same[LOCKSTEP_VECS];
+            for (int v = 0; v < vecs; v++)
+                same[v] = zero;
+            for (int lane = 0; lane < ls->lanes; lane++)
+            {
+                if (!lane_get(g->mask, lane))
+                    continue;
+                uint16_t lane_target = (lane_get(ls->GPR[r1], lane) << 8) | lane_get(ls->GPR[r2], lane);
+                if (first < 0)
+                {
+                    first = lane;
+                    target = lane_target;
+                }
+                if (lane_target == target)
+                    lane_set(same, lane, -1);
+            }
+            LaneGroup *t = lane_split(groups, g, same, vecs);
+            t->PC = target;
+            t->IF_buffer = NOP_INSTR;
+            t->ID_buffer = NOP_INSTR;
+            if (t == g)
+                break;
+        }
+        break;
+    }
+    case 8: // SAL: counts of 8 and more shift everything out
+    {
+        LaneVec kept = zero + (int8_t)(shift < 8 ? 0xFF << shift : 0);
+        for (int v = 0; v < vecs; v++)
+        {
+            LaneVec r = (LaneVec)((LaneVec16)ls->GPR[r1][v] << (shift & 7)) & kept;
+            LANE_NZ_RESULT(ls, g, r1, v, r);
+        }
+        break;
+    }
+    case 9: // SAR: counts of 8 and more leave only the sign
+    {
+        int count = shift < 8 ? shift : 7;
+        LaneVec low = zero + (int8_t)(0xFF >> count);
+        for (int v = 0; v < vecs; v++)
+        {
+            LaneVec a = ls->GPR[r1][v];
+            LaneVec r = ((LaneVec)((LaneVec16)a >> count) & low) | ((a < 0) & ~low);
+            LANE_NZ_RESULT(ls, g, r1, v, r);
+        }
+        break;
+    }
+    case 10: // LDR
+        for (int v = 0; v < vecs; v++)
+            ls->GPR[r1][v] = LANE_BLEND(g->mask[v], ls->data_memory[d->imm][v], ls->GPR[r1][v]);
+        g->PC += 1;
+        break;
+    case 11: // STR
+        for (int v = 0; v < vecs; v++)
+            ls->data_memory[d->imm][v] = LANE_BLEND(g->mask[v], ls->GPR[r1][v], ls->data_memory[d->imm][v]);
+        break;
+    default:
+        break;
+    }
+}
+
+static int lane_groups_mergeable(const LaneGroup *a, const LaneGroup *b)
+{
+    return a->PC == b->PC && a->IF_buffer == b->IF_buffer && a->ID_buffer == b->ID_buffer &&
+           a->IF_addr == b->IF_addr && a->ID_addr == b->ID_addr && a->skipped == b->skipped &&
+           a->remaining == b->remaining;
+}
+
+// Record the final PC and cycle count of every lane in g
+static void lane_group_finish(LaneState *ls, const LaneGroup *g, long long cycle)
+{
+    for (int lane = 0; lane < ls->lanes; lane++)
+    {
+        if (lane_get(g->mask, lane))
+        {
+            ls->final_PC[lane] = g->PC;
+            ls->cycles[lane] = cycle;
+        }
+    }
+}
+
+// Run the machine's program on every lane of ls; same cycle loop as
+// run_pipeline, once per group
+void lockstep_run(Machine *m, LaneState *ls, LaneGroups *groups)
+{
+    long long cycle = 0;
+    LaneGroup *first = &groups->groups[0];
+
+    memset(first, 0, sizeof(*first));
+    first->IF_buffer = NOP_INSTR;
+    first->ID_buffer = NOP_INSTR;
+    first->remaining = INT32_MAX;
+    first->PC = m->entry_pc;
+    for (int lane = 0; lane < ls->lanes; lane++)
+        lane_set(first->mask, lane, -1);
+    first->lanes = ls->lanes;
+    groups->count = 1;
+
+    while (groups->count > 0 && cycle < m->max_cycles)
+    {
+        cycle++;
+        int count = groups->count; // groups split off this cycle are already done
+        for (int i = 0; i < count; i++)
+        {
+            LaneGroup *g = &groups->groups[i];
+            const DecodedInstruction *ex = buffer_decoded(m, g->ID_buffer, g->ID_addr);
+            g->ID_buffer = g->IF_buffer;
+            g->ID_addr = g->IF_addr;
+            g->IF_addr = g->PC;
+            if (g->PC < INSTRUCTION_MEMORY_SIZE && m->instruction_memory[g->PC] != 0)
+                g->IF_buffer = m->instruction_memory[g->PC++];
+            else
+                g->IF_buffer = NOP_INSTR;
+            if (g->IF_buffer == NOP_INSTR)
+            {
+                if (g->remaining == INT32_MAX)
+                    g->remaining = 2;
+                g->remaining--;
+            }
+            if (g->skipped > 0)
+            {
+                g->skipped--;
+                continue;
+            }
+            if (ex->opcode != 0xFF)
+            {
+                groups->lane_instructions += g->lanes;
+                lockstep_execute(ls, groups, g, ex);
+            }
+        }
+
+        // Retire finished groups and merge groups that reconverged
+        for (int i = 0; i < groups->count; i++)
+        {
+            LaneGroup *g = &groups->groups[i];
+            int drop = 0;
+            if (g->remaining <= 0)
+            {
+                lane_group_finish(ls, g, cycle);
+                drop = 1;
+            }
+            else
+            {
+                for (int j = 0; j < i; j++)
+                {
+                    if (lane_groups_mergeable(&groups->groups[j], g))
+                    {
+                        for (int v = 0; v < ls->vecs; v++)
+                            groups->groups[j].mask[v] |= g->mask[v];
+                        groups->groups[j].lanes += g->lanes;
+                        drop = 1;
+                        break;
+                    }
+                }
+            }
+            if (drop)
+            {
+                *g = groups->groups[--groups->count];
+                i--;
+            }
+        }
+    }
+    for (int i = 0; i < groups->count; i++)
+        lane_group_finish(ls, &groups->groups[i], cycle);
+}
+
+// Run the program from every initial state, one machine at a time or in
+// lockstep chunks, printing each instance's final state in order
+long long run_states(Machine *m, const InitialState *states, int count, int lockstep)
+{
+    long long total_cycles = 0;
+    int n = 0;
+    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++)
+    {
+        if (m->instruction_memory[i] != 0)
+            n++;
+    }
+
+    if (!lockstep)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            TRACE(m, TRACE_SUMMARY, "==> state %d <==\n", i + 1);
+            reset_state(m);
+            apply_state(m, &states[i]);
+            if (m->dcache != NULL)
+                dcache_invalidate(m->dcache);
+            if (m->pipeline != NULL)
+                pipeline_model_start(m->pipeline);
+            long long cycles = run_pipeline(m);
+            if (m->dcache != NULL)
+            {
+                char what[32];
+                snprintf(what, sizeof(what), "state %d", i + 1);
+                dcache_end_run(m->dcache, what, cycles);
+            }
+            total_cycles += cycles;
+        }
+        return total_cycles;
+    }
+
+    // Vector members need LANE_VEC_BYTES alignment, more than malloc promises
+    LaneState *ls = lane_alloc(sizeof(LaneState));
+    LaneGroups *groups = lane_alloc(sizeof(LaneGroups));
+    if (ls == NULL || groups == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(ls);
+        free(groups);
+        return 0;
+    }
+    groups->dispatches = 0;
+    groups->lane_instructions = 0;
+
+    for (int base = 0; base < count; base += LOCKSTEP_LANES)
+    {
+        ls->lanes = count - base < LOCKSTEP_LANES ? count - base : LOCKSTEP_LANES;
+        ls->vecs = (ls->lanes + LANE_VEC_BYTES - 1) / LANE_VEC_BYTES;
+        memset(ls->GPR, 0, sizeof(ls->GPR));
+        memset(ls->data_memory, 0, sizeof(ls->data_memory));
+        memset(ls->C, 0, sizeof(ls->C));
+        memset(ls->V, 0, sizeof(ls->V));
+        memset(ls->N, 0, sizeof(ls->N));
+        memset(ls->S, 0, sizeof(ls->S));
+        memset(ls->Z, 0, sizeof(ls->Z));
+        for (int lane = 0; lane < ls->lanes; lane++)
+        {
+            const InitialState *state = &states[base + lane];
+            for (int r = 0; r < NUM_GPRS; r++)
+                lane_set(ls->GPR[r], lane, state->GPR[r]);
+            for (int a = 0; a < LOCKSTEP_DATA_WORDS; a++)
+                lane_set(ls->data_memory[a], lane, state->data_memory[a]);
+        }
+
+        lockstep_run(m, ls, groups);
+
+        for (int lane = 0; lane < ls->lanes; lane++)
+        {
+            total_cycles += ls->cycles[lane];
+            if (m->trace.level < TRACE_SUMMARY)
+                continue;
+            // Gather the lane into the machine to print it like run_pipeline
+            for (int r = 0; r < NUM_GPRS; r++)
+                m->GPR[r] = lane_get(ls->GPR[r], lane);
+            memcpy(m->data_memory, states[base + lane].data_memory, sizeof(m->data_memory));
+            for (int a = 0; a < LOCKSTEP_DATA_WORDS; a++)
+                m->data_memory[a] = lane_get(ls->data_memory[a], lane);
+            SREG_t sreg = {lane_get(ls->C, lane), lane_get(ls->V, lane), lane_get(ls->N, lane),
+                           lane_get(ls->S, lane), lane_get(ls->Z, lane), 0};
+            machine_set_sreg(m, sreg);
+            m->PC = ls->final_PC[lane];
+            m->dirty = DIRTY_ALL;
+            m->touched |= DIRTY_ALL & ~(1ULL << DIRTY_CODE_BIT);
+            trace_printf(&m->trace, "==> state %d <==\n", base + lane + 1);
+            trace_printf(&m->trace, "initialized count is: %d\n", n);
+            trace_final_state(m);
+        }
+    }
+    trace_flush(&m->trace);
+    fprintf(stderr, "lockstep: dispatches=%lld instances/dispatch=%.1f\n",
+            groups->dispatches, groups->dispatches ? (double)groups->lane_instructions / groups->dispatches : 0.0);
+    free(ls);
+    free(groups);
+    return total_cycles;
+}
+
+// ---------------------------------------------------------------------------
+// Assembler
+//
+// A program file is assembled in a single pass over its bytes, mapped into
+// memory where the platform allows it. Mnemonics are packed into a 32-bit key
+// and matched with one switch, operands are scanned in place. Both the
+// "MOVI R1 5" form and the "MOVI R1, 5" / "LDR R4, [6]" / "BEQZ R1, +2" form
+// are accepted, in any letter case. Blank lines and comments (";", "//" or
+// "#" up to the end of the line) are skipped. Two directives set up the
+// initial state: ".entry N" starts the program at address N and
+// ".data ADDR V1 V2 ..." puts bytes into data memory from ADDR on. Mistakes
+// are reported with their line number.
+// ---------------------------------------------------------------------------
+#define ASM_MAX_ERRORS 20
+#define ASM_KEY(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+typedef struct
+{
+    const char *filename;
+    int line;
+    int errors;
+} AsmSource;
+
+void asm_error(AsmSource *src, const char *fmt, ...)
+{
+    if (src->errors++ >= ASM_MAX_ERRORS)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s:%d: ", src->filename, src->line);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+// Opcode (0..11) of a mnemonic of len characters, -1 if there is none
+int asm_opcode(const char *name, int len)
+{
+    if (len < 2 || len > 4)
+        return -1;
+    uint32_t key = 0;
+    for (int i = 0; i < len; i++)
+        key |= (uint32_t)(name[i] & ~0x20) << (8 * i); // upper case
+    switch (key)
+    {
+    case ASM_KEY('A', 'D', 'D', 0):
+        return 0;
+    case ASM_KEY('S', 'U', 'B', 0):
+        return 1;
+    case ASM_KEY('M', 'U', 'L', 0):
+        return 2;
+    case ASM_KEY('M', 'O', 'V', 'I'):
+        return 3;
+    case ASM_KEY('B', 'E', 'Q', 'Z'):
+        return 4;
+    case ASM_KEY('A', 'N', 'D', 'I'):
+        return 5;
+    case ASM_KEY('E', 'O', 'R', 0):
+        return 6;
+    case ASM_KEY('B', 'R', 0, 0):
+        return 7;
+    case ASM_KEY('S', 'A', 'L', 0):
+        return 8;
+    case ASM_KEY('S', 'A', 'R', 0):
+        return 9;
+    case ASM_KEY('L', 'D', 'R', 0):
+        return 10;
+    case ASM_KEY('S', 'T', 'R', 0):
+        return 11;
+    }
+    return -1;
+}
+
+static inline int asm_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline int asm_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Skip blanks and, once an operand has been read, one optional comma
+static inline const char *asm_skip(const char *p, const char *end, int comma)
+{
+    while (p < end && asm_is_space(*p))
+        p++;
+    if (comma && p < end && *p == ',')
+    {
+        p++;
+        while (p < end && asm_is_space(*p))
+            p++;
+    }
+    return p;
+}
+
+static inline int asm_at_line_end(const char *p, const char *end)
+{
+    return p == end || *p == '\n' || *p == ';' || *p == '#' ||
+           (*p == '/' && p + 1 < end && p[1] == '/');
+}
+
+// Register operand R0..R63; returns the register or -1
+int asm_register(const char **pos, const char *end)
+{
+    const char *p = *pos;
+    if (p == end || (*p != 'R' && *p != 'r') || p + 1 == end || !asm_is_digit(p[1]))
+        return -1;
+    int reg = 0;
+    for (p++; p < end && asm_is_digit(*p) && reg < 64; p++)
+        reg = reg * 10 + (*p - '0');
+    if (reg >= 64 || (p < end && asm_is_digit(*p)))
+        return -1;
+    *pos = p;
+    return reg;
+}
+
+// Immediate operand: n, +n, -n, optionally written as [n]; returns 1 if one
+// was found
+int asm_immediate(const char **pos, const char *end, int *value)
+{
+    const char *p = *pos;
+    int bracket = p < end && *p == '[';
+    if (bracket)
+        p = asm_skip(p + 1, end, 0);
+    int negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+    if (p == end || !asm_is_digit(*p))
+        return 0;
+    int n = 0;
+    for (; p < end && asm_is_digit(*p); p++)
+        n = n < 100000 ? n * 10 + (*p - '0') : n;
+    if (bracket)
+    {
+        p = asm_skip(p, end, 0);
+        if (p == end || *p != ']')
+            return 0;
+        p++;
+    }
+    *value = negative ? -n : n;
+    *pos = p;
+    return 1;
+}
+
+// .entry and .data; name..p is the directive, the rest of the line its
+// operands. Returns where parsing stopped.
+const char *asm_directive(Machine *m, AsmSource *src, const char *name, const char *p, const char *end)
+{
+    int len = (int)(p - name);
+    int value;
+    p = asm_skip(p, end, 0);
+    if (len == 6 && strncmp(name, ".entry", 6) == 0)
+    {
+        if (!asm_immediate(&p, end, &value) || value < 0 || value >= INSTRUCTION_MEMORY_SIZE)
+        {
+            asm_error(src, ".entry needs an address 0..%d", INSTRUCTION_MEMORY_SIZE - 1);
+            return p;
+        }
+        m->entry_pc = (uint16_t)value;
+        p = asm_skip(p, end, 0);
+    }
+    else if (len == 5 && strncmp(name, ".data", 5) == 0)
+    {
+        int address;
+        if (!asm_immediate(&p, end, &address) || address < 0 || address >= DATA_MEMORY_SIZE)
+        {
+            asm_error(src, ".data needs an address 0..%d", DATA_MEMORY_SIZE - 1);
+            return p;
+        }
+        for (p = asm_skip(p, end, 1); !asm_at_line_end(p, end); p = asm_skip(p, end, 1))
+        {
+            if (!asm_immediate(&p, end, &value) || value < -128 || value > 255)
+            {
+                asm_error(src, ".data values are bytes, -128..255");
+                return p;
+            }
+            if (address == DATA_MEMORY_SIZE)
+            {
+                asm_error(src, ".data runs past the end of data memory");
+                return p;
+            }
+            m->initial_pages |= 1ULL << (address / DATA_PAGE_SIZE);
+            m->touched |= 1ULL << (address / DATA_PAGE_SIZE);
+            m->initial_data[address++] = (int8_t)value;
+        }
+    }
+    else
+    {
+        asm_error(src, "unknown directive '%.*s'", len, name);
+        return p;
+    }
+    if (!asm_at_line_end(p, end))
+        asm_error(src, "unexpected text after the operands");
+    return p;
+}
+
+// Assemble lines [p, end) into the machine's instruction memory. Returns the
+// number of instructions, or -1 after reporting errors on stderr; *lines is
+// set to the number of source lines.
+int assemble_source(Machine *m, const char *p, const char *end, const char *filename, int *lines)
+{
+    AsmSource src = {filename, 0, 0};
+    int count = 0;
+
+    while (p < end)
+    {
+        src.line++;
+        p = asm_skip(p, end, 0);
+        if (asm_at_line_end(p, end))
+            goto next_line;
+
+        const char *name = p;
+        while (p < end && !asm_is_space(*p) && *p != '\n' && *p != ',')
+            p++;
+        if (*name == '.')
+        {
+            p = asm_directive(m, &src, name, p, end);
+            goto next_line;
+        }
+        int opcode = asm_opcode(name, (int)(p - name));
+        if (opcode < 0)
+        {
+            asm_error(&src, "unknown instruction '%.*s'", (int)(p - name), name);
+            goto next_line;
+        }
+
+        p = asm_skip(p, end, 0);
+        int r1 = asm_register(&p, end);
+        if (r1 < 0)
+        {
+            asm_error(&src, "expected a register R0..R63 as first operand");
+            goto next_line;
+        }
+        p = asm_skip(p, end, 1);
+
+        int operand;
+        // ADD, SUB, MUL, EOR and BR take a second register
+        if (opcode <= 2 || opcode == 6 || opcode == 7)
+        {
+            operand = asm_register(&p, end);
+            if (operand < 0)
+            {
+                asm_error(&src, "expected a register R0..R63 as second operand");
+                goto next_line;
+            }
+        }
+        else if (!asm_immediate(&p, end, &operand))
+        {
+            asm_error(&src, "expected an immediate as second operand");
+            goto next_line;
+        }
+        else if (operand < -32 || operand > 63)
+        {
+            // Values 32..63 are kept as their 6-bit pattern, as before
+            asm_error(&src, "immediate %d does not fit in 6 bits", operand);
+            goto next_line;
+        }
+        else if ((opcode == 8 || opcode == 9) && operand < 0)
+        {
+            asm_error(&src, "negative shift amount %d", operand);
+            goto next_line;
+        }
+
+        p = asm_skip(p, end, 0);
+        if (!asm_at_line_end(p, end))
+        {
+            asm_error(&src, "unexpected text after the operands");
+            goto next_line;
+        }
+        if (count == INSTRUCTION_MEMORY_SIZE)
+            asm_error(&src, "program does not fit in %d instructions", INSTRUCTION_MEMORY_SIZE);
+        else
+            m->instruction_memory[count] = (uint16_t)(opcode << 12 | r1 << 6 | (operand & 0x3F));
+        count++;
+
+    next_line:
+        while (p < end && *p != '\n')
+            p++;
+        if (p < end)
+            p++;
+    }
+    m->dirty |= 1ULL << DIRTY_CODE_BIT;
+    if (count > m->code_end)
+        m->code_end = count < INSTRUCTION_MEMORY_SIZE ? count : INSTRUCTION_MEMORY_SIZE;
+    *lines = src.line;
+    if (src.errors > ASM_MAX_ERRORS)
+        fprintf(stderr, "%s: %d more errors\n", filename, src.errors - ASM_MAX_ERRORS);
+    return src.errors ? -1 : count;
+}
+
+// ---------------------------------------------------------------------------
+// Input files and program images
+//
+// Program files are read whole: files up to FILE_READ_LIMIT bytes with one
+// read() (cheaper than setting up a mapping), larger ones are mapped.
+//
+// A program image is an assembled program in a little-endian binary form
+// that loads without parsing:
+//
+//   "PSIM" | version u16 | flags u16 (0) | entry PC u16 | word count u16 |
+//   data address u16 | data length u16 | words u16[count] | data bytes
+//
+// The words go to instruction memory from address 0, the data bytes are the
+// initial data memory from the data address on. load_program_file tells
+// images from text by the magic.
+// ---------------------------------------------------------------------------
+#define FILE_READ_LIMIT 16384
+#define IMAGE_MAGIC "PSIM"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 16
+
+typedef struct
+{
+    const char *data;
+    size_t size;
+    int mapped;
+} FileView;
+
+// Make a whole file readable at view->data; returns 0 (after printing why)
+// if it cannot be read
+int file_view_open(FileView *view, const char *filename)
+{
+    view->data = NULL;
+    view->size = 0;
+    view->mapped = 0;
+#ifdef __unix__
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("Error opening file");
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    if (st.st_size > FILE_READ_LIMIT)
+    {
+        void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (text == MAP_FAILED)
+        {
+            perror("Error reading file");
+            return 0;
+        }
+        view->data = text;
+        view->size = st.st_size;
+        view->mapped = 1;
+        return 1;
+    }
+    char *text = malloc(st.st_size + 1);
+    ssize_t size = text != NULL ? read(fd, text, st.st_size) : -1;
+    close(fd);
+    if (size < 0)
+    {
+        perror("Error reading file");
+        free(text);
+        return 0;
+    }
+#else
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        perror("Error opening file");
+        return 0;
+    }
+    char *text = NULL;
+    size_t size = 0, capacity = 0, n;
+    do
+    {
+        if (size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : FILE_READ_LIMIT;
+            text = realloc(text, capacity);
+        }
+        n = fread(text + size, 1, capacity - size, file);
+        size += n;
+    } while (n > 0);
+    fclose(file);
+#endif
+    view->data = text;
+    view->size = size;
+    return 1;
+}
+
+void file_view_close(FileView *view)
+{
+#ifdef __unix__
+    if (view->mapped)
+    {
+        munmap((void *)view->data, view->size);
+        return;
+    }
+#endif
+    free((void *)view->data);
+}
+
+static inline uint16_t image_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+int is_program_image(const char *data, size_t size)
+{
+    return size >= 4 && memcmp(data, IMAGE_MAGIC, 4) == 0;
+}
+
+// Load a program image into instruction memory and the initial data/PC;
+// returns the number of instructions or -1 if the image is not valid
+int image_load(Machine *m, const char *data, size_t size, const char *filename)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    if (size < IMAGE_HEADER_SIZE || image_u16(bytes + 4) != IMAGE_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a version %d program image\n", filename, IMAGE_VERSION);
+        return -1;
+    }
+    uint16_t entry = image_u16(bytes + 8);
+    uint16_t count = image_u16(bytes + 10);
+    uint16_t data_address = image_u16(bytes + 12);
+    uint16_t data_length = image_u16(bytes + 14);
+    if (image_u16(bytes + 6) != 0 || entry >= INSTRUCTION_MEMORY_SIZE || count > INSTRUCTION_MEMORY_SIZE ||
+        data_address + data_length > DATA_MEMORY_SIZE ||
+        size != IMAGE_HEADER_SIZE + 2 * (size_t)count + data_length)
+    {
+        fprintf(stderr, "Error: program image %s is truncated or corrupt\n", filename);
+        return -1;
+    }
+
+    const uint8_t *words = bytes + IMAGE_HEADER_SIZE;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(m->instruction_memory, words, 2 * (size_t)count);
+#else
+    for (int i = 0; i < count; i++)
+        m->instruction_memory[i] = image_u16(words + 2 * i);
+#endif
+    int code_end = machine_code_end(m);
+    if (code_end > count)
+        memset(m->instruction_memory + count, 0, 2 * (size_t)(code_end - count));
+    m->code_end = count;
+    m->dirty |= 1ULL << DIRTY_CODE_BIT;
+
+    for (int p = 0; p < DATA_PAGES; p++)
+    {
+        if ((m->initial_pages >> p) & 1)
+            memset(m->initial_data + p * DATA_PAGE_SIZE, 0, DATA_PAGE_SIZE);
+    }
+    m->touched |= m->initial_pages;
+    m->initial_pages = 0;
+    memcpy(m->initial_data + data_address, words + 2 * (size_t)count, data_length);
+    for (int p = data_address / DATA_PAGE_SIZE; p * DATA_PAGE_SIZE < data_address + data_length; p++)
+        m->initial_pages |= 1ULL << p;
+    m->touched |= m->initial_pages;
+    m->entry_pc = entry;
+    return count;
+}
+
+// Write the loaded program (instruction memory up to the last non-zero word,
+// initial data memory from its first to its last non-zero byte and the entry
+// PC) as a program image; returns 0 on error
+int image_save(const Machine *m, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        perror("Error creating program image");
+        return 0;
+    }
+    int count = INSTRUCTION_MEMORY_SIZE;
+    while (count > 0 && m->instruction_memory[count - 1] == 0)
+        count--;
+    int first = 0, last = DATA_MEMORY_SIZE;
+    while (first < last && m->initial_data[first] == 0)
+        first++;
+    while (last > first && m->initial_data[last - 1] == 0)
+        last--;
+
+    fwrite(IMAGE_MAGIC, 1, 4, file);
+    put_u16(file, IMAGE_VERSION);
+    put_u16(file, 0);
+    put_u16(file, m->entry_pc);
+    put_u16(file, (uint16_t)count);
+    put_u16(file, (uint16_t)(last > first ? first : 0));
+    put_u16(file, (uint16_t)(last - first));
+    for (int i = 0; i < count; i++)
+        put_u16(file, m->instruction_memory[i]);
+    fwrite(m->initial_data + first, 1, last - first, file);
+
+    int ok = !ferror(file);
+    if (fclose(file) != 0)
+        ok = 0;
+    if (!ok)
+        fprintf(stderr, "Error writing program image %s\n", filename);
+    return ok;
+}
+
+// Assemble a program file; returns the number of instructions, or -1 if the
+// file cannot be read or has errors
+int assemble_file(Machine *m, const char *filename, int *lines)
+{
+    FileView view;
+    if (!file_view_open(&view, filename))
+        return -1;
+    int count = assemble_source(m, view.data, view.data + view.size, filename, lines);
+    file_view_close(&view);
+    return count;
+}
+
+// Allocate a machine with an empty program. A JIT engine that cannot be set
+// up falls back to the threaded engine.
+Machine *machine_create(TraceLevel level, ExecutionEngine engine, long long max_cycles, FILE *out)
+{
+    Machine *m = calloc(1, sizeof(Machine));
+    if (m == NULL)
+        return NULL;
+    m->trace.level = level;
+    m->trace.out = out;
+    m->engine = engine;
+    m->max_cycles = max_cycles;
+    m->decoded_end = INSTRUCTION_MEMORY_SIZE; // nothing decoded yet
+    if (m->engine == ENGINE_JIT && !jit_init(m))
+    {
+        fprintf(stderr, "JIT not available on this platform, using the threaded engine\n");
+        m->engine = ENGINE_THREADED;
+    }
+    if (m->engine == ENGINE_MEMO && !memo_init(m))
+    {
+        free(m);
+        return NULL;
+    }
+    resetAll(m);
+    return m;
+}
+
+void machine_destroy(Machine *m)
+{
+    if (m == NULL)
+        return;
+    jit_free(m);
+    memo_free(m);
+    machine_drop_clean_pages(m);
+    free(m->profile);
+    predictor_free(m->predictor);
+    dcache_free(m->dcache);
+    pipeline_model_free(m->pipeline);
+    free(m->debugger);
+    free(m);
+}
+
+// Load a program (assembler text or a program image) from memory into the
+// machine's instruction memory, predecode it and reset the machine to the
+// program's initial state; returns 0 if it is not valid
+int load_program(Machine *m, const char *data, size_t size, const char *filename)
+{
+    int lines;
+    int count;
+    if (is_program_image(data, size))
+        count = image_load(m, data, size, filename);
+    else
+        count = assemble_source(m, data, data + size, filename, &lines);
+    if (count < 0)
+        return 0;
+    TRACE(m, TRACE_SUMMARY, "\n"); // for clean output after last line
+    predecode_program(m);
+    reset_state(m);
+    return 1;
+}
+
+// load_program for a file; returns 0 if it cannot be read or is not valid
+int load_program_file(Machine *m, const char *filename)
+{
+    FileView view;
+    TRACE(m, TRACE_SUMMARY, "\nFile Content:\n");
+    if (!file_view_open(&view, filename))
+        return 0;
+    int ok = load_program(m, view.data, view.size, filename);
+    file_view_close(&view);
+    return ok;
+}
+
+// Seconds from a monotonic clock, for the benchmark report
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ---------------------------------------------------------------------------
+// Sampled simulation (--sample)
+//
+// Estimates what the timing models would add to a long run from a few
+// intervals of it. A functional pass with the models off cuts the run into
+// intervals of INTERVAL instructions, snapshots the start of each and
+// records its basic-block vector (how many instructions every basic block
+// executed) projected onto SAMPLE_DIMENSIONS random directions, as SimPoint
+// does. k-means groups intervals with similar vectors into at most K
+// clusters. The interval closest to a cluster's centre is rerun from its
+// snapshot with fresh timing models, warmed up on the last WARMUP
+// instructions before it, and stands for every interval of the cluster.
+// The interval farthest from the centre is rerun as well: the difference
+// of the two, applied to the whole cluster, bounds the estimate's error.
+//
+// Cycle and instruction counts come out of the functional pass exactly
+// (it keeps the pipeline's time); only the cycles the models add or save
+// (branch prediction, cache stalls, hazard stalls) are estimated.
+// ---------------------------------------------------------------------------
+#define SAMPLE_CLUSTERS 10
+#define SAMPLE_DIMENSIONS 15
+#define SAMPLE_ITERATIONS 100
+
+typedef struct
+{
+    long long interval;
+    int clusters;
+    long long warmup;
+    // Timing models as given to --predictor, --dcache and --pipeline
+    const char *predictor;
+    int btb_entries;
+    const char *dcache;
+    int dcache_miss;
+    const char *pipeline;
+} SampleConfig;
+
+typedef struct
+{
+    Snapshot *start;
+    long long instructions;
+    long long cycles;
+    double vector[SAMPLE_DIMENSIONS];
+    int cluster;
+} SampleInterval;
+
+// Give the machine fresh timing models; returns 0 if one could not be made
+static int sample_models_create(Machine *m, const SampleConfig *config)
+{
+    if ((config->predictor != NULL && (m->predictor = predictor_create(config->predictor, config->btb_entries)) == NULL) ||
+        (config->dcache != NULL && (m->dcache = dcache_create(config->dcache, config->dcache_miss)) == NULL) ||
+        (config->pipeline != NULL && (m->pipeline = pipeline_model_create(config->pipeline)) == NULL))
+        return 0;
+    if (m->dcache != NULL)
+        dcache_invalidate(m->dcache);
+    return 1;
+}
+
+static void sample_models_free(Machine *m)
+{
+    predictor_free(m->predictor);
+    dcache_free(m->dcache);
+    pipeline_model_free(m->pipeline);
+    m->predictor = NULL;
+    m->dcache = NULL;
+    m->pipeline = NULL;
+}
+
+// Cycles the machine's timing models have added so far
+static long long sample_model_cycles(const Machine *m)
+{
+    long long cycles = 0;
+    if (m->predictor != NULL)
+        cycles += m->predictor->predicted_cycles - m->predictor->branch_cycles;
+    if (m->dcache != NULL)
+        cycles += m->dcache->run.stall_cycles;
+    if (m->pipeline != NULL)
+        cycles += m->pipeline->total_stalls;
+    return cycles;
+}
+
+// Rerun interval i with the timing models and set *added to the cycles
+// they added (negative if they saved some); returns 0 if they could not be
+// made
+static int sample_rerun(Machine *m, const SampleInterval *intervals, int i, const SampleConfig *config,
+                        long long *added)
+{
+    const SampleInterval *interval = &intervals[i];
+    snapshot_restore(m, interval->start);
+    if (i > 0 && config->warmup > 0)
+    {
+        // Start early enough to warm the models on the previous interval
+        snapshot_restore(m, intervals[i - 1].start);
+        if (intervals[i - 1].instructions > config->warmup)
+            functional_run(m, intervals[i - 1].instructions - config->warmup);
+    }
+    if (!sample_models_create(m, config))
+    {
+        sample_models_free(m);
+        return 0;
+    }
+    pipeline_run(m, interval->start->cycle);
+    long long before = sample_model_cycles(m);
+    pipeline_run(m, interval->start->cycle + interval->cycles);
+    *added = sample_model_cycles(m) - before;
+    sample_models_free(m);
+    return 1;
+}
+
+static double sample_distance(const double *a, const double *b)
+{
+    double sum = 0;
+    for (int d = 0; d < SAMPLE_DIMENSIONS; d++)
+        sum += (a[d] - b[d]) * (a[d] - b[d]);
+    return sum;
+}
+
+// Group the intervals into at most k clusters (k-means, weighted by the
+// instructions of each interval, started from the intervals farthest from
+// each other); returns the number of clusters
+static int sample_cluster(SampleInterval *intervals, int count, int k, double (*centres)[SAMPLE_DIMENSIONS])
+{
+    int clusters = 1;
+    memcpy(centres[0], intervals[0].vector, sizeof(centres[0]));
+    while (clusters < k)
+    {
+        int farthest = -1;
+        double distance = 0;
+        for (int i = 0; i < count; i++)
+        {
+            double nearest = sample_distance(intervals[i].vector, centres[0]);
+            for (int c = 1; c < clusters; c++)
+            {
+                double d = sample_distance(intervals[i].vector, centres[c]);
+                if (d < nearest)
+                    nearest = d;
+            }
+            if (nearest > distance)
+            {
+                distance = nearest;
+                farthest = i;
+            }
+        }
+        if (farthest < 0)
+            break; // fewer distinct vectors than clusters
+        memcpy(centres[clusters++], intervals[farthest].vector, sizeof(centres[0]));
+    }
+
+    for (int iteration = 0; iteration < SAMPLE_ITERATIONS; iteration++)
+    {
+        int moved = 0;
+        for (int i = 0; i < count; i++)
+        {
+            int best = 0;
+            for (int c = 1; c < clusters; c++)
+            {
+                if (sample_distance(intervals[i].vector, centres[c]) <
+                    sample_distance(intervals[i].vector, centres[best]))
+                    best = c;
+            }
+            moved |= iteration == 0 || intervals[i].cluster != best;
+            intervals[i].cluster = best;
+        }
+        if (!moved)
+            break;
+        for (int c = 0; c < clusters; c++)
+        {
+            double sum[SAMPLE_DIMENSIONS] = {0};
+            double weight = 0;
+            for (int i = 0; i < count; i++)
+            {
+                if (intervals[i].cluster != c)
+                    continue;
+                for (int d = 0; d < SAMPLE_DIMENSIONS; d++)
+                    sum[d] += intervals[i].vector[d] * intervals[i].instructions;
+                weight += intervals[i].instructions;
+            }
+            for (int d = 0; weight > 0 && d < SAMPLE_DIMENSIONS; d++)
+                centres[c][d] = sum[d] / weight;
+        }
+    }
+    return clusters;
+}
+
+// Run the loaded program (from reset) once functionally and estimate the cycles of a
+// run with the timing models from a few detailed intervals, reported on
+// stderr; the machine is left in the final state. Returns 0 on error.
+int run_sampled(Machine *m, const SampleConfig *config)
+{
+    pipeline_start(m);
+    int ok = 1;
+    TraceLevel level = m->trace.level;
+    m->trace.level = TRACE_NONE;
+    m->executions = calloc(INSTRUCTION_MEMORY_SIZE, sizeof(uint32_t));
+    SampleInterval *intervals = NULL;
+    int count = 0;
+    int capacity = 0;
+    double start = now_seconds();
+    if (m->executions == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        m->trace.level = level;
+        return 0;
+    }
+
+    // Basic blocks start at branch targets and after branches; every block
+    // gets a random direction to project its instruction count onto
+    static double directions[INSTRUCTION_MEMORY_SIZE][SAMPLE_DIMENSIONS];
+    uint32_t seed = 0x9E3779B9u;
+    uint8_t leader[INSTRUCTION_MEMORY_SIZE] = {0};
+    leader[0] = leader[m->entry_pc] = 1;
+    for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+    {
+        const DecodedInstruction *d = &m->decoded_program[a];
+        if ((d->opcode == 4 || d->opcode == 7) && a + 1 < INSTRUCTION_MEMORY_SIZE)
+            leader[a + 1] = 1;
+        if (d->opcode == 4 && a + 1 + d->imm >= 0 && a + 1 + d->imm < INSTRUCTION_MEMORY_SIZE)
+            leader[a + 1 + d->imm] = 1;
+    }
+    for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+    {
+        if (leader[a])
+        {
+            for (int d = 0; d < SAMPLE_DIMENSIONS; d++)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                directions[a][d] = seed / (double)UINT32_MAX * 2 - 1;
+            }
+        }
+        else
+        {
+            memcpy(directions[a], directions[a - 1], sizeof(directions[a]));
+        }
+    }
+
+    // Functional pass: one snapshot and vector per interval
+    long long instructions = 0;
+    while (m->remaining > 0 && m->cycle < m->max_cycles)
+    {
+        if (count == capacity)
+        {
+            SampleInterval *grown = realloc(intervals, (capacity ? capacity * 2 : 64) * sizeof(SampleInterval));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Out of memory\n");
+                ok = 0;
+                break;
+            }
+            intervals = grown;
+            capacity = capacity ? capacity * 2 : 64;
+        }
+        Snapshot *snap = snapshot_take(m);
+        if (snap == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            ok = 0;
+            break;
+        }
+        long long executed = functional_run(m, config->interval);
+        if (executed == 0)
+        {
+            // Only the drain was left; it belongs to the last interval
+            if (count > 0)
+                intervals[count - 1].cycles += m->cycle - snap->cycle;
+            snapshot_release(snap);
+            break;
+        }
+        SampleInterval *interval = &intervals[count++];
+        interval->start = snap;
+        interval->instructions = executed;
+        interval->cycles = m->cycle - snap->cycle;
+        interval->cluster = 0;
+        memset(interval->vector, 0, sizeof(interval->vector));
+        for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+        {
+            if (m->executions[a] == 0)
+                continue;
+            for (int d = 0; d < SAMPLE_DIMENSIONS; d++)
+                interval->vector[d] += (double)m->executions[a] / executed * directions[a][d];
+            m->executions[a] = 0;
+        }
+        instructions += executed;
+    }
+    free(m->executions);
+    m->executions = NULL;
+    long long cycles = m->cycle;
+    double functional_time = now_seconds() - start;
+    Snapshot *final = ok ? snapshot_take(m) : NULL;
+
+    // Cluster, then rerun each cluster's representative and farthest member
+    int k = config->clusters < count ? config->clusters : count;
+    double (*centres)[SAMPLE_DIMENSIONS] = calloc(k > 0 ? k : 1, sizeof(*centres));
+    if (ok && (final == NULL || centres == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        ok = 0;
+    }
+    if (ok && count > 0)
+    {
+        int clusters = sample_cluster(intervals, count, k, centres);
+        double estimate = 0;
+        double bound = 0;
+        long long rerun_instructions = 0;
+        int reruns = 0;
+        start = now_seconds();
+        for (int c = 0; c < clusters && ok; c++)
+        {
+            int members = 0;
+            int nearest = -1;
+            int farthest = -1;
+            long long weight = 0;
+            for (int i = 0; i < count; i++)
+            {
+                if (intervals[i].cluster != c)
+                    continue;
+                double d = sample_distance(intervals[i].vector, centres[c]);
+                if (nearest < 0 || d < sample_distance(intervals[nearest].vector, centres[c]))
+                    nearest = i;
+                if (farthest < 0 || d > sample_distance(intervals[farthest].vector, centres[c]))
+                    farthest = i;
+                weight += intervals[i].instructions;
+                members++;
+            }
+            if (members == 0)
+                continue;
+            long long added = 0;
+            long long far_added = 0;
+            if (!sample_rerun(m, intervals, nearest, config, &added) ||
+                (farthest != nearest && !sample_rerun(m, intervals, farthest, config, &far_added)))
+            {
+                fprintf(stderr, "Out of memory\n");
+                ok = 0;
+                break;
+            }
+            if (farthest == nearest)
+                far_added = added;
+            reruns += 1 + (farthest != nearest);
+            rerun_instructions += intervals[nearest].instructions + (farthest != nearest ? intervals[farthest].instructions : 0);
+            double per_instruction = (double)added / intervals[nearest].instructions;
+            double far_per_instruction = (double)far_added / intervals[farthest].instructions;
+            estimate += per_instruction * weight;
+            bound += (far_per_instruction > per_instruction ? far_per_instruction - per_instruction
+                                                            : per_instruction - far_per_instruction) * weight;
+            fprintf(stderr, "  cluster %d: intervals=%d weight=%.1f%% representative=%d (%+.3f CPI) farthest=%d (%+.3f CPI)\n",
+                    c, members, 100.0 * weight / instructions, nearest, per_instruction, farthest, far_per_instruction);
+        }
+        double detailed_time = now_seconds() - start;
+        if (ok)
+        {
+            double estimated = cycles + estimate;
+            fprintf(stderr, "sample: interval=%lld intervals=%d clusters=%d warmup=%lld reruns=%d (%.1f%% of instructions)\n",
+                    config->interval, count, clusters, config->warmup, reruns, 100.0 * rerun_instructions / instructions);
+            fprintf(stderr, "sample: instructions=%lld cycles=%lld -> %.0f +- %.0f (%.2f%%) CPI=%.3f -> %.3f +- %.3f\n",
+                    instructions, cycles, estimated, bound, estimated > 0 ? 100.0 * bound / estimated : 0.0,
+                    (double)cycles / instructions, estimated / instructions, bound / instructions);
+            fprintf(stderr, "sample: functional time=%.3fs detailed time=%.3fs\n", functional_time, detailed_time);
+        }
+    }
+    else if (ok)
+    {
+        fprintf(stderr, "sample: no instructions executed\n");
+    }
+
+    if (final != NULL)
+        snapshot_restore(m, final);
+    snapshot_release(final);
+    for (int i = 0; i < count; i++)
+        snapshot_release(intervals[i].start);
+    free(intervals);
+    free(centres);
+    m->trace.level = level;
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Incremental re-simulation (--incremental)
+//
+// Keeps what a run of the program learnt in a state file so that the next
+// run of an edited version only simulates from the point where the edit
+// can first make a difference. The program runs in the functional engine,
+// which keeps the pipeline's exact time, and every INTERVAL instructions
+// the state is added to the file as a checkpoint. For every address the
+// file also holds the first interval that executed it, besides the program
+// image the run started from.
+//
+// An instruction only affects the run once it is fetched, and everything
+// fetched is executed within two cycles, squashed by a branch one or two
+// addresses before it, or fetched while the program drains. A squashed
+// word only matters through what fetching it does: an empty word neither
+// advances the PC nor lets the program go on, NOP_INSTR advances the PC
+// but ends the program too. So the first interval that executed a changed
+// address (or one of the two before it, if the edit changed what fetching
+// it does) bounds where an edit can show; the checkpoint at its start is
+// taken unless its IF or ID buffer already holds a word the edit changed,
+// in which case an earlier one is. Checkpoints are only kept while the
+// program has neither fetched an empty word (the drain) nor stored into
+// instruction memory, and a different entry point or initial data memory
+// means a run from the start.
+// ---------------------------------------------------------------------------
+#define INCREMENTAL_MAGIC "PSIN"
+#define INCREMENTAL_VERSION 1
+#define INCREMENTAL_INTERVAL 100000 // default instructions between checkpoints
+
+typedef struct
+{
+    char *data; // checkpoint_write format
+    size_t size;
+} IncrementalCheckpoint;
+
+typedef struct
+{
+    uint16_t entry_pc;
+    int8_t initial_data[DATA_MEMORY_SIZE];
+    uint16_t image[INSTRUCTION_MEMORY_SIZE];
+    int32_t first_interval[INSTRUCTION_MEMORY_SIZE]; // -1 if never executed
+    IncrementalCheckpoint *checkpoints;
+    int count;
+    int capacity;
+} IncrementalState;
+
+static void incremental_free(IncrementalState *state)
+{
+    for (int i = 0; i < state->count; i++)
+        free(state->checkpoints[i].data);
+    free(state->checkpoints);
+    state->checkpoints = NULL;
+    state->count = state->capacity = 0;
+}
+
+// Append the machine's state as a checkpoint; returns 0 if out of memory
+static int incremental_add(IncrementalState *state, Machine *m)
+{
+    if (state->count == state->capacity)
+    {
+        int capacity = state->capacity ? state->capacity * 2 : 16;
+        IncrementalCheckpoint *grown = realloc(state->checkpoints, capacity * sizeof(IncrementalCheckpoint));
+        if (grown == NULL)
+            return 0;
+        state->checkpoints = grown;
+        state->capacity = capacity;
+    }
+    IncrementalCheckpoint *checkpoint = &state->checkpoints[state->count];
+    FILE *stream = open_memstream(&checkpoint->data, &checkpoint->size);
+    if (stream == NULL)
+        return 0;
+    checkpoint_write(m, stream);
+    if (fclose(stream) != 0)
+        return 0;
+    state->count++;
+    return 1;
+}
+
+// Read the state file of an earlier run; returns 0 if there is none or it
+// is not valid
+static int incremental_read(IncrementalState *state, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return 0;
+    char magic[4];
+    int ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, INCREMENTAL_MAGIC, 4) == 0 &&
+             get_u16(file) == INCREMENTAL_VERSION && get_u32(file) == INSTRUCTION_MEMORY_SIZE &&
+             get_u32(file) == DATA_MEMORY_SIZE;
+    if (ok)
+    {
+        state->entry_pc = get_u16(file);
+        ok = fread(state->initial_data, 1, DATA_MEMORY_SIZE, file) == DATA_MEMORY_SIZE;
+        for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+            state->image[a] = get_u16(file);
+        for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+            state->first_interval[a] = (int32_t)get_u32(file);
+        uint32_t count = get_u32(file);
+        for (uint32_t i = 0; ok && i < count && !feof(file); i++)
+        {
+            uint32_t size = get_u32(file);
+            char *data = feof(file) ? NULL : malloc(size);
+            if (data == NULL || fread(data, 1, size, file) != size)
+            {
+                free(data);
+                ok = 0;
+                break;
+            }
+            if (state->count == state->capacity)
+            {
+                int capacity = state->capacity ? state->capacity * 2 : 16;
+                IncrementalCheckpoint *grown = realloc(state->checkpoints, capacity * sizeof(IncrementalCheckpoint));
+                if (grown == NULL)
+                {
+                    free(data);
+                    ok = 0;
+                    break;
+                }
+                state->checkpoints = grown;
+                state->capacity = capacity;
+            }
+            state->checkpoints[state->count].data = data;
+            state->checkpoints[state->count++].size = size;
+        }
+        ok = ok && !ferror(file) && !feof(file) && state->count == (int)count && count > 0;
+    }
+    fclose(file);
+    if (!ok)
+    {
+        fprintf(stderr, "Error: %s is not an incremental state file, running from the start\n", filename);
+        incremental_free(state);
+    }
+    return ok;
+}
+
+// Write the state file (through a temporary file, so an interrupted run
+// leaves the previous one); returns 0 on error
+static int incremental_write(const IncrementalState *state, const char *filename)
+{
+    size_t length = strlen(filename);
+    char *temporary = malloc(length + 5);
+    if (temporary == NULL)
+        return 0;
+    memcpy(temporary, filename, length);
+    memcpy(temporary + length, ".tmp", 5);
+    FILE *file = fopen(temporary, "wb");
+    if (!file)
+    {
+        perror("Error writing incremental state");
+        free(temporary);
+        return 0;
+    }
+    fwrite(INCREMENTAL_MAGIC, 1, 4, file);
+    put_u16(file, INCREMENTAL_VERSION);
+    put_u32(file, INSTRUCTION_MEMORY_SIZE);
+    put_u32(file, DATA_MEMORY_SIZE);
+    put_u16(file, state->entry_pc);
+    fwrite(state->initial_data, 1, DATA_MEMORY_SIZE, file);
+    for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+        put_u16(file, state->image[a]);
+    for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+        put_u32(file, (uint32_t)state->first_interval[a]);
+    put_u32(file, state->count);
+    for (int i = 0; i < state->count; i++)
+    {
+        put_u32(file, state->checkpoints[i].size);
+        fwrite(state->checkpoints[i].data, 1, state->checkpoints[i].size, file);
+    }
+    int ok = !ferror(file);
+    if (fclose(file) != 0)
+        ok = 0;
+    if (ok && rename(temporary, filename) != 0)
+        ok = 0;
+    if (!ok)
+    {
+        fprintf(stderr, "Error writing incremental state %s\n", filename);
+        remove(temporary);
+    }
+    free(temporary);
+    return ok;
+}
+
+// Put the machine in the state of a checkpoint, running the new program
+// image from there; returns 0 if the checkpoint is not valid for it (a
+// fetched word the edit changed, or past max_cycles)
+static int incremental_restore(Machine *m, const IncrementalCheckpoint *checkpoint, const IncrementalState *state,
+                               int code_end)
+{
+    FILE *stream = fmemopen(checkpoint->data, checkpoint->size, "rb");
+    if (stream == NULL)
+        return 0;
+    int ok = checkpoint_read(m, stream, "incremental state");
+    fclose(stream);
+    if (!ok)
+        return 0;
+    int ex = m->EX_buffer == &nop_decoded ? -1 : m->EX_buffer - m->decoded_program;
+    memcpy(m->instruction_memory, state->image, sizeof(m->instruction_memory));
+    m->code_end = code_end;
+    predecode_program(m);
+    m->EX_buffer = ex < 0 ? &nop_decoded : &m->decoded_program[ex];
+    return m->cycle <= m->max_cycles && (m->IF_buffer == NOP_INSTR || m->IF_buffer == state->image[m->IF_addr]) &&
+           (m->ID_buffer == NOP_INSTR || m->ID_buffer == state->image[m->ID_addr]);
+}
+
+// Run the loaded program (from reset), resuming from the state file of an
+// earlier run where the program changed little, and write the state file
+// for the next run; returns 0 on error
+int run_incremental(Machine *m, const char *filename, long long interval)
+{
+    IncrementalState *old = calloc(1, sizeof(IncrementalState));
+    IncrementalState *state = calloc(1, sizeof(IncrementalState));
+    m->executions = calloc(INSTRUCTION_MEMORY_SIZE, sizeof(uint32_t));
+    if (old == NULL || state == NULL || m->executions == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(old);
+        free(state);
+        free(m->executions);
+        m->executions = NULL;
+        return 0;
+    }
+    double start = now_seconds();
+    pipeline_start(m);
+    state->entry_pc = m->entry_pc;
+    memcpy(state->initial_data, m->initial_data, sizeof(state->initial_data));
+    memcpy(state->image, m->instruction_memory, sizeof(state->image));
+    for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+        state->first_interval[a] = -1;
+    int code_end = m->code_end;
+    Snapshot *reset = snapshot_take(m);
+
+    // Find the last checkpoint before the first change can be fetched
+    int resume = -1;
+    int changed = 0;
+    if (reset != NULL && incremental_read(old, filename) && old->entry_pc == state->entry_pc &&
+        memcmp(old->initial_data, state->initial_data, sizeof(state->initial_data)) == 0)
+    {
+        resume = old->count - 1;
+        for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+        {
+            if (old->image[a] == state->image[a])
+                continue;
+            changed++;
+            int fetch_changed = (old->image[a] == 0) != (state->image[a] == 0) ||
+                                (old->image[a] == NOP_INSTR) != (state->image[a] == NOP_INSTR);
+            for (int x = fetch_changed ? a - 2 : a; x <= a; x++)
+            {
+                if (x >= 0 && old->first_interval[x] >= 0 && old->first_interval[x] < resume)
+                    resume = old->first_interval[x];
+            }
+        }
+        while (resume >= 0 && !incremental_restore(m, &old->checkpoints[resume], state, code_end))
+            resume--;
+        if (resume < 0)
+            snapshot_restore(m, reset);
+        // The intervals before the one resumed from ran the same way
+        for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+        {
+            if (old->first_interval[a] >= 0 && old->first_interval[a] < resume)
+                state->first_interval[a] = old->first_interval[a];
+        }
+    }
+    long long resumed_at = m->cycle;
+
+    int ok = reset != NULL;
+    if (ok && resume >= 0)
+    {
+        // The checkpoints up to the one resumed from hold for the new
+        // program too
+        state->checkpoints = old->checkpoints;
+        state->capacity = old->capacity;
+        state->count = resume + 1;
+        for (int i = state->count; i < old->count; i++)
+            free(old->checkpoints[i].data);
+        old->checkpoints = NULL;
+        old->count = old->capacity = 0;
+    }
+    else if (ok)
+    {
+        ok = incremental_add(state, m);
+    }
+
+    int index = state->count - 1; // interval that starts at the last checkpoint
+    int recording = 1;
+    while (ok && m->remaining > 0 && m->cycle < m->max_cycles)
+    {
+        long long executed = functional_run(m, interval);
+        for (int a = 0; a < INSTRUCTION_MEMORY_SIZE; a++)
+        {
+            if (m->executions[a] != 0 && state->first_interval[a] < 0)
+                state->first_interval[a] = index;
+            m->executions[a] = 0;
+        }
+        if (executed == 0 || m->remaining <= 0 || m->cycle >= m->max_cycles)
+            break;
+        recording &= m->remaining == INT32_MAX && !((m->touched >> DIRTY_CODE_BIT) & 1);
+        if (recording)
+        {
+            ok = incremental_add(state, m);
+            index++;
+        }
+    }
+    if (!ok)
+        fprintf(stderr, "Out of memory\n");
+    double elapsed = now_seconds() - start;
+
+    if (ok)
+    {
+        fprintf(stderr, "incremental: changed=%d resumed at cycle %lld of %lld (checkpoint %d), simulated %lld cycles (%.1f%%) checkpoints=%d time=%.3fs\n",
+                changed, resumed_at, m->cycle, resume, m->cycle - resumed_at,
+                m->cycle ? 100.0 * (m->cycle - resumed_at) / m->cycle : 0.0, state->count, elapsed);
+        ok = incremental_write(state, filename);
+    }
+    free(m->executions);
+    m->executions = NULL;
+    snapshot_release(reset);
+    incremental_free(old);
+    incremental_free(state);
+    free(old);
+    free(state);
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Fuzzing (--fuzz)
+//
+// Generates random programs straight into instruction memory and runs each
+// in the pipeline model with the selected engine and, as the reference, in
+// the functional engine (one instruction at a time through the predecoded
+// handlers, with the switch interpreter for the cycles it leaves to the
+// pipeline). Both must end in the same complete state, cycle count
+// included. Case i of seed S is generated from seed S+i alone, so a
+// mismatch is reproduced with --fuzz=S+i:1, and its program is saved as an
+// image that the normal options (any engine, full trace) can run.
+//
+// The programs hold valid opcodes only, never the empty word. LDR and STR
+// use addresses 0 to 31 of data memory, and no instruction writes R63, so
+// BR R63, Rn jumps to one of the first 256 addresses (or past the end of
+// memory when Rn is negative). Between cases both machines are reset with
+// resetAll, which only clears what the previous case used.
+// ---------------------------------------------------------------------------
+#define FUZZ_LENGTH 32       // default maximum program length
+#define FUZZ_MAX_CYCLES 1000 // cycle limit unless --max-cycles is given
+#define FUZZ_REPORTED 10     // mismatches printed
+
+static uint64_t fuzz_next(uint64_t *state)
+{
+    // splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Fill words with the program of seed; returns its length (1 to length)
+static int fuzz_generate(uint64_t seed, int length, uint16_t *words)
+{
+    uint64_t state = seed;
+    int count = 1 + fuzz_next(&state) % length;
+    for (int i = 0; i < count; i++)
+    {
+        uint16_t word = 0;
+        while (word == 0)
+        {
+            uint64_t r = fuzz_next(&state);
+            int opcode = r % 12;
+            int r1 = (r >> 8) % (NUM_GPRS - 1);
+            int r2 = (r >> 16) % NUM_GPRS;
+            int imm = (r >> 24) & 63;
+            if (opcode == 7)
+                r1 = NUM_GPRS - 1;
+            if (opcode == 10 || opcode == 11)
+                imm &= 31;
+            int r_type = opcode == 0 || opcode == 1 || opcode == 2 || opcode == 6 || opcode == 7;
+            word = opcode << 12 | r1 << 6 | (r_type ? r2 : imm);
+        }
+        words[i] = word;
+    }
+    return count;
+}
+
+static void fuzz_load(Machine *m, const uint16_t *words, int count)
+{
+    resetAll(m);
+    for (int i = 0; i < count; i++)
+        load_instruction(m, i, words[i]);
+    predecode_program(m);
+    pipeline_start(m);
+}
+
+// Run count cases from seed; returns the number of mismatches, or -1 if
+// the machines could not be made
+long long run_fuzz(uint64_t seed, long long count, int length, ExecutionEngine engine, long long max_cycles)
+{
+    if (max_cycles == LLONG_MAX)
+        max_cycles = FUZZ_MAX_CYCLES;
+    Machine *m = machine_create(TRACE_NONE, engine, max_cycles, stdout);
+    Machine *ref = machine_create(TRACE_NONE, ENGINE_SWITCH, max_cycles, stdout);
+    uint16_t *words = malloc(length * sizeof(uint16_t));
+    if (m == NULL || ref == NULL || words == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        machine_destroy(m);
+        machine_destroy(ref);
+        free(words);
+        return -1;
+    }
+
+    long long mismatches = 0;
+    long long cycles = 0;
+    double start = now_seconds();
+    for (long long i = 0; i < count; i++)
+    {
+        int n = fuzz_generate(seed + i, length, words);
+        fuzz_load(m, words, n);
+        fuzz_load(ref, words, n);
+        pipeline_run(m, max_cycles);
+        functional_run(ref, LLONG_MAX);
+        cycles += m->cycle;
+        if (machine_state_equal(m, ref))
+            continue;
+        if (mismatches++ < FUZZ_REPORTED)
+        {
+            char image[64];
+            snprintf(image, sizeof(image), "fuzz-%llu.img", (unsigned long long)(seed + i));
+            fprintf(stderr, "Mismatch in case %lld (--fuzz=%llu:1): cycle %lld PC 0x%04X, reference cycle %lld PC 0x%04X; program saved as %s\n",
+                    i, (unsigned long long)(seed + i), m->cycle, m->PC, ref->cycle, ref->PC, image);
+            fuzz_load(ref, words, n);
+            image_save(ref, image);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    fprintf(stderr, "fuzz: cases=%lld mismatches=%lld cycles=%lld time=%.3fs cases/s=%.0f (%.1fM/hour)\n", count,
+            mismatches, cycles, elapsed, elapsed > 0 ? count / elapsed : 0.0,
+            elapsed > 0 ? count / elapsed * 3600 / 1e6 : 0.0);
+    machine_destroy(m);
+    machine_destroy(ref);
+    free(words);
+    return mismatches;
+}
+
+// ---------------------------------------------------------------------------
+// Batch runner
+//
+// Runs many program files on a pool of worker threads. Each worker owns one
+// machine that it resets between jobs, and a deque of job indices dealt out
+// round-robin. A worker takes jobs from the back of its own deque and, once
+// that is empty, steals from the front of the others, so a few long programs
+// do not leave the other cores idle. Each job's trace goes to its own memory
+// stream and is printed in command-line order after all jobs finished.
+// ---------------------------------------------------------------------------
+typedef struct
+{
+    const char *filename;
+    char *output; // trace text (open_memstream)
+    size_t output_size;
+    long long cycles;
+    int loaded; // 0 if the file could not be opened
+} BatchJob;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    int *jobs; // job indices, live between head and tail
+    int head;
+    int tail;
+} WorkDeque;
+
+typedef struct
+{
+    BatchJob *jobs;
+    WorkDeque *deques;
+    int workers;
+    int repeat;
+    TraceLevel level;
+    ExecutionEngine engine;
+    long long max_cycles;
+} BatchRun;
+
+typedef struct
+{
+    BatchRun *run;
+    int id;
+} BatchWorker;
+
+// Deal count job indices round-robin to the workers' deques, which share
+// the slots array
+void work_deques_init(WorkDeque *deques, int workers, int *slots, int count)
+{
+    int used = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        pthread_mutex_init(&deques[w].lock, NULL);
+        deques[w].jobs = slots + used;
+        for (int j = w; j < count; j += workers)
+            deques[w].jobs[deques[w].tail++] = j;
+        used += deques[w].tail;
+    }
+}
+
+// Next job for worker id: its own newest job first, then the oldest job of
+// another worker; -1 when every deque is empty
+int work_next_job(WorkDeque *deques, int workers, int id)
+{
+    for (int i = 0; i < workers; i++)
+    {
+        int victim = (id + i) % workers;
+        WorkDeque *deque = &deques[victim];
+        int job = -1;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head < deque->tail)
+            job = victim == id ? deque->jobs[--deque->tail] : deque->jobs[deque->head++];
+        pthread_mutex_unlock(&deque->lock);
+        if (job >= 0)
+            return job;
+    }
+    return -1;
+}
+
+void *batch_worker(void *arg)
+{
+    BatchWorker *worker = arg;
+    BatchRun *run = worker->run;
+    Machine *m = NULL;
+    int job_index;
+
+    while ((job_index = work_next_job(run->deques, run->workers, worker->id)) >= 0)
+    {
+        BatchJob *job = &run->jobs[job_index];
+        FILE *out = open_memstream(&job->output, &job->output_size);
+        if (out == NULL)
+            continue;
+        if (m == NULL)
+            m = machine_create(run->level, run->engine, run->max_cycles, out);
+        if (m == NULL)
+        {
+            fclose(out);
+            continue;
+        }
+        m->trace.out = out;
+        resetAll(m);
+        job->loaded = load_program_file(m, job->filename);
+        for (int r = 0; job->loaded && r < run->repeat; r++)
+        {
+            if (r > 0)
+                reset_state(m);
+            job->cycles += run_pipeline(m);
+        }
+        trace_flush(&m->trace);
+        fclose(out);
+    }
+    machine_destroy(m);
+    return NULL;
+}
+
+// Run every file with the given number of worker threads and print the
+// traces in order; returns 0 if every file could be loaded
+int run_batch(const char **filenames, int count, int workers, int repeat,
+              TraceLevel level, ExecutionEngine engine, long long max_cycles)
+{
+    if (workers > count)
+        workers = count;
+    BatchJob *jobs = calloc(count, sizeof(BatchJob));
+    WorkDeque *deques = calloc(workers, sizeof(WorkDeque));
+    BatchWorker *pool = calloc(workers, sizeof(BatchWorker));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    int *slots = malloc(count * sizeof(int));
+    if (!jobs || !deques || !pool || !threads || !slots)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(jobs);
+        free(deques);
+        free(pool);
+        free(threads);
+        free(slots);
+        return 1;
+    }
+
+    BatchRun run = {jobs, deques, workers, repeat, level, engine, max_cycles};
+    work_deques_init(deques, workers, slots, count);
+    for (int j = 0; j < count; j++)
+        jobs[j].filename = filenames[j];
+
+    double start = now_seconds();
+    int started = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        pool[w].run = &run;
+        pool[w].id = w;
+        if (w > 0 && pthread_create(&threads[w], NULL, batch_worker, &pool[w]) != 0)
+            break;
+        started++;
+    }
+    batch_worker(&pool[0]); // the main thread is worker 0
+    for (int w = 1; w < started; w++)
+        pthread_join(threads[w], NULL);
+    double elapsed = now_seconds() - start;
+
+    int status = 0;
+    long long total_cycles = 0;
+    for (int j = 0; j < count; j++)
+    {
+        if (level > TRACE_NONE)
+            printf("==> %s <==\n", jobs[j].filename);
+        if (jobs[j].output != NULL)
+            fwrite(jobs[j].output, 1, jobs[j].output_size, stdout);
+        if (!jobs[j].loaded)
+        {
+            fprintf(stderr, "%s: not run\n", jobs[j].filename);
+            status = 55;
+        }
+        total_cycles += jobs[j].cycles;
+        free(jobs[j].output);
+    }
+    fflush(stdout);
+    fprintf(stderr, "files=%d threads=%d cycles=%lld time=%.3fs cycles/s=%.0f\n",
+            count, started, total_cycles, elapsed, elapsed > 0 ? total_cycles / elapsed : 0.0);
+
+    for (int w = 0; w < workers; w++)
+        pthread_mutex_destroy(&deques[w].lock);
+    free(jobs);
+    free(deques);
+    free(pool);
+    free(threads);
+    free(slots);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Design-space sweep (--sweep)
+//
+// Runs one program at every point of a grid of configurations and collects
+// the cycle counts, the timing model results and the final state in one
+// CSV or JSON table. The grid file has one axis per line: a key and its
+// values, e.g.
+//
+//     predictor none 1bit 2bit:16
+//     dcache 16:4:1 64:8:2
+//     state R1=5 [3]=2
+//     state R1=7
+//
+// Every combination of the values is one point; a "state" line adds one
+// value (the rest of the line, as in --states) to the initial state axis.
+// The points are spread over worker threads with the batch runner's
+// work-stealing deques. Each point starts from a freshly loaded program, so
+// no point sees what another one's STR did to instruction memory.
+// ---------------------------------------------------------------------------
+enum
+{
+    SWEEP_PREDICTOR,
+    SWEEP_BTB,
+    SWEEP_DCACHE,
+    SWEEP_DCACHE_MISS,
+    SWEEP_PIPELINE,
+    SWEEP_MAX_CYCLES,
+    SWEEP_STATE,
+    SWEEP_AXES
+};
+
+const char *sweep_keys[SWEEP_AXES] = {"predictor", "btb", "dcache", "dcache-miss", "pipeline", "max-cycles", "state"};
+
+typedef struct
+{
+    char **values;
+    int count; // 0 when the grid does not vary it
+} SweepAxis;
+
+typedef struct
+{
+    int loaded;
+    long long cycles;
+    long long mispredicts; // the model results, when the point has the model
+    long long predicted_cycles;
+    long long dcache_misses;
+    long long dcache_cycles;
+    long long instructions;
+    long long pipeline_cycles;
+    int8_t GPR[NUM_GPRS];
+    int8_t data_memory[DATA_MEMORY_SIZE];
+} SweepPoint;
+
+typedef struct
+{
+    SweepAxis axes[SWEEP_AXES];
+    InitialState *states; // the parsed values of the state axis
+    const char *program;
+    size_t program_size;
+    const char *filename;
+    ExecutionEngine engine;
+    long long max_cycles;
+    SweepPoint *points;
+    int count;
+    WorkDeque *deques;
+    int workers;
+} SweepRun;
+
+typedef struct
+{
+    SweepRun *run;
+    int id;
+} SweepWorker;
+
+// Value index of every axis at a point; the first axis varies slowest
+static void sweep_choices(const SweepRun *run, int point, int choice[SWEEP_AXES])
+{
+    for (int a = SWEEP_AXES - 1; a >= 0; a--)
+    {
+        int count = run->axes[a].count ? run->axes[a].count : 1;
+        choice[a] = point % count;
+        point /= count;
+    }
+}
+
+// The axis value at a point, NULL if the grid does not vary the axis or the
+// value is "none"
+static const char *sweep_value(const SweepRun *run, const int choice[SWEEP_AXES], int axis)
+{
+    if (run->axes[axis].count == 0 || strcmp(run->axes[axis].values[choice[axis]], "none") == 0)
+        return NULL;
+    return run->axes[axis].values[choice[axis]];
+}
+
+// Run one point on the worker's machine; the grid was checked when it was
+// read, so creating the models only fails when memory runs out
+static void sweep_point(SweepRun *run, Machine *m, int index)
+{
+    SweepPoint *point = &run->points[index];
+    int choice[SWEEP_AXES];
+    sweep_choices(run, index, choice);
+    const char *predictor = sweep_value(run, choice, SWEEP_PREDICTOR);
+    const char *btb = sweep_value(run, choice, SWEEP_BTB);
+    const char *dcache = sweep_value(run, choice, SWEEP_DCACHE);
+    const char *miss = sweep_value(run, choice, SWEEP_DCACHE_MISS);
+    const char *pipeline = sweep_value(run, choice, SWEEP_PIPELINE);
+    const char *max_cycles = sweep_value(run, choice, SWEEP_MAX_CYCLES);
+
+    resetAll(m);
+    point->loaded = load_program(m, run->program, run->program_size, run->filename);
+    if (!point->loaded)
+        return;
+    if (sweep_value(run, choice, SWEEP_STATE) != NULL)
+        apply_state(m, &run->states[choice[SWEEP_STATE]]);
+    m->max_cycles = max_cycles ? strtoll(max_cycles, NULL, 10) : run->max_cycles;
+    if (predictor != NULL)
+        m->predictor = predictor_create(predictor, btb ? atoi(btb) : BTB_ENTRIES);
+    if (dcache != NULL && (m->dcache = dcache_create(dcache, miss ? atoi(miss) : DCACHE_MISS_LATENCY)) != NULL)
+        dcache_invalidate(m->dcache);
+    if (pipeline != NULL && (m->pipeline = pipeline_model_create(pipeline)) != NULL)
+        pipeline_model_start(m->pipeline);
+
+    point->cycles = run_pipeline(m);
+    memcpy(point->GPR, m->GPR, sizeof(point->GPR));
+    memcpy(point->data_memory, m->data_memory, sizeof(point->data_memory));
+    if (m->predictor != NULL)
+    {
+        point->mispredicts = m->predictor->mispredicts;
+        point->predicted_cycles = point->cycles - m->predictor->branch_cycles + m->predictor->predicted_cycles;
+    }
+    if (m->dcache != NULL)
+    {
+        point->dcache_misses = m->dcache->run.read_misses + m->dcache->run.write_misses;
+        point->dcache_cycles = point->cycles + m->dcache->run.stall_cycles;
+    }
+    if (m->pipeline != NULL)
+    {
+        point->instructions = m->pipeline->instructions;
+        point->pipeline_cycles = point->cycles + m->pipeline->total_stalls + (m->pipeline->stages == 5 ? 2 : 0);
+    }
+    predictor_free(m->predictor);
+    dcache_free(m->dcache);
+    pipeline_model_free(m->pipeline);
+    m->predictor = NULL;
+    m->dcache = NULL;
+    m->pipeline = NULL;
+}
+
+void *sweep_worker(void *arg)
+{
+    SweepWorker *worker = arg;
+    SweepRun *run = worker->run;
+    Machine *m = machine_create(TRACE_NONE, run->engine, run->max_cycles, stdout);
+    int index;
+    while (m != NULL && (index = work_next_job(run->deques, run->workers, worker->id)) >= 0)
+        sweep_point(run, m, index);
+    machine_destroy(m);
+    return NULL;
+}
+
+// Check one grid value by building what it describes; returns 0 if it is
+// not valid
+static int sweep_value_valid(int axis, char *value, InitialState *state, const int8_t *initial_data)
+{
+    char *end;
+    switch (axis)
+    {
+    case SWEEP_PREDICTOR:
+    {
+        BranchPredictor *bp = predictor_create(value, BTB_ENTRIES);
+        predictor_free(bp);
+        return bp != NULL;
+    }
+    case SWEEP_DCACHE:
+    {
+        DataCache *c = dcache_create(value, DCACHE_MISS_LATENCY);
+        dcache_free(c);
+        return c != NULL;
+    }
+    case SWEEP_PIPELINE:
+    {
+        PipelineModel *pm = pipeline_model_create(value);
+        pipeline_model_free(pm);
+        return pm != NULL;
+    }
+    case SWEEP_BTB:
+    {
+        long entries = strtol(value, &end, 10);
+        return *end == '\0' && entries >= 0 && (entries & (entries - 1)) == 0;
+    }
+    case SWEEP_DCACHE_MISS:
+    case SWEEP_MAX_CYCLES:
+        return strtoll(value, &end, 10) >= 0 && *end == '\0' && end != value;
+    default: // SWEEP_STATE; parse_state_line cuts the text up, so parse a copy
+    {
+        char *copy = strdup(value);
+        int ok = copy != NULL && parse_state_line(copy, state, initial_data);
+        free(copy);
+        return ok;
+    }
+    }
+}
+
+// Read the grid file into run->axes (and run->states); returns 0 on failure
+int sweep_read_grid(SweepRun *run, const char *filename, const int8_t *initial_data)
+{
+    char line[4096];
+    int number = 0;
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        perror("Error opening sweep grid");
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *key = line + strspn(line, " \t");
+        if (*key == '\0' || *key == '#')
+            continue;
+        char *rest = key + strcspn(key, " \t");
+        if (*rest != '\0')
+            *rest++ = '\0';
+        int axis = 0;
+        while (axis < SWEEP_AXES && strcmp(key, sweep_keys[axis]) != 0)
+            axis++;
+        if (axis == SWEEP_AXES)
+        {
+            fprintf(stderr, "%s:%d: unknown axis '%s'\n", filename, number, key);
+            fclose(file);
+            return 0;
+        }
+
+        // A state is the rest of the line, every other axis lists values
+        SweepAxis *a = &run->axes[axis];
+        char *save;
+        char *value = axis == SWEEP_STATE ? rest + strspn(rest, " \t") : strtok_r(rest, " \t", &save);
+        while (value != NULL)
+        {
+            a->values = realloc(a->values, (a->count + 1) * sizeof(char *));
+            if (axis == SWEEP_STATE)
+                run->states = realloc(run->states, (a->count + 1) * sizeof(InitialState));
+            a->values[a->count] = strdup(value);
+            if (strcmp(value, "none") != 0 &&
+                !sweep_value_valid(axis, value, run->states + a->count, initial_data))
+            {
+                fprintf(stderr, "%s:%d: not a valid %s: %s\n", filename, number, key, value);
+                a->count++;
+                fclose(file);
+                return 0;
+            }
+            a->count++;
+            value = axis == SWEEP_STATE ? NULL : strtok_r(NULL, " \t", &save);
+        }
+    }
+    fclose(file);
+
+    run->count = 1;
+    for (int a = 0; a < SWEEP_AXES; a++)
+    {
+        if (run->axes[a].count > 0 && run->count > INT_MAX / run->axes[a].count)
+        {
+            fprintf(stderr, "%s: too many points\n", filename);
+            return 0;
+        }
+        run->count *= run->axes[a].count ? run->axes[a].count : 1;
+    }
+    return 1;
+}
+
+// Write a CSV field, quoted when it has a comma or a quote in it
+static void csv_field(FILE *out, const char *text)
+{
+    if (strpbrk(text, ",\"") == NULL)
+    {
+        fputs(text, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *text; text++)
+    {
+        if (*text == '"')
+            fputc('"', out);
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+// One row per point: the axes the grid varies, the cycle counts, the model
+// results the grid asks for, every register and the nonzero data memory
+void sweep_write_csv(const SweepRun *run, FILE *out)
+{
+    fprintf(out, "point");
+    for (int a = 0; a < SWEEP_AXES; a++)
+    {
+        if (run->axes[a].count > 0)
+            fprintf(out, ",%s", sweep_keys[a]);
+    }
+    fprintf(out, ",status,cycles");
+    if (run->axes[SWEEP_PREDICTOR].count > 0)
+        fprintf(out, ",mispredicts,predicted_cycles");
+    if (run->axes[SWEEP_DCACHE].count > 0)
+        fprintf(out, ",dcache_misses,dcache_cycles");
+    if (run->axes[SWEEP_PIPELINE].count > 0)
+        fprintf(out, ",instructions,pipeline_cycles");
+    for (int r = 0; r < NUM_GPRS; r++)
+        fprintf(out, ",R%d", r);
+    fprintf(out, ",memory\n");
+
+    for (int i = 0; i < run->count; i++)
+    {
+        const SweepPoint *p = &run->points[i];
+        int choice[SWEEP_AXES];
+        sweep_choices(run, i, choice);
+        fprintf(out, "%d", i);
+        for (int a = 0; a < SWEEP_AXES; a++)
+        {
+            if (run->axes[a].count == 0)
+                continue;
+            fputc(',', out);
+            csv_field(out, run->axes[a].values[choice[a]]);
+        }
+        fprintf(out, ",%s,%lld", p->loaded ? "ok" : "error", p->cycles);
+        int has_predictor = sweep_value(run, choice, SWEEP_PREDICTOR) != NULL;
+        int has_dcache = sweep_value(run, choice, SWEEP_DCACHE) != NULL;
+        int has_pipeline = sweep_value(run, choice, SWEEP_PIPELINE) != NULL;
+        if (run->axes[SWEEP_PREDICTOR].count > 0)
+            fprintf(out, has_predictor ? ",%lld,%lld" : ",,", p->mispredicts, p->predicted_cycles);
+        if (run->axes[SWEEP_DCACHE].count > 0)
+            fprintf(out, has_dcache ? ",%lld,%lld" : ",,", p->dcache_misses, p->dcache_cycles);
+        if (run->axes[SWEEP_PIPELINE].count > 0)
+            fprintf(out, has_pipeline ? ",%lld,%lld" : ",,", p->instructions, p->pipeline_cycles);
+        for (int r = 0; r < NUM_GPRS; r++)
+            fprintf(out, ",%d", p->GPR[r]);
+        fputc(',', out);
+        const char *separator = "";
+        for (int a = 0; a < DATA_MEMORY_SIZE; a++)
+        {
+            if (p->data_memory[a] != 0)
+            {
+                fprintf(out, "%s[%d]=%d", separator, a, p->data_memory[a]);
+                separator = " ";
+            }
+        }
+        fputc('\n', out);
+    }
+}
+
+// The same table as a JSON array of objects
+void sweep_write_json(const SweepRun *run, FILE *out)
+{
+    fprintf(out, "[\n");
+    for (int i = 0; i < run->count; i++)
+    {
+        const SweepPoint *p = &run->points[i];
+        int choice[SWEEP_AXES];
+        sweep_choices(run, i, choice);
+        fprintf(out, "  {\"point\": %d", i);
+        for (int a = 0; a < SWEEP_AXES; a++)
+        {
+            if (run->axes[a].count == 0)
+                continue;
+            fprintf(out, ", \"%s\": \"", sweep_keys[a]);
+            for (const char *c = run->axes[a].values[choice[a]]; *c; c++)
+            {
+                if (*c == '"' || *c == '\\')
+                    fputc('\\', out);
+                fputc(*c, out);
+            }
+            fputc('"', out);
+        }
+        fprintf(out, ", \"status\": \"%s\", \"cycles\": %lld", p->loaded ? "ok" : "error", p->cycles);
+        if (sweep_value(run, choice, SWEEP_PREDICTOR) != NULL)
+            fprintf(out, ", \"mispredicts\": %lld, \"predicted_cycles\": %lld", p->mispredicts, p->predicted_cycles);
+        if (sweep_value(run, choice, SWEEP_DCACHE) != NULL)
+            fprintf(out, ", \"dcache_misses\": %lld, \"dcache_cycles\": %lld", p->dcache_misses, p->dcache_cycles);
+        if (sweep_value(run, choice, SWEEP_PIPELINE) != NULL)
+            fprintf(out, ", \"instructions\": %lld, \"pipeline_cycles\": %lld", p->instructions, p->pipeline_cycles);
+        fprintf(out, ", \"registers\": [");
+        for (int r = 0; r < NUM_GPRS; r++)
+            fprintf(out, "%s%d", r ? ", " : "", p->GPR[r]);
+        fprintf(out, "], \"memory\": {");
+        const char *separator = "";
+        for (int a = 0; a < DATA_MEMORY_SIZE; a++)
+        {
+            if (p->data_memory[a] != 0)
+            {
+                fprintf(out, "%s\"%d\": %d", separator, a, p->data_memory[a]);
+                separator = ", ";
+            }
+        }
+        fprintf(out, "}}%s\n", i + 1 < run->count ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
+
+// Run the program file at every point of the grid with the given number of
+// worker threads and write the table to output (stdout if NULL; JSON if
+// the name ends in .json, CSV otherwise); returns 0 on success
+int run_sweep(const char *filename, const char *grid, const char *output, int workers, ExecutionEngine engine,
+              long long max_cycles)
+{
+    SweepRun run = {0};
+    FileView view;
+    Machine *m = machine_create(TRACE_NONE, ENGINE_SWITCH, max_cycles, stdout);
+    if (m == NULL || !file_view_open(&view, filename))
+    {
+        machine_destroy(m);
+        return 55;
+    }
+    // Loading it once checks the program and gives the states its data
+    int status = 55;
+    if (load_program(m, view.data, view.size, filename) && sweep_read_grid(&run, grid, m->initial_data))
+    {
+        status = 1;
+        run.program = view.data;
+        run.program_size = view.size;
+        run.filename = filename;
+        run.engine = engine;
+        run.max_cycles = max_cycles;
+        run.workers = workers < run.count ? workers : run.count;
+        run.points = calloc(run.count, sizeof(SweepPoint));
+        run.deques = calloc(run.workers, sizeof(WorkDeque));
+        SweepWorker *pool = calloc(run.workers, sizeof(SweepWorker));
+        pthread_t *threads = calloc(run.workers, sizeof(pthread_t));
+        int *slots = malloc(run.count * sizeof(int));
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (!run.points || !run.deques || !pool || !threads || !slots)
+            fprintf(stderr, "Out of memory\n");
+        else if (out == NULL)
+            perror("Error opening sweep output");
+        else
+        {
+            work_deques_init(run.deques, run.workers, slots, run.count);
+            double start = now_seconds();
+            int started = 0;
+            for (int w = 0; w < run.workers; w++)
+            {
+                pool[w].run = &run;
+                pool[w].id = w;
+                if (w > 0 && pthread_create(&threads[w], NULL, sweep_worker, &pool[w]) != 0)
+                    break;
+                started++;
+            }
+            sweep_worker(&pool[0]); // the main thread is worker 0
+            for (int w = 1; w < started; w++)
+                pthread_join(threads[w], NULL);
+            double elapsed = now_seconds() - start;
+
+            size_t length = output ? strlen(output) : 0;
+            if (length >= 5 && strcmp(output + length - 5, ".json") == 0)
+                sweep_write_json(&run, out);
+            else
+                sweep_write_csv(&run, out);
+            long long total_cycles = 0;
+            for (int i = 0; i < run.count; i++)
+                total_cycles += run.points[i].cycles;
+            fprintf(stderr, "points=%d threads=%d cycles=%lld time=%.3fs points/s=%.0f\n", run.count, started,
+                    total_cycles, elapsed, elapsed > 0 ? run.count / elapsed : 0.0);
+            status = 0;
+            for (int w = 0; w < run.workers; w++)
+                pthread_mutex_destroy(&run.deques[w].lock);
+        }
+        if (out != NULL && out != stdout)
+            fclose(out);
+        free(pool);
+        free(threads);
+        free(slots);
+    }
+    for (int a = 0; a < SWEEP_AXES; a++)
+    {
+        for (int i = 0; i < run.axes[a].count; i++)
+            free(run.axes[a].values[i]);
+        free(run.axes[a].values);
+    }
+    free(run.states);
+    free(run.points);
+    free(run.deques);
+    file_view_close(&view);
+    machine_destroy(m);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Multicore mode (--cores)
+//
+// N cores, each a machine of its own (PC, registers, SREG, pipeline buffers
+// and instruction memory), share one data memory. The cores are spread
+// over host threads that run them QUANTUM cycles at a time and then meet at
+// a barrier. Until then each core works on its own copy of the shared
+// memory; at the barrier the bytes every core changed (found by comparing
+// its dirty pages with the memory at the start of the quantum) are merged
+// in core order, so the higher core wins when two cores store to the same
+// byte, and every core continues from the merged memory. The result only
+// depends on the quantum, never on the number of threads or how they are
+// scheduled; QUANTUM 1 makes every store visible to all cores from the
+// next cycle on, which is the single-threaded cycle-by-cycle interleaving
+// (--jobs=1). Negative STR addresses reach the core's own instruction
+// memory and are not shared.
+// ---------------------------------------------------------------------------
+#define MULTICORE_QUANTUM 100
+#define MULTICORE_ID_REGISTER (NUM_GPRS - 1) // holds the core number at reset
+
+typedef struct
+{
+    Machine **cores;
+    int count;
+    int threads;
+    long long quantum;
+    int *running; // per core: 0 once its program finished or hit --max-cycles
+    int all_done;
+    long long syncs;
+    pthread_barrier_t barrier;
+    int8_t shared[DATA_MEMORY_SIZE]; // memory at the start of the quantum
+    int8_t merged[DATA_MEMORY_SIZE];
+} MultiCore;
+
+typedef struct
+{
+    MultiCore *mc;
+    int id;
+} MultiCoreThread;
+
+// Merge what the cores stored during the quantum and hand the result to all
+// of them; runs on one thread while the others wait at the barrier
+static void multicore_sync(MultiCore *mc)
+{
+    uint64_t changed = 0;
+    memcpy(mc->merged, mc->shared, sizeof(mc->merged));
+    for (int c = 0; c < mc->count; c++)
+    {
+        Machine *m = mc->cores[c];
+        for (int p = 0; p < DATA_PAGES; p++)
+        {
+            if (!((m->dirty >> p) & 1))
+                continue;
+            for (int a = p * DATA_PAGE_SIZE; a < (p + 1) * DATA_PAGE_SIZE; a++)
+            {
+                if (m->data_memory[a] != mc->shared[a])
+                {
+                    mc->merged[a] = m->data_memory[a];
+                    changed |= 1ULL << p;
+                }
+            }
+        }
+        m->dirty = 0;
+    }
+    if (changed)
+    {
+        for (int c = 0; c < mc->count; c++)
+        {
+            Machine *m = mc->cores[c];
+            for (int p = 0; p < DATA_PAGES; p++)
+            {
+                if ((changed >> p) & 1)
+                    memcpy(m->data_memory + p * DATA_PAGE_SIZE, mc->merged + p * DATA_PAGE_SIZE, DATA_PAGE_SIZE);
+            }
+            m->touched |= changed;
+        }
+        memcpy(mc->shared, mc->merged, sizeof(mc->shared));
+    }
+    mc->syncs++;
+    mc->all_done = 1;
+    for (int c = 0; c < mc->count; c++)
+        mc->all_done &= !mc->running[c];
+}
+
+static void *multicore_thread(void *arg)
+{
+    MultiCoreThread *thread = arg;
+    MultiCore *mc = thread->mc;
+    for (;;)
+    {
+        for (int c = thread->id; c < mc->count; c += mc->threads)
+        {
+            Machine *m = mc->cores[c];
+            if (!mc->running[c])
+                continue;
+            long long until = m->max_cycles - m->cycle > mc->quantum ? m->cycle + mc->quantum : m->max_cycles;
+            mc->running[c] = pipeline_run(m, until) && m->cycle < m->max_cycles;
+        }
+        if (pthread_barrier_wait(&mc->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+            multicore_sync(mc);
+        pthread_barrier_wait(&mc->barrier);
+        if (mc->all_done)
+            return NULL;
+    }
+}
+
+// Run cores cores (core i runs program file i modulo count) sharing one data
+// memory on threads host threads, and print every core's output in order;
+// returns 55 if a program file could not be loaded
+int run_multicore(const char **filenames, int file_count, int cores, long long quantum, int threads,
+                  TraceLevel level, ExecutionEngine engine, long long max_cycles)
+{
+    MultiCore mc = {0};
+    mc.count = cores;
+    mc.threads = threads < cores ? threads : cores;
+    mc.quantum = quantum;
+    mc.cores = calloc(cores, sizeof(Machine *));
+    mc.running = calloc(cores, sizeof(int));
+    char **outputs = calloc(cores, sizeof(char *));
+    size_t *output_sizes = calloc(cores, sizeof(size_t));
+    FILE **streams = calloc(cores, sizeof(FILE *));
+    MultiCoreThread *pool = calloc(mc.threads, sizeof(MultiCoreThread));
+    pthread_t *handles = calloc(mc.threads, sizeof(pthread_t));
+    int status = 0;
+    if (!mc.cores || !mc.running || !outputs || !output_sizes || !streams || !pool || !handles)
+    {
+        fprintf(stderr, "Out of memory\n");
+        status = 1;
+    }
+
+    // The shared memory starts with the .data of every program, later
+    // cores on top of earlier ones
+    for (int c = 0; status == 0 && c < cores; c++)
+    {
+        streams[c] = open_memstream(&outputs[c], &output_sizes[c]);
+        Machine *m = streams[c] ? machine_create(level, engine, max_cycles, streams[c]) : NULL;
+        mc.cores[c] = m;
+        if (m == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            status = 1;
+        }
+        else if (!load_program_file(m, filenames[c % file_count]))
+            status = 55;
+        else
+        {
+            for (int a = 0; a < DATA_MEMORY_SIZE; a++)
+            {
+                if (m->initial_data[a] != 0)
+                    mc.shared[a] = m->initial_data[a];
+            }
+        }
+    }
+    if (status == 0)
+    {
+        for (int c = 0; c < cores; c++)
+        {
+            Machine *m = mc.cores[c];
+            memcpy(m->data_memory, mc.shared, sizeof(mc.shared));
+            m->touched |= DIRTY_ALL & ~(1ULL << DIRTY_CODE_BIT);
+            m->GPR[MULTICORE_ID_REGISTER] = c;
+            pipeline_start(m);
+            m->dirty = 0;
+            mc.running[c] = 1;
+        }
+
+        pthread_barrier_init(&mc.barrier, NULL, mc.threads);
+        double start = now_seconds();
+        int started = 1;
+        for (int t = 0; t < mc.threads; t++)
+        {
+            pool[t].mc = &mc;
+            pool[t].id = t;
+        }
+        for (int t = 1; t < mc.threads; t++)
+        {
+            if (pthread_create(&handles[t], NULL, multicore_thread, &pool[t]) != 0)
+            {
+                // Every thread has to reach the barrier, so run all cores
+                // with the threads there are
+                fprintf(stderr, "Could not start %d threads\n", mc.threads);
+                exit(1);
+            }
+            started++;
+        }
+        multicore_thread(&pool[0]); // the main thread is thread 0
+        for (int t = 1; t < started; t++)
+            pthread_join(handles[t], NULL);
+        double elapsed = now_seconds() - start;
+        pthread_barrier_destroy(&mc.barrier);
+
+        long long total_cycles = 0;
+        for (int c = 0; c < cores; c++)
+        {
+            pipeline_finish(mc.cores[c]);
+            trace_flush(&mc.cores[c]->trace);
+            total_cycles += mc.cores[c]->cycle;
+        }
+        for (int c = 0; c < cores; c++)
+        {
+            fflush(streams[c]);
+            if (level > TRACE_NONE)
+                printf("==> core %d <==\n", c);
+            fwrite(outputs[c], 1, output_sizes[c], stdout);
+        }
+        fflush(stdout);
+        fprintf(stderr, "cores=%d quantum=%lld threads=%d syncs=%lld cycles=%lld time=%.3fs cycles/s=%.0f\n", cores,
+                quantum, mc.threads, mc.syncs, total_cycles, elapsed, elapsed > 0 ? total_cycles / elapsed : 0.0);
+    }
+
+    for (int c = 0; c < cores; c++)
+    {
+        if (mc.cores != NULL)
+            machine_destroy(mc.cores[c]);
+        if (streams != NULL && streams[c] != NULL)
+            fclose(streams[c]);
+        if (outputs != NULL)
+            free(outputs[c]);
+    }
+    free(mc.cores);
+    free(mc.running);
+    free(outputs);
+    free(output_sizes);
+    free(streams);
+    free(pool);
+    free(handles);
+    return status;
+}
+
+// Append the non-empty lines of a list file ("-" for standard input) to the
+// file list; returns 0 on failure
+int read_file_list(const char *listname, const char ***files, int *count, int *capacity)
+{
+    char line[1024];
+    FILE *list = strcmp(listname, "-") == 0 ? stdin : fopen(listname, "r");
+    if (!list)
+    {
+        perror("Error opening file list");
+        return 0;
+    }
+    while (fgets(line, sizeof(line), list) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        if (*count == *capacity)
+        {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            *files = realloc(*files, *capacity * sizeof(char *));
+        }
+        (*files)[(*count)++] = strdup(line);
+    }
+    if (list != stdin)
+        fclose(list);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Server mode (--serve, --connect)
+//
+// A long-running process that runs programs sent over a Unix socket, so a
+// harness does not pay for a process (and a cold machine) per job. Worker
+// threads take turns accepting connections; each owns one machine that it
+// keeps warm across jobs and connections, reset like a batch worker's.
+//
+// A connection carries any number of jobs, one after the other. A request is
+// a 32-bit little-endian length and that many bytes of program (assembler
+// text or a program image). The reply is a 32-bit status, the 64-bit cycle
+// count, a 32-bit length and the program's output at the server's --trace
+// level. The status is 0, 55 if the program is not valid, SERVE_CYCLE_LIMIT
+// if it had not finished at --max-cycles (SERVE_MAX_CYCLES unless given) or
+// SERVE_OUTPUT_LIMIT if its output was cut at SERVE_MAX_OUTPUT bytes, so a
+// program that never halts cannot hold a worker or fill the server's memory.
+// The server runs each job --repeat times with its --engine.
+// ---------------------------------------------------------------------------
+#define SERVE_MAX_REQUEST (1 << 24)
+#define SERVE_BACKLOG 64
+#define SERVE_MAX_CYCLES 10000000  // cycle limit unless --max-cycles is given
+#define SERVE_MAX_OUTPUT (1 << 24) // output bytes a job may produce
+#define SERVE_SLICE 4096           // cycles run between output checks
+#define SERVE_CYCLE_LIMIT 56
+#define SERVE_OUTPUT_LIMIT 57
+
+typedef struct
+{
+    int listener;
+    int repeat;
+    TraceLevel level;
+    ExecutionEngine engine;
+    long long max_cycles;
+} ServeRun;
+
+// Read or write exactly size bytes; returns 0 on EOF or an error
+static int io_read_full(int fd, void *buffer, size_t size)
+{
+    uint8_t *p = buffer;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static int io_write_full(int fd, const void *buffer, size_t size)
+{
+    const uint8_t *p = buffer;
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void le_put(uint8_t *p, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t le_get(const uint8_t *p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)p[i] << (8 * i);
+    return value;
+}
+
+// Run the loaded program in slices of SERVE_SLICE cycles, stopping once its
+// output passes SERVE_MAX_OUTPUT; returns the job's status
+static int serve_run(Machine *m, FILE *out)
+{
+    pipeline_start(m);
+    int running = 1;
+    while (running && m->cycle < m->max_cycles)
+    {
+        long long until = m->max_cycles - m->cycle > SERVE_SLICE ? m->cycle + SERVE_SLICE : m->max_cycles;
+        running = pipeline_run(m, until);
+        if (ftell(out) + (long)m->trace.length > SERVE_MAX_OUTPUT)
+            return SERVE_OUTPUT_LIMIT;
+    }
+    pipeline_finish(m);
+    return running ? SERVE_CYCLE_LIMIT : 0;
+}
+
+// Answer the jobs of one connection with the worker's machine (created on
+// first use, kept warm afterwards)
+static void serve_connection(ServeRun *run, Machine **machine, int fd)
+{
+    char *program = NULL;
+    uint8_t header[4];
+    while (io_read_full(fd, header, sizeof(header)))
+    {
+        uint32_t size = (uint32_t)le_get(header, 4);
+        char *grown = size <= SERVE_MAX_REQUEST ? realloc(program, size ? size : 1) : NULL;
+        if (grown == NULL)
+            break;
+        program = grown;
+        if (!io_read_full(fd, program, size))
+            break;
+
+        char *output = NULL;
+        size_t output_size = 0;
+        FILE *out = open_memstream(&output, &output_size);
+        if (out == NULL)
+            break;
+        if (*machine == NULL)
+            *machine = machine_create(run->level, run->engine, run->max_cycles, out);
+        Machine *m = *machine;
+        long long cycles = 0;
+        int status = 55;
+        if (m != NULL)
+        {
+            m->trace.out = out;
+            resetAll(m);
+            TRACE(m, TRACE_SUMMARY, "\nFile Content:\n");
+            if (load_program(m, program, size, "request"))
+                status = 0;
+            for (int r = 0; status == 0 && r < run->repeat; r++)
+            {
+                if (r > 0)
+                    reset_state(m);
+                status = serve_run(m, out);
+                cycles += m->cycle;
+            }
+            trace_flush(&m->trace);
+            m->trace.out = NULL;
+        }
+        fclose(out);
+        if (output_size > SERVE_MAX_OUTPUT)
+            output_size = SERVE_MAX_OUTPUT;
+
+        uint8_t reply[16];
+        le_put(reply, status, 4);
+        le_put(reply + 4, (uint64_t)cycles, 8);
+        le_put(reply + 12, output_size, 4);
+        int sent = io_write_full(fd, reply, sizeof(reply)) && io_write_full(fd, output, output_size);
+        free(output);
+        if (!sent)
+            break;
+    }
+    free(program);
+    close(fd);
+}
+
+// Accept and answer connections until the listener fails (other than by
+// an interrupted call or a connection that was dropped before accept)
+static void *serve_worker(void *arg)
+{
+    ServeRun *run = arg;
+    Machine *m = NULL;
+    for (;;)
+    {
+        int fd = accept(run->listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Error accepting a connection");
+            break;
+        }
+        serve_connection(run, &m, fd);
+    }
+    machine_destroy(m);
+    return NULL;
+}
+
+// Listen on the socket path and serve jobs with the given number of worker
+// threads; only returns, with 1, if the socket cannot be set up or stops
+// accepting connections
+int run_server(const char *path, int workers, int repeat, TraceLevel level, ExecutionEngine engine,
+               long long max_cycles)
+{
+    if (max_cycles == LLONG_MAX)
+        max_cycles = SERVE_MAX_CYCLES;
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, SERVE_BACKLOG) != 0)
+    {
+        perror("Error setting up the server socket");
+        if (listener >= 0)
+            close(listener);
+        return 1;
+    }
+
+    ServeRun run = {listener, repeat, level, engine, max_cycles};
+    fprintf(stderr, "serving on %s with %d threads\n", path, workers);
+    for (int w = 1; w < workers; w++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_worker, &run) != 0)
+            break;
+        pthread_detach(thread);
+    }
+    serve_worker(&run); // the main thread is worker 0
+    close(listener);
+    return 1;
+}
+
+// Send every file to the server at path and print the replies like the
+// batch runner; returns 55 if a file could not be read or run
+int run_client(const char *path, const char **filenames, int count)
+{
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        perror("Error connecting to the server");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    int status = 0;
+    long long total_cycles = 0;
+    double start = now_seconds();
+    for (int i = 0; i < count; i++)
+    {
+        FileView view;
+        if (!file_view_open(&view, filenames[i]))
+        {
+            fprintf(stderr, "%s: not run\n", filenames[i]);
+            status = 55;
+            continue;
+        }
+        uint8_t header[4];
+        uint8_t reply[16];
+        le_put(header, view.size, 4);
+        int sent = io_write_full(fd, header, sizeof(header)) && io_write_full(fd, view.data, view.size);
+        file_view_close(&view);
+        if (!sent || !io_read_full(fd, reply, sizeof(reply)))
+        {
+            fprintf(stderr, "Connection to the server lost\n");
+            status = 1;
+            break;
+        }
+        size_t length = le_get(reply + 12, 4);
+        char *output = malloc(length ? length : 1);
+        if (output == NULL || !io_read_full(fd, output, length))
+        {
+            fprintf(stderr, "Connection to the server lost\n");
+            free(output);
+            status = 1;
+            break;
+        }
+        if (count > 1)
+            printf("==> %s <==\n", filenames[i]);
+        fwrite(output, 1, length, stdout);
+        free(output);
+        uint32_t job_status = (uint32_t)le_get(reply, 4);
+        if (job_status == SERVE_CYCLE_LIMIT)
+            fprintf(stderr, "%s: not finished at the server's --max-cycles\n", filenames[i]);
+        else if (job_status == SERVE_OUTPUT_LIMIT)
+            fprintf(stderr, "%s: output cut at %d bytes\n", filenames[i], SERVE_MAX_OUTPUT);
+        else if (job_status != 0)
+            fprintf(stderr, "%s: not run\n", filenames[i]);
+        if (job_status != 0)
+            status = 55;
+        total_cycles += (long long)le_get(reply + 4, 8);
+    }
+    close(fd);
+    fflush(stdout);
+    double elapsed = now_seconds() - start;
+    fprintf(stderr, "files=%d cycles=%lld time=%.3fs cycles/s=%.0f\n", count, total_cycles, elapsed,
+            elapsed > 0 ? total_cycles / elapsed : 0.0);
+    return status;
+}
 
-    // Print the extracted components
-    // printf("Opcode: %s\n", opcode);
-    // printf("Register: %s\n", reg);
-    // printf("Immediate/operand: %s\n", imm);
-    hex = parseOpcode(opcode) |
-          parseRegister(reg) |
-          parseImmediate(imm);
-    // printf("Hexadecimal: 0x%04X\n", hex);
-    return hex;
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--trace=none|summary|cycle|full] [--engine=switch|threaded|jit|memo] [--repeat=N] [--max-cycles=N] [--jobs=N] [--list=FILE] [--states=FILE [--lockstep]] [--checkpoint=CYCLE:FILE] [--restore=FILE] [--snapshot-every=N] [--assemble-only] [--emit-image=FILE] [--profile=FILE] [--fast-forward=N[:W] [--check-switches]] [--sample=INTERVAL[:K[:WARMUP]]] [--incremental=FILE [--incremental-every=N]] [--record=FILE] [--replay=FILE] [--predictor=SCHEME[:ENTRIES]] [--btb=N] [--dcache=SIZE:LINE:WAYS[:lru|random][:wb|wt]] [--dcache-miss=N] [--pipeline=3|5[:noforward]] [--serve=SOCKET] [--connect=SOCKET] [--sweep=GRID [--sweep-out=FILE]] [--cores=N[:QUANTUM]] [--fuzz=SEED[:COUNT] [--fuzz-length=N]] [--break=ADDR] [--break-if=Rn<op>VALUE] [--watch=ADDR] [file...]\n", program);
 }
-int main()
+
+int main(int argc, char *argv[])
 {
-    // to compile use: gcc -o main main.c
-    resetAll();
+    // to compile use: gcc -O2 -pthread -o main main.c
 
     // Program:
     // MOVI R1, 5     => R1 = 5
@@ -624,30 +7581,712 @@ int main()
     // SAL R4, 1      => R4 = R4 << 1 = 14
     // SAR R4, 1      => R4 = R4 >> 1 = 7
 
-    // instuction counter
-    int counter = 0;
-    char filename[100];
-    char line[256];
-    skipped = 0; // Reset skipped flag
-    printf("Enter the file name: ");
-    scanf("%99s", filename);
+    char filename[FILENAME_MAX] = {0};
+    int repeat = 1;
+    int jobs = 0;
+    TraceLevel trace_level = TRACE_FULL;
+    ExecutionEngine engine = ENGINE_SWITCH;
+    long long max_cycles = LLONG_MAX;
+    const char **files = NULL;
+    int file_count = 0;
+    int file_capacity = 0;
+    const char *states_file = NULL;
+    int lockstep = 0;
+    long long checkpoint_cycle = 0;
+    const char *checkpoint_file = NULL;
+    const char *restore_file = NULL;
+    long long snapshot_every = 0;
+    int assemble_only = 0;
+    const char *image_file = NULL;
+    const char *profile_file = NULL;
+    long long forward = 0;
+    long long window = 0;
+    int check_switches = 0;
+    const char *record_file = NULL;
+    const char *replay_file = NULL;
+    const char *predictor_spec = NULL;
+    int btb_entries = BTB_ENTRIES;
+    const char *dcache_spec = NULL;
+    int dcache_miss = DCACHE_MISS_LATENCY;
+    const char *pipeline_spec = NULL;
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    const char *sweep_grid = NULL;
+    const char *sweep_output = NULL;
+    int cores = 0;
+    long long quantum = MULTICORE_QUANTUM;
+    long long sample_interval = 0;
+    int sample_clusters = SAMPLE_CLUSTERS;
+    long long sample_warmup = -1; // default: the whole previous interval
+    const char *incremental_file = NULL;
+    long long incremental_every = INCREMENTAL_INTERVAL;
+    long long fuzz_count = 0;
+    unsigned long long fuzz_seed = 0;
+    int fuzz_length = FUZZ_LENGTH;
+    Debugger *debugger = NULL;
 
-    FILE *file = fopen(filename, "r");
-    if (!file)
+    for (int i = 1; i < argc; i++)
     {
-        perror("Error opening file");
+        if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            int level = parse_trace_level(argv[i] + 8);
+            if (level < 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+            trace_level = level;
+        }
+        else if (strncmp(argv[i], "--engine=", 9) == 0)
+        {
+            int selected = parse_engine(argv[i] + 9);
+            if (selected < 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+            engine = selected;
+        }
+        else if (strncmp(argv[i], "--max-cycles=", 13) == 0)
+        {
+            max_cycles = atoll(argv[i] + 13);
+        }
+        else if (strncmp(argv[i], "--repeat=", 9) == 0)
+        {
+            repeat = atoi(argv[i] + 9);
+            if (repeat < 1)
+                repeat = 1;
+        }
+        else if (strncmp(argv[i], "--jobs=", 7) == 0)
+        {
+            jobs = atoi(argv[i] + 7);
+        }
+        else if (strncmp(argv[i], "--list=", 7) == 0)
+        {
+            if (!read_file_list(argv[i] + 7, &files, &file_count, &file_capacity))
+                return 55;
+        }
+        else if (strncmp(argv[i], "--states=", 9) == 0)
+        {
+            states_file = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--lockstep") == 0)
+        {
+            lockstep = 1;
+        }
+        else if (strncmp(argv[i], "--checkpoint=", 13) == 0)
+        {
+            char *colon;
+            checkpoint_cycle = strtoll(argv[i] + 13, &colon, 10);
+            if (*colon != ':' || colon[1] == '\0' || checkpoint_cycle <= 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+            checkpoint_file = colon + 1;
+        }
+        else if (strncmp(argv[i], "--restore=", 10) == 0)
+        {
+            restore_file = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--snapshot-every=", 17) == 0)
+        {
+            snapshot_every = atoll(argv[i] + 17);
+        }
+        else if (strncmp(argv[i], "--incremental=", 14) == 0)
+        {
+            incremental_file = argv[i] + 14;
+        }
+        else if (strncmp(argv[i], "--incremental-every=", 20) == 0)
+        {
+            incremental_every = atoll(argv[i] + 20);
+            if (incremental_every <= 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--assemble-only") == 0)
+        {
+            assemble_only = 1;
+        }
+        else if (strncmp(argv[i], "--emit-image=", 13) == 0)
+        {
+            image_file = argv[i] + 13;
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0)
+        {
+            profile_file = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--fast-forward=", 15) == 0)
+        {
+            char *colon;
+            forward = strtoll(argv[i] + 15, &colon, 10);
+            if (*colon == ':')
+                window = strtoll(colon + 1, &colon, 10);
+            if (*colon != '\0' || forward <= 0 || window < 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--sample=", 9) == 0)
+        {
+            char *colon;
+            sample_interval = strtoll(argv[i] + 9, &colon, 10);
+            if (*colon == ':')
+                sample_clusters = strtol(colon + 1, &colon, 10);
+            if (*colon == ':')
+                sample_warmup = strtoll(colon + 1, &colon, 10);
+            if (*colon != '\0' || sample_interval <= 0 || sample_interval > INT32_MAX || sample_clusters <= 0 ||
+                sample_warmup < -1)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--check-switches") == 0)
+        {
+            check_switches = 1;
+        }
+        else if (strncmp(argv[i], "--record=", 9) == 0)
+        {
+            record_file = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--replay=", 9) == 0)
+        {
+            replay_file = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--predictor=", 12) == 0)
+        {
+            predictor_spec = argv[i] + 12;
+        }
+        else if (strncmp(argv[i], "--btb=", 6) == 0)
+        {
+            btb_entries = atoi(argv[i] + 6);
+        }
+        else if (strncmp(argv[i], "--dcache=", 9) == 0)
+        {
+            dcache_spec = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--dcache-miss=", 14) == 0)
+        {
+            dcache_miss = atoi(argv[i] + 14);
+        }
+        else if (strncmp(argv[i], "--pipeline=", 11) == 0)
+        {
+            pipeline_spec = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--serve=", 8) == 0)
+        {
+            serve_path = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--connect=", 10) == 0)
+        {
+            connect_path = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--sweep=", 8) == 0)
+        {
+            sweep_grid = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--sweep-out=", 12) == 0)
+        {
+            sweep_output = argv[i] + 12;
+        }
+        else if (strncmp(argv[i], "--fuzz=", 7) == 0)
+        {
+            char *colon;
+            fuzz_seed = strtoull(argv[i] + 7, &colon, 10);
+            fuzz_count = 100000;
+            if (*colon == ':')
+                fuzz_count = strtoll(colon + 1, &colon, 10);
+            if (*colon != '\0' || colon == argv[i] + 7 || fuzz_count <= 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--fuzz-length=", 14) == 0)
+        {
+            fuzz_length = atoi(argv[i] + 14);
+            if (fuzz_length <= 0 || fuzz_length > INSTRUCTION_MEMORY_SIZE)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--break=", 8) == 0 || strncmp(argv[i], "--break-if=", 11) == 0 ||
+                 strncmp(argv[i], "--watch=", 8) == 0)
+        {
+            int kind = argv[i][2] == 'w' ? DEBUG_WATCHPOINT : argv[i][7] == '-' ? DEBUG_CONDITION : DEBUG_BREAKPOINT;
+            if ((debugger == NULL && (debugger = debugger_create()) == NULL) ||
+                !debugger_add(debugger, kind, strchr(argv[i], '=') + 1))
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--cores=", 8) == 0)
+        {
+            char *colon;
+            cores = strtol(argv[i] + 8, &colon, 10);
+            if (*colon == ':')
+                quantum = strtoll(colon + 1, &colon, 10);
+            if (*colon != '\0' || cores <= 0 || quantum <= 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (argv[i][0] == '-')
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            if (file_count == file_capacity)
+            {
+                file_capacity = file_capacity ? file_capacity * 2 : 64;
+                files = realloc(files, file_capacity * sizeof(char *));
+            }
+            files[file_count++] = strdup(argv[i]);
+        }
+    }
+
+    if ((lockstep && states_file == NULL) || (restore_file != NULL && (file_count > 0 || states_file != NULL)) ||
+        ((assemble_only || image_file != NULL) && (restore_file != NULL || file_count > 1 || jobs > 0)) ||
+        (check_switches && forward == 0) ||
+        (debugger != NULL && (states_file != NULL || forward > 0 || sample_interval > 0 || incremental_file != NULL)) ||
+        (replay_file != NULL && (file_count > 0 || jobs > 0 || states_file != NULL || restore_file != NULL ||
+                                 record_file != NULL || checkpoint_file != NULL || snapshot_every > 0 ||
+                                 assemble_only || image_file != NULL || profile_file != NULL || forward > 0 || sample_interval > 0 ||
+                                 incremental_file != NULL || debugger != NULL ||
+                                 predictor_spec != NULL || dcache_spec != NULL || pipeline_spec != NULL)))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // --serve, --connect, --sweep, --cores and --fuzz run whole programs,
+    // like the batch runner
+    if (serve_path != NULL || connect_path != NULL || sweep_grid != NULL || sweep_output != NULL || cores > 0 ||
+        fuzz_count > 0)
+    {
+        if ((serve_path != NULL && (connect_path != NULL || sweep_grid != NULL || cores > 0 || file_count > 0)) ||
+            (connect_path != NULL && (sweep_grid != NULL || cores > 0 || file_count == 0)) ||
+            (sweep_grid != NULL && (cores > 0 || file_count != 1)) || (sweep_output != NULL && sweep_grid == NULL) ||
+            (cores > 0 && file_count == 0) ||
+            (fuzz_count > 0 && (serve_path != NULL || connect_path != NULL || sweep_grid != NULL || cores > 0 ||
+                                file_count > 0)) ||
+            states_file != NULL || restore_file != NULL ||
+            replay_file != NULL || checkpoint_file != NULL || snapshot_every > 0 || assemble_only ||
+            image_file != NULL || profile_file != NULL || forward > 0 || sample_interval > 0 || incremental_file != NULL ||
+            record_file != NULL || debugger != NULL ||
+            predictor_spec != NULL || dcache_spec != NULL || pipeline_spec != NULL)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (jobs <= 0)
+            jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs <= 0)
+            jobs = 1;
+        int status;
+        if (fuzz_count > 0)
+            status = run_fuzz(fuzz_seed, fuzz_count, fuzz_length, engine, max_cycles) == 0 ? 0 : 1;
+        else if (serve_path != NULL)
+            status = run_server(serve_path, jobs, repeat, trace_level, engine, max_cycles);
+        else if (connect_path != NULL)
+            status = run_client(connect_path, files, file_count);
+        else if (cores > 0)
+            status = run_multicore(files, file_count, cores, quantum, jobs, trace_level, engine, max_cycles);
+        else
+            status = run_sweep(files[0], sweep_grid, sweep_output, jobs, engine, max_cycles);
+        for (int i = 0; i < file_count; i++)
+            free((char *)files[i]);
+        free(files);
+        return status;
+    }
+
+    // --replay prints a recorded run without simulating it
+    if (replay_file != NULL)
+    {
+        Machine *m = machine_create(trace_level, ENGINE_SWITCH, max_cycles, stdout);
+        if (m == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        long long cycles = replay_trace(m, replay_file);
+        machine_destroy(m);
+        return cycles < 0 ? 55 : 0;
+    }
+
+    // Several files (or --jobs) go through the batch runner
+    if (file_count > 1 || jobs > 0)
+    {
+        if (states_file != NULL || checkpoint_file != NULL || snapshot_every > 0 || profile_file != NULL || forward > 0 ||
+            sample_interval > 0 || incremental_file != NULL || record_file != NULL || predictor_spec != NULL ||
+            dcache_spec != NULL || pipeline_spec != NULL || debugger != NULL)
+        {
+            fprintf(stderr, "--states, --checkpoint, --snapshot-every, --profile, --fast-forward, --sample, --incremental, --record, the timing models and the debugger run a single program file\n");
+            return 1;
+        }
+        if (jobs <= 0)
+            jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs <= 0)
+            jobs = 1;
+        int status = file_count > 0 ? run_batch(files, file_count, jobs, repeat, trace_level, engine, max_cycles) : 0;
+        for (int i = 0; i < file_count; i++)
+            free((char *)files[i]);
+        free(files);
+        return status;
+    }
+
+    if (file_count == 1)
+    {
+        // A longer name could not be opened anyway; say so instead of
+        // opening a cut-off one
+        int length = snprintf(filename, sizeof(filename), "%s", files[0]);
+        free((char *)files[0]);
+        if (length >= (int)sizeof(filename))
+        {
+            fprintf(stderr, "Error: file name longer than %d characters\n", FILENAME_MAX - 1);
+            free(files);
+            return 55;
+        }
+    }
+    free(files);
+    if (filename[0] == '\0' && restore_file == NULL)
+    {
+        printf("Enter the file name: ");
+        scanf("%99s", filename);
+    }
+
+    if (forward > 0 && (states_file != NULL || restore_file != NULL || checkpoint_file != NULL || snapshot_every > 0))
+    {
+        fprintf(stderr, "--fast-forward cannot be combined with --states, --restore, --checkpoint or --snapshot-every\n");
+        return 1;
+    }
+    if (record_file != NULL && (states_file != NULL || forward > 0))
+    {
+        fprintf(stderr, "--record cannot be combined with --states or --fast-forward\n");
+        return 1;
+    }
+    if ((predictor_spec != NULL || dcache_spec != NULL || pipeline_spec != NULL) && forward > 0)
+    {
+        fprintf(stderr, "--predictor, --dcache and --pipeline cannot be combined with --fast-forward\n");
+        return 1;
+    }
+    if (sample_interval > 0 && (states_file != NULL || restore_file != NULL || checkpoint_file != NULL ||
+                                snapshot_every > 0 || forward > 0 || record_file != NULL || profile_file != NULL ||
+                                repeat > 1))
+    {
+        fprintf(stderr, "--sample cannot be combined with --states, --restore, --checkpoint, --snapshot-every, --fast-forward, --record, --profile or --repeat\n");
+        return 1;
+    }
+    if (incremental_file != NULL &&
+        (trace_level > TRACE_SUMMARY || states_file != NULL || restore_file != NULL || checkpoint_file != NULL ||
+         snapshot_every > 0 || forward > 0 || sample_interval > 0 || record_file != NULL || profile_file != NULL ||
+         predictor_spec != NULL || dcache_spec != NULL || pipeline_spec != NULL || repeat > 1))
+    {
+        fprintf(stderr, "--incremental only prints the final state (--trace=none or summary) and cannot be combined with --states, --restore, --checkpoint, --snapshot-every, --fast-forward, --sample, --record, --profile, the timing models or --repeat\n");
+        return 1;
+    }
+    if (profile_file != NULL && !PROFILE_COUNTERS)
+    {
+        fprintf(stderr, "--profile needs a build with PROFILE_COUNTERS\n");
+        return 1;
+    }
+    Machine *m = machine_create(trace_level, engine, max_cycles, stdout);
+    if (m != NULL && profile_file != NULL && (m->profile = calloc(1, sizeof(Profile))) == NULL)
+    {
+        machine_destroy(m);
+        m = NULL;
+    }
+    if (m == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    m->debugger = debugger;
+    // The predictor's tables stay warm across --repeat runs and --states
+    // instances
+    if ((predictor_spec != NULL && (m->predictor = predictor_create(predictor_spec, btb_entries)) == NULL) ||
+        (dcache_spec != NULL && (m->dcache = dcache_create(dcache_spec, dcache_miss)) == NULL) ||
+        (pipeline_spec != NULL && (m->pipeline = pipeline_model_create(pipeline_spec)) == NULL))
+    {
+        machine_destroy(m);
+        print_usage(argv[0]);
+        return 1;
+    }
+    // --restore continues every run from the checkpoint instead of
+    // starting the program from reset
+    Snapshot *restored = NULL;
+    if (restore_file != NULL)
+    {
+        if (!checkpoint_load(m, restore_file) || (restored = snapshot_take(m)) == NULL)
+        {
+            machine_destroy(m);
+            return 55;
+        }
+    }
+    else if (assemble_only)
+    {
+        // Assembler throughput: assemble the file --repeat times
+        long long total_lines = 0;
+        int lines = 0;
+        int count = 0;
+        double start = now_seconds();
+        for (int run = 0; run < repeat && count >= 0; run++)
+        {
+            count = assemble_file(m, filename, &lines);
+            total_lines += lines;
+        }
+        double elapsed = now_seconds() - start;
+        machine_destroy(m);
+        if (count < 0)
+            return 55;
+        fprintf(stderr, "instructions=%d lines=%lld time=%.3fs lines/s=%.0f\n",
+                count, total_lines, elapsed, elapsed > 0 ? total_lines / elapsed : 0.0);
+        return 0;
+    }
+    else if (!load_program_file(m, filename))
+    {
+        machine_destroy(m);
         return 55;
     }
+    if (image_file != NULL)
+    {
+        // Assemble once, run the image from then on
+        int ok = image_save(m, image_file);
+        machine_destroy(m);
+        return ok ? 0 : 1;
+    }
 
-    printf("\nFile Content:\n");
-    while (fgets(line, sizeof(line), file) != NULL)
+    // --sample gives every interval it reruns fresh timing models; the ones
+    // made above only checked the options
+    if (sample_interval > 0)
     {
-        load_instruction(counter++, parsefn(line));
+        SampleConfig sample = {sample_interval, sample_clusters, sample_warmup < 0 ? sample_interval : sample_warmup,
+                               predictor_spec, btb_entries, dcache_spec, dcache_miss, pipeline_spec};
+        sample_models_free(m);
+        int ok = run_sampled(m, &sample);
+        pipeline_finish(m);
+        machine_destroy(m);
+        return ok ? 0 : 1;
     }
-    fclose(file);
-    printf("\n"); // for clean output after last line
+    if (incremental_file != NULL)
+    {
+        int ok = run_incremental(m, incremental_file, incremental_every);
+        pipeline_finish(m);
+        machine_destroy(m);
+        return ok ? 0 : 1;
+    }
+
+    if (states_file != NULL)
+    {
+        InitialState *states;
+        int count = load_states_file(m, states_file, &states);
+        if (count < 0)
+        {
+            machine_destroy(m);
+            return 55;
+        }
+        if (lockstep && (m->trace.level >= TRACE_CYCLE || m->profile != NULL || m->predictor != NULL || m->dcache != NULL ||
+                         m->pipeline != NULL))
+        {
+            fprintf(stderr, "Per-cycle traces, profiles and timing models are per instance, running the states one at a time\n");
+            lockstep = 0;
+        }
+        if (lockstep && !lockstep_supported(m))
+        {
+            fprintf(stderr, "LDR/STR with a negative address cannot run in lockstep, running the states one at a time\n");
+            lockstep = 0;
+        }
+        long long total_cycles = 0;
+        double start = now_seconds();
+        for (int run = 0; run < repeat; run++)
+            total_cycles += run_states(m, states, count, lockstep);
+        double elapsed = now_seconds() - start;
+        fprintf(stderr, "instances=%d cycles=%lld time=%.3fs cycles/s=%.0f\n",
+                count * repeat, total_cycles, elapsed, elapsed > 0 ? total_cycles / elapsed : 0.0);
+        free(states);
+        if (m->predictor != NULL)
+            predictor_report(m->predictor, total_cycles);
+        if (m->dcache != NULL && count * repeat > 1)
+            dcache_print(&m->dcache->total, "total", total_cycles);
+        if (m->pipeline != NULL)
+            pipeline_model_report(m->pipeline, m, total_cycles);
+        if (m->memo != NULL)
+            memo_report(m->memo, total_cycles);
+        int ok = profile_file == NULL || profile_write(m, profile_file);
+        machine_destroy(m);
+        return ok ? 0 : 1;
+    }
+
+    // --check-switches runs a second machine in the pipeline model only
+    Machine *ref = NULL;
+    FastForwardStats ff_stats = {0};
+    if (check_switches)
+    {
+        ref = machine_create(TRACE_NONE, ENGINE_THREADED, max_cycles, stdout);
+        if (ref == NULL || !load_program_file(ref, filename))
+        {
+            machine_destroy(ref);
+            machine_destroy(m);
+            return 55;
+        }
+    }
+
+    // With --repeat the same program is run several times from a clean
+    // register/data state and the simulation speed is reported on stderr
+    long long total_cycles = 0;
+    int record_ok = 1;
+    int checkpoint_written = 0;
+    Snapshot **snapshots = NULL;
+    int snapshot_count = 0;
+    double snapshot_time = 0;
+    double start = now_seconds();
+    for (int run = 0; run < repeat; run++)
+    {
+        if (restored != NULL)
+        {
+            if (run > 0)
+                snapshot_restore(m, restored);
+        }
+        else
+        {
+            if (run > 0)
+                reset_state(m);
+            pipeline_start(m);
+        }
+        long long first_cycle = m->cycle;
+        if (m->dcache != NULL)
+            dcache_invalidate(m->dcache);
+        if (m->pipeline != NULL)
+            pipeline_model_start(m->pipeline);
+        if (m->debugger != NULL)
+            debugger_start(m->debugger, m);
+        // --record traces the first run
+        if (run == 0 && record_file != NULL &&
+            (m->recorder = recorder_open(m, record_file, restored == NULL)) == NULL)
+        {
+            record_ok = 0;
+            break;
+        }
+
+        if (forward > 0)
+        {
+            if (ref != NULL)
+            {
+                if (run > 0)
+                    reset_state(ref);
+                pipeline_start(ref);
+            }
+            run_fast_forward(m, ref, forward, window, &ff_stats);
+            pipeline_finish(m);
+            total_cycles += m->cycle - first_cycle;
+            continue;
+        }
 
-    run_pipeline();
+        // Stop at the checkpoint cycle (first run only) and every
+        // snapshot_every cycles on the way
+        long long next_checkpoint = checkpoint_file != NULL && run == 0 ? checkpoint_cycle : LLONG_MAX;
+        long long next_snapshot = snapshot_every > 0 ? m->cycle + snapshot_every : LLONG_MAX;
+        for (;;)
+        {
+            long long until = m->max_cycles;
+            if (next_checkpoint < until)
+                until = next_checkpoint;
+            if (next_snapshot < until)
+                until = next_snapshot;
+            if (!(m->debugger != NULL ? debugger_run(m, until) : pipeline_run(m, until)) || m->cycle >= m->max_cycles)
+                break;
+            if (m->cycle == next_checkpoint)
+            {
+                checkpoint_written = checkpoint_save(m, checkpoint_file);
+                next_checkpoint = LLONG_MAX;
+            }
+            if (m->cycle == next_snapshot)
+            {
+                double taken = now_seconds();
+                Snapshot *snap = snapshot_take(m);
+                if (snap != NULL)
+                {
+                    snapshots = realloc(snapshots, (snapshot_count + 1) * sizeof(Snapshot *));
+                    snapshots[snapshot_count++] = snap;
+                }
+                snapshot_time += now_seconds() - taken;
+                next_snapshot += snapshot_every;
+            }
+        }
+        if (m->recorder != NULL)
+        {
+            record_ok = recorder_close(m->recorder, m, record_file);
+            m->recorder = NULL;
+        }
+        pipeline_finish(m);
+        total_cycles += m->cycle - first_cycle;
+        // Quitting the debugger ends the remaining runs too
+        if (m->debugger != NULL && m->debugger->stop == DEBUG_QUIT)
+            repeat = run + 1;
+        if (m->dcache != NULL)
+        {
+            char what[32];
+            snprintf(what, sizeof(what), "run %d", run + 1);
+            dcache_end_run(m->dcache, what, m->cycle - first_cycle);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    if (checkpoint_file != NULL && !checkpoint_written)
+        fprintf(stderr, "No checkpoint written: the program was not running at cycle %lld\n", checkpoint_cycle);
+    if (repeat > 1)
+    {
+        fprintf(stderr, "runs=%d cycles=%lld time=%.3fs cycles/s=%.0f\n",
+                repeat, total_cycles, elapsed, elapsed > 0 ? total_cycles / elapsed : 0.0);
+    }
+    if (snapshot_every > 0)
+    {
+        // Pages a snapshot shares with the previous one were not copied
+        int copied = 0;
+        for (int i = 0; i < snapshot_count; i++)
+        {
+            for (int p = 0; p < DATA_PAGES; p++)
+                copied += i == 0 || snapshots[i]->pages[p] != snapshots[i - 1]->pages[p];
+        }
+        fprintf(stderr, "snapshots=%d data pages copied=%d of %d snapshot time=%.3fs (%.0f ns/snapshot)\n",
+                snapshot_count, copied, snapshot_count * DATA_PAGES, snapshot_time,
+                snapshot_count ? snapshot_time * 1e9 / snapshot_count : 0.0);
+        for (int i = 0; i < snapshot_count; i++)
+            snapshot_release(snapshots[i]);
+        free(snapshots);
+    }
+    if (forward > 0)
+    {
+        fprintf(stderr, "fast-forward: switches=%d functional instructions=%lld cycles=%lld detailed cycles=%lld\n",
+                ff_stats.switches, ff_stats.functional_instructions, ff_stats.functional_cycles,
+                ff_stats.detailed_cycles);
+        if (ref != NULL)
+            fprintf(stderr, "switch points checked: %s\n", ff_stats.mismatches ? "engines disagree" : "all agree");
+    }
+    if (m->predictor != NULL)
+        predictor_report(m->predictor, total_cycles);
+    if (m->dcache != NULL && repeat > 1)
+        dcache_print(&m->dcache->total, "total", total_cycles);
+    if (m->pipeline != NULL)
+        pipeline_model_report(m->pipeline, m, total_cycles);
+    if (m->memo != NULL)
+        memo_report(m->memo, total_cycles);
+    machine_destroy(ref);
+    snapshot_release(restored);
+    if ((profile_file != NULL && !profile_write(m, profile_file)) || ff_stats.mismatches > 0 || !record_ok)
+    {
+        machine_destroy(m);
+        return 1;
+    }
+    machine_destroy(m);
 
     // load_instruction(0, 0x3045); // MOVI R1, 5 type:I
     // load_instruction(1, 0x3083); // MOVI R2, 3 type:I
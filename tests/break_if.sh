@@ -0,0 +1,32 @@
+#!/bin/sh
+# --break-if values: -128..127 compare the register as signed, 128..255 as
+# unsigned. R1 goes 0, 25, then 200 (-56 as a signed byte) in cycle 4.
+#
+#   tests/break_if.sh [SIMULATOR]     (default: ./main)
+SIM=${1:-./main}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+failed=0
+
+printf 'MOVI R1, 25\nSAL R1, 3\nMOVI R2, 1\nMOVI R3, 1\n' > "$DIR/program.txt"
+
+# expect CONDITION STOP : the run stops with the line STOP, or not at all
+# when STOP is empty
+expect()
+{
+    stop=$("$SIM" --trace=none --break-if="$1" "$DIR/program.txt" < /dev/null 2>/dev/null | grep 'after cycle')
+    if [ "$stop" != "$2" ]; then
+        echo "FAIL --break-if=$1: got \"$stop\", expected \"$2\""
+        failed=1
+    fi
+}
+
+expect 'R1>150' 'R1 > 150 after cycle 4'
+expect 'R1==200' 'R1 == 200 after cycle 4'
+expect 'R1<150' ''
+expect 'R1<-50' 'R1 < -50 after cycle 4'
+expect 'R1>100' ''
+expect 'R1==-56' 'R1 == -56 after cycle 4'
+
+[ $failed -eq 0 ] && echo "break-if: ok"
+exit $failed
@@ -0,0 +1,86 @@
+#!/bin/sh
+# Engine parity: every program below must end in the same final state (the
+# --trace=summary dump) under every engine, and in the functional engine,
+# as under the switch interpreter.
+#
+#   tests/engine_parity.sh [SIMULATOR]     (default: ./main)
+SIM=${1:-./main}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+failed=0
+
+# image FILE [@ADDR] WORD... : write a program image (see "Program Images" in
+# the README) holding the given 16-bit instruction words from ADDR (default 0)
+# on, entry ADDR, no data
+image()
+{
+    file=$1
+    shift
+    at=0
+    case $1 in @*) at=${1#@}; shift ;; esac
+    count=$((at + $#))
+    {
+        printf 'PSIM\001\000\000\000'
+        printf "\\$(printf %03o $((at & 255)))\\$(printf %03o $((at >> 8)))"
+        printf "\\$(printf %03o $((count & 255)))\\$(printf %03o $((count >> 8)))"
+        printf '\000\000\000\000'
+        head -c $((2 * at)) /dev/zero
+        for word in "$@"; do
+            printf "\\$(printf %03o $((word & 255)))\\$(printf %03o $((word >> 8)))"
+        done
+    } > "$file"
+}
+
+check()
+{
+    "$SIM" --engine=switch --trace=summary --max-cycles=1000 "$1" > "$DIR/switch.out" 2>/dev/null
+    for engine in threaded jit memo functional; do
+        # The functional engine runs through --fast-forward
+        options="--engine=$engine"
+        [ $engine = functional ] && options="--engine=threaded --fast-forward=1000"
+        "$SIM" $options --trace=summary --max-cycles=1000 "$1" > "$DIR/$engine.out" 2>/dev/null
+        if ! cmp -s "$DIR/switch.out" "$DIR/$engine.out"; then
+            echo "FAIL $2: $options differs from --engine=switch"
+            failed=1
+        fi
+    done
+}
+
+# A fetched 0xFFFF is the pipeline's NOP: two of them end the program before
+# the MOVI R5/R6 behind them run
+image "$DIR/nop_word.img" 0x3041 0x3082 0x30C3 0xFFFF 0xFFFF 0x3141 0x3181
+check "$DIR/nop_word.img" "0xFFFF word"
+
+# The same behind a loop, so that JIT and memoized blocks start in front of
+# the 0xFFFF words and the functional engine reaches them steadily:
+# R2 = 3; loop: R4 = 1, R6 = R6 + R4, R2 = R2 - 1 (R3 = -1), until R2 = 0
+image "$DIR/nop_word_loop.img" 0x3040 0x3204 0x3083 0x30FF 0x3101 0x0184 0x0083 0x4082 0x7048 \
+    0x3041 0x3042 0x3043 0xFFFF 0xFFFF 0x3141 0x3181
+check "$DIR/nop_word_loop.img" "0xFFFF word after a loop"
+
+# An STR with a negative address writes the last words of instruction memory.
+# Starting at 1000: R1 = 7, STR R1 -32, R2 = 0x30, STR R2 -31 rewrites word
+# 1008 to MOVI R0 7, which must run once fetched. In the second program the
+# high byte lands while word 1008 is already in IF.
+image "$DIR/code_write.img" @1000 0x3047 0xB060 0x3086 0x8083 0xB0A1 0x3241 0x3281 0x32C1
+image "$DIR/code_write_fetched.img" @1000 0x3047 0xB060 0x3086 0x8083 0x3241 0x3281 0xB0A1 0x32C1
+for program in code_write code_write_fetched; do
+    check "$DIR/$program.img" "$program"
+    if ! grep -qx 'R0 = 7' "$DIR/switch.out"; then
+        echo "FAIL $program: the rewritten instruction did not run"
+        failed=1
+    fi
+done
+
+# An STR that rewrites its own word: from 1006, R7 = 0x30, then STR R7 -31
+# turns word 1008 (itself) into MOVI R3 -31. The cycle it runs in still
+# traces it as the store.
+image "$DIR/code_write_self.img" @1006 0x31C6 0x81C3 0xB1E1 0x3101 0x3141
+check "$DIR/code_write_self.img" "code_write_self"
+if ! "$SIM" --trace=full "$DIR/code_write_self.img" 2>/dev/null | grep -qxF 'STR mem[-31] = 48'; then
+    echo "FAIL code_write_self: the store is not traced as a store"
+    failed=1
+fi
+
+[ $failed -eq 0 ] && echo "engine parity: ok"
+exit $failed
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Engine parity under AddressSanitizer and UBSan: builds main.c with both
+# (any report ends the run, so it shows up as a FAIL) and runs
+# tests/engine_parity.sh with that build.
+#
+#   tests/sanitize.sh [CC]     (default: cc)
+CC=${1:-cc}
+TESTS=$(dirname "$0")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+"$CC" -g -O1 -pthread -fsanitize=address,undefined -fno-sanitize-recover=all \
+    -o "$DIR/main" "$TESTS/../main.c" || exit 1
+sh "$TESTS/engine_parity.sh" "$DIR/main"